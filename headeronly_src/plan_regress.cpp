@@ -0,0 +1,58 @@
+// Records or checks query plans and timings of a workload file.
+//
+//   plan_regress <database> <workload.sql> <baseline.db> record
+//   plan_regress <database> <workload.sql> <baseline.db> check [threshold]
+//
+// check exits with 1 when a plan changed or a statement got slower than
+// threshold (default 1.5) times its recorded median or p99.
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include "sqlite3pp.h"
+#include "sqlite3ppprof.h"
+
+using namespace std;
+
+int main(int argc, char* argv[]) {
+    string mode = argc < 5 ? "" : argv[4];
+    if (mode != "record" && mode != "check") {
+        cerr << "usage: " << argv[0] << " <database> <workload.sql> <baseline.db> record|check [threshold]" << endl;
+        return 2;
+    }
+
+    try {
+        sqlite3pp::database db(argv[1], SQLITE_OPEN_READWRITE);
+        ifstream in(argv[2]);
+        if (!in) {
+            cerr << "can't open " << argv[2] << endl;
+            return 2;
+        }
+        auto workload = sqlite3pp::prof::load_workload(in);
+
+        sqlite3pp::prof::harness_options opts;
+        if (argc > 5) opts.slowdown_threshold = atof(argv[5]);
+        sqlite3pp::prof::plan_harness harness(db, opts);
+        auto current = harness.run(workload);
+
+        sqlite3pp::database store(argv[3]);
+        if (mode == "record") {
+            if (sqlite3pp::prof::plan_harness::save(store, current) != SQLITE_OK) {
+                cerr << "can't save baseline: " << store.error_msg() << endl;
+                return 2;
+            }
+            cout << current.size() << " statements recorded" << endl;
+            return 0;
+        }
+
+        auto diffs = harness.compare(sqlite3pp::prof::plan_harness::load(store), current);
+        auto report = sqlite3pp::prof::plan_harness::report(diffs);
+        cout << report;
+        cout << diffs.size() << " statements compared" << endl;
+        return report.empty() ? 0 : 1;
+    } catch (exception& e) {
+        cerr << e.what() << endl;
+        return 2;
+    }
+}
@@ -0,0 +1,94 @@
+// Times an allocation-heavy workload with SQLite's default allocator and
+// then with config::use_pool_allocator().
+//
+//   pool_bench [threads] [rows]
+//
+// Each thread runs inserts, an index build, sorted scans and short-lived
+// statements on its own in-memory database.
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include "sqlite3pp.h"
+#include "sqlite3ppmem.h"
+
+using namespace std;
+
+namespace {
+
+void workload(int rows) {
+    sqlite3pp::database db(":memory:");
+    db.execute("CREATE TABLE t (id INTEGER PRIMARY KEY, name TEXT, score REAL)");
+    {
+        sqlite3pp::transaction xct(db);
+        sqlite3pp::command ins(db, "INSERT INTO t (name, score) VALUES (?, ?)");
+        for (int i = 0; i < rows; ++i) {
+            ins.bind(1, "name-" + to_string(i * 7919 % rows), sqlite3pp::copy);
+            ins.bind(2, i * 0.5);
+            ins.execute();
+            ins.reset();
+        }
+        xct.commit();
+    }
+    db.execute("CREATE INDEX t_name ON t (name)");
+
+    for (int pass = 0; pass < 3; ++pass) {
+        sqlite3pp::query qry(db, "SELECT name, score FROM t ORDER BY score DESC, name");
+        for (auto i = qry.begin(); i != qry.end(); ++i) {
+            (*i).get<string>(0);
+        }
+    }
+    // Statements prepared and finalized one by one, as an ORM would.
+    for (int i = 0; i < rows / 10; ++i) {
+        sqlite3pp::query qry(db, "SELECT score FROM t WHERE name = ?");
+        qry.bind(1, "name-" + to_string(i), sqlite3pp::copy);
+        for (auto r = qry.begin(); r != qry.end(); ++r) {
+        }
+    }
+}
+
+double run(int threads, int rows) {
+    auto start = chrono::steady_clock::now();
+    vector<thread> workers;
+    for (int i = 0; i < threads; ++i) {
+        workers.emplace_back(workload, rows);
+    }
+    for (auto& t : workers) {
+        t.join();
+    }
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    int rows = argc > 2 ? atoi(argv[2]) : 50000;
+    if (threads < 1 || rows < 10) {
+        cerr << "usage: " << argv[0] << " [threads] [rows]" << endl;
+        return 2;
+    }
+
+    try {
+        auto base = run(threads, rows);
+        cout << "default allocator: " << base << " ms" << endl;
+
+        // The allocator can only be replaced while SQLite is shut down.
+        sqlite3_shutdown();
+        if (sqlite3pp::config::use_pool_allocator() != SQLITE_OK) {
+            cerr << "can't install the pool allocator" << endl;
+            return 2;
+        }
+        auto pooled = run(threads, rows);
+        auto st = sqlite3pp::config::pool_statistics();
+        cout << "pool allocator:    " << pooled << " ms (" << base / pooled << "x)" << endl;
+        cout << st.pooled_allocations << " pooled, " << st.fallback_allocations << " fallback allocations, "
+             << st.chunk_bytes << " chunk bytes" << endl;
+        return 0;
+    } catch (exception& e) {
+        cerr << e.what() << endl;
+        return 2;
+    }
+}
@@ -30,11 +30,20 @@
 #define SQLITE3PP_VERSION_MINOR 0
 #define SQLITE3PP_VERSION_PATCH 10
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
 #include <functional>
 #include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <tuple>
+#include <vector>
 
 #ifdef SQLITE3PP_LOADABLE_EXTENSION
 #include <sqlite3ext.h>
@@ -74,10 +83,370 @@ namespace sqlite3pp
     noncopyable& operator=(noncopyable const&) = delete;
   };
 
+  // Point-in-time copy of a latency_histogram. Values are nanoseconds.
+  class histogram_snapshot
+  {
+   public:
+    histogram_snapshot();
+
+    long long count() const;
+    long long sum() const;
+    long long max() const;
+    double mean() const;
+
+    // Upper bound of the bucket holding the p-th percentile (0 <= p <= 100).
+    long long percentile(double p) const;
+
+    histogram_snapshot& operator+=(histogram_snapshot const& other);
+
+   private:
+    friend class latency_histogram;
+
+    std::vector<long long> counts_;
+    long long sum_;
+    long long max_;
+  };
+
+  // Log-linear (HDR-style) histogram with 8 sub-buckets per power of two,
+  // i.e. about 12% relative precision. Recording is wait-free.
+  class latency_histogram : noncopyable
+  {
+   public:
+    static const int sub_bucket_bits = 3;
+    static const int bucket_count = (64 - sub_bucket_bits + 1) << sub_bucket_bits;
+
+    latency_histogram();
+
+    void record(long long value);
+    // Removes one sample previously added by record(value).
+    void erase(long long value);
+
+    histogram_snapshot snapshot() const;
+    void reset();
+
+    static int bucket_index(long long value);
+    static long long bucket_upper_bound(int idx);
+
+   private:
+    std::atomic<long long> counts_[bucket_count];
+    std::atomic<long long> sum_;
+    std::atomic<long long> max_;
+  };
+
+  // Exponential backoff with jitter, bounded by a deadline. Used by
+  // database::set_busy_backoff() and database::run_in_transaction().
+  struct backoff_policy
+  {
+    std::chrono::microseconds initial_delay = std::chrono::microseconds(100);
+    std::chrono::microseconds max_delay = std::chrono::microseconds(20000);
+    double multiplier = 2.0;
+    // Fraction of each delay that is randomized, in [0, 1].
+    double jitter = 0.5;
+    std::chrono::milliseconds deadline = std::chrono::milliseconds(5000);
+  };
+
+  struct retry_policy
+  {
+    int max_attempts = 10;
+    // Use BEGIN IMMEDIATE so that writers serialize at the start of the
+    // transaction instead of failing with SQLITE_BUSY_SNAPSHOT later.
+    bool immediate = true;
+    backoff_policy backoff;
+  };
+
+  struct contention_stats
+  {
+    // Time spent in the busy handler per lock acquisition.
+    histogram_snapshot lock_waits;
+    // Time spent backing off per run_in_transaction() call.
+    histogram_snapshot transaction_waits;
+    long long busy_calls = 0;
+    long long busy_timeouts = 0;
+    long long transaction_retries = 0;
+    long long transaction_failures = 0;
+  };
+
+  class contention_monitor : noncopyable
+  {
+   public:
+    contention_monitor();
+
+    contention_stats stats() const;
+    void reset();
+
+    latency_histogram lock_waits;
+    latency_histogram transaction_waits;
+    std::atomic<long long> busy_calls;
+    std::atomic<long long> busy_timeouts;
+    std::atomic<long long> transaction_retries;
+    std::atomic<long long> transaction_failures;
+  };
+
+  // Counters from sqlite3_stmt_status().
+  struct statement_stats
+  {
+    long long fullscan_steps = 0;
+    long long sorts = 0;
+    long long autoindexes = 0;
+    long long vm_steps = 0;
+    long long reprepares = 0;
+    long long runs = 0;
+    // Current memory use, in bytes; aggregated as the maximum.
+    long long memory_used = 0;
+
+    statement_stats& operator+=(statement_stats const& other);
+    statement_stats& operator-=(statement_stats const& other);
+  };
+
+  // Describes one finished execution of a statement, from its first step()
+  // to SQLITE_DONE, an error, reset() or finalization.
+  struct execution_info
+  {
+    sqlite3_stmt* stmt;
+    std::chrono::nanoseconds elapsed;
+    long long rows;
+    // Counter deltas for this execution.
+    statement_stats stats;
+  };
+
+  // One element of a statement's plan as reported by
+  // sqlite3_stmt_scanstatus(), nested like the EXPLAIN QUERY PLAN output.
+  // Only available when SQLite is built with SQLITE_ENABLE_STMT_SCANSTATUS;
+  // the parent links and cycle counts need sqlite3_stmt_scanstatus_v2().
+  struct scan_node
+  {
+    // Plan node id and parent id; parent is 0 for top-level nodes and for
+    // every node without the v2 interface, where id is the select id.
+    int id = 0;
+    int parent = 0;
+    std::string name;
+    std::string explain;
+    // Number of times the loop was started and rows it visited in total.
+    long long loops = 0;
+    long long rows = 0;
+    // Planner estimate of rows per start of the loop.
+    double estimated_rows = 0.0;
+    // CPU cycles spent in the loop, or -1 if not measured.
+    long long cycles = -1;
+    std::vector<scan_node> children;
+  };
+
+  // Renders scan_status() as an indented plan annotated with actual and
+  // estimated row counts.
+  std::string format_scan_status(std::vector<scan_node> const& nodes);
+
+  // Bounded multi-producer multi-consumer queue. try_push() and try_pop()
+  // never block or allocate; capacity is rounded up to a power of two.
+  template <class T>
+  class ring_buffer : noncopyable
+  {
+   public:
+    explicit ring_buffer(std::size_t capacity);
+
+    bool try_push(T&& value);
+    bool try_pop(T& value);
+
+    std::size_t capacity() const;
+
+   private:
+    struct cell {
+      std::atomic<std::size_t> seq;
+      T value;
+    };
+
+    std::unique_ptr<cell[]> cells_;
+    std::size_t mask_;
+    alignas(64) std::atomic<std::size_t> head_;
+    alignas(64) std::atomic<std::size_t> tail_;
+  };
+
+  // Values from sqlite3_db_status(). Memory sizes are in bytes.
+  struct database_status
+  {
+    long long cache_hit = 0;
+    long long cache_miss = 0;
+    long long cache_write = 0;
+    long long cache_spill = 0;
+    long long cache_used = 0;
+    long long cache_used_shared = 0;
+    long long lookaside_used = 0;
+    long long lookaside_highwater = 0;
+    long long lookaside_hit = 0;
+    long long lookaside_miss_size = 0;
+    long long lookaside_miss_full = 0;
+    long long schema_used = 0;
+    long long stmt_used = 0;
+    long long deferred_fks = 0;
+  };
+
+  // Bytes charged to a connection by the counting allocator installed with
+  // enable_memory_accounting() (sqlite3ppmem.h).
+  struct memory_usage
+  {
+    long long current = 0;
+    long long highwater = 0;
+    long long allocations = 0;
+  };
+
+  // Allocations made while an account is active on a thread are charged to
+  // it, and credited back to it when freed. Accounts come from a process-wide
+  // pool and are never deleted, since live allocations refer to them.
+  class memory_account : noncopyable
+  {
+   public:
+    class scope : noncopyable
+    {
+     public:
+      explicit scope(memory_account* a);
+      ~scope();
+
+     private:
+      memory_account* prev_;
+    };
+
+    static memory_account* acquire();
+    static void release(memory_account* a);
+
+    static memory_account*& active();
+    static std::atomic<bool>& enabled();
+
+    // n bytes were allocated (counted) or resized (not counted).
+    void charge(long long n, bool counted = true);
+    memory_usage usage() const;
+
+   private:
+    struct pool_state {
+      std::mutex mutex;
+      memory_account* free = nullptr;
+    };
+
+    memory_account();
+    static pool_state& pool();
+
+   private:
+    std::atomic<long long> current_;
+    std::atomic<long long> highwater_;
+    std::atomic<long long> allocations_;
+    memory_account* next_free_;
+  };
+
+  enum deadline_mode { progress_check, timer_interrupt };
+
+  // Background thread that calls sqlite3_interrupt() once a deadline passes.
+  // Used by database in the timer_interrupt deadline mode.
+  class interrupt_timer : noncopyable
+  {
+   public:
+    static interrupt_timer& instance();
+    ~interrupt_timer();
+
+    unsigned long long schedule(sqlite3* db, std::chrono::steady_clock::time_point when);
+    // Returns true if the interrupt has already been delivered.
+    bool cancel(unsigned long long id);
+    // The interrupt is only delivered between enter() and leave(), i.e.
+    // while the statement is inside sqlite3_step(). enter() returns false
+    // once the time has passed.
+    bool enter(unsigned long long id);
+    void leave(unsigned long long id);
+
+   private:
+    interrupt_timer();
+    void run();
+
+   private:
+    struct entry {
+      sqlite3* db;
+      std::chrono::steady_clock::time_point when;
+      bool fired;
+      bool active;
+    };
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::map<unsigned long long, entry> entries_;
+    unsigned long long next_id_;
+    bool stop_;
+    std::thread thread_;
+  };
+
+  enum journal_mode { journal_delete, journal_truncate, journal_persist, journal_memory, journal_wal, journal_off };
+  enum synchronous_mode { synchronous_off, synchronous_normal, synchronous_full, synchronous_extra };
+  enum temp_store_mode { temp_store_default, temp_store_file, temp_store_memory };
+
+  enum limit_category {
+    limit_length = SQLITE_LIMIT_LENGTH,
+    limit_sql_length = SQLITE_LIMIT_SQL_LENGTH,
+    limit_column = SQLITE_LIMIT_COLUMN,
+    limit_expr_depth = SQLITE_LIMIT_EXPR_DEPTH,
+    limit_compound_select = SQLITE_LIMIT_COMPOUND_SELECT,
+    limit_vdbe_op = SQLITE_LIMIT_VDBE_OP,
+    limit_function_arg = SQLITE_LIMIT_FUNCTION_ARG,
+    limit_attached = SQLITE_LIMIT_ATTACHED,
+    limit_like_pattern_length = SQLITE_LIMIT_LIKE_PATTERN_LENGTH,
+    limit_variable_number = SQLITE_LIMIT_VARIABLE_NUMBER,
+    limit_trigger_depth = SQLITE_LIMIT_TRIGGER_DEPTH,
+    limit_worker_threads = SQLITE_LIMIT_WORKER_THREADS
+  };
+
+  // A PRAGMA value that is either given or left alone.
+  template <class T>
+  struct pragma_value
+  {
+    pragma_value() : set(false), value() {}
+    pragma_value(T v) : set(true), value(v) {}
+
+    bool set;
+    T value;
+  };
+
+  // Connection tuning; see database::apply_pragmas(). cache_size follows
+  // PRAGMA cache_size: pages if positive, KiB if negative.
+  struct pragma_settings
+  {
+    pragma_value<journal_mode> journal;
+    pragma_value<synchronous_mode> synchronous;
+    pragma_value<long long int> cache_size;
+    pragma_value<long long int> mmap_size;
+    pragma_value<temp_store_mode> temp_store;
+    pragma_value<int> page_size;
+    pragma_value<int> wal_autocheckpoint;
+    pragma_value<int> busy_timeout;
+    pragma_value<int> threads;
+
+    // WAL with NORMAL sync, a 64 MiB cache and a 5 s busy timeout.
+    static pragma_settings oltp();
+    // No durability: in-memory journal, no syncs, a 256 MiB cache and
+    // sorter threads. A crash can corrupt the database.
+    static pragma_settings bulk_load();
+    // A 1 GiB memory map, a 128 MiB cache and sorter threads.
+    static pragma_settings read_mostly_analytics();
+  };
+
+  enum deserialize_mode { deserialize_copy, deserialize_read_only };
+
+  // A copy of a database from database::serialize().
+  class database_image
+  {
+   public:
+    database_image();
+
+    unsigned char const* data() const;
+    std::size_t size() const;
+    bool empty() const;
+
+   private:
+    friend class database;
+
+    std::unique_ptr<unsigned char, void (*)(void*)> data_;
+    std::size_t size_;
+  };
+
   class database : noncopyable
   {
     friend class statement;
+    friend class query;
     friend class database_error;
+    friend class change_feed;
     friend class ext::function;
     friend class ext::aggregate;
     friend database ext::borrow(sqlite3* pdb);
@@ -85,10 +454,14 @@ namespace sqlite3pp
    public:
     using busy_handler = std::function<int (int)>;
     using commit_handler = std::function<int ()>;
+    using committed_handler = std::function<void ()>;
     using rollback_handler = std::function<void ()>;
     using update_handler = std::function<void (int, char const*, char const*, long long int)>;
     using authorize_handler = std::function<int (int, char const*, char const*, char const*, char const*)>;
     using backup_handler = std::function<void (int, int, int)>;
+    using progress_handler = std::function<int ()>;
+    using trace_handler = std::function<int (unsigned, void*, void*)>;
+    using execution_handler = std::function<void (execution_info const&)>;
 
     explicit database(char const* dbname = nullptr, int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, const char* vfs = nullptr);
 
@@ -108,11 +481,38 @@ namespace sqlite3pp
 
     long long int last_insert_rowid() const;
 
+    // The file of a schema; empty for in-memory and temporary databases.
+    char const* filename(char const* schema = "main") const;
+
     int enable_foreign_keys(bool enable = true);
     int enable_triggers(bool enable = true);
     int enable_extended_result_codes(bool enable = true);
+    // With shared cache, makes step(), prepare() and execute() wait on
+    // sqlite3_unlock_notify() instead of returning SQLITE_LOCKED. Needs an
+    // SQLite built with, and code compiled with, SQLITE_ENABLE_UNLOCK_NOTIFY;
+    // otherwise it returns SQLITE_ERROR.
+    int enable_unlock_notify(bool enable = true);
 
     int changes() const;
+    // False while a transaction is open.
+    bool autocommit() const;
+
+    // reset clears the counters and high-water marks that SQLite resets.
+    database_status status(bool reset = false) const;
+
+    // Lookaside allocator for small objects (SQLITE_DBCONFIG_LOOKASIDE).
+    // buf, if given, must hold slot_size * slots bytes and outlive the
+    // connection; otherwise SQLite allocates it. Call right after opening,
+    // while no lookaside memory is in use. status() reports the hits and
+    // misses.
+    int configure_lookaside(int slot_size, int slots, void* buf = nullptr);
+
+    // Frees as much cache memory as possible (sqlite3_db_release_memory).
+    int release_memory();
+
+    // Memory allocated on behalf of this connection; zero unless
+    // enable_memory_accounting() was called before it was opened.
+    memory_usage memory() const;
 
     int error_code() const;
     int extended_error_code() const;
@@ -121,17 +521,126 @@ namespace sqlite3pp
     int execute(char const* sql);
     int executef(char const* sql, ...);
 
+    // Replaces any busy handler.
     int set_busy_timeout(int ms);
 
+    // Typed PRAGMAs. journal mode changes that SQLite refuses, e.g. WAL on
+    // an in-memory database, return SQLITE_ERROR.
+    int set_journal_mode(journal_mode mode);
+    int set_synchronous(synchronous_mode mode);
+    int set_cache_size(long long int size);
+    int set_mmap_size(long long int bytes);
+    int set_temp_store(temp_store_mode mode);
+    int set_page_size(int bytes);
+    int set_wal_autocheckpoint(int pages);
+    int set_threads(int n);
+
+    // Copies the content of a schema into an image; empty on failure or
+    // when SQLite is built with SQLITE_OMIT_DESERIALIZE.
+    database_image serialize(char const* schema = "main") const;
+    // Replaces the content of a schema with an image. deserialize_copy
+    // copies it into memory that grows as the database is written;
+    // deserialize_read_only uses the data in place, so it must outlive
+    // the connection.
+    int deserialize(void const* data, std::size_t size, deserialize_mode mode = deserialize_copy, char const* schema = "main");
+    // The same for a database file. deserialize_read_only maps the file
+    // without copying it and keeps the mapping until the schema is
+    // replaced, detached with detach(), or the connection is fully closed.
+    // The file must not be truncated or rewritten meanwhile: reading pages
+    // past the new end of a mapped file raises SIGBUS.
+    int deserialize_file(char const* path, deserialize_mode mode = deserialize_copy, char const* schema = "main");
+
+    // Run-time limits (sqlite3_limit). SQLite silently caps values at its
+    // compile-time maximums, e.g. SQLITE_MAX_WORKER_THREADS, so read the
+    // limit back to see what took effect. set_limit returns the old value.
+    int limit(limit_category category) const;
+    int set_limit(limit_category category, int value);
+
+    // The current value of every setting in pragma_settings.
+    pragma_settings pragmas() const;
+    // Applies the given settings one by one. If one fails, its error is
+    // returned and an attempt is made to restore those already changed;
+    // restored, if given, receives the result of that attempt (SQLITE_OK
+    // when nothing had to be restored). busy_timeout replaces any busy
+    // handler.
+    int apply_pragmas(pragma_settings const& settings, int* restored = nullptr);
+
     void set_busy_handler(busy_handler h);
     void set_commit_handler(commit_handler h);
+    // Called on the executing thread once a transaction has committed,
+    // when the statement that committed it returns. Unlike the commit
+    // handler, it is not called for a COMMIT that then fails, e.g. with
+    // SQLITE_BUSY. Only statements run through this library are noticed.
+    void set_committed_handler(committed_handler h);
     void set_rollback_handler(rollback_handler h);
     void set_update_handler(update_handler h);
     void set_authorize_handler(authorize_handler h);
+    // Called about every n VM instructions; a non-zero result interrupts
+    // the running statement.
+    void set_progress_handler(progress_handler h, int n = 1000);
+    // mask is a combination of SQLITE_TRACE_* flags; the handler gets the
+    // event type and the P and X arguments of sqlite3_trace_v2.
+    void set_trace_handler(unsigned mask, trace_handler h);
+    // Called on the executing thread after each statement execution that
+    // took at least threshold.
+    void set_execution_handler(execution_handler h, std::chrono::nanoseconds threshold = std::chrono::nanoseconds(0));
+
+    // Installs a busy handler that sleeps with exponential backoff and
+    // jitter until the policy deadline, recording lock waits.
+    void set_busy_backoff(backoff_policy const& policy = backoff_policy());
+
+    // Runs fn() inside a transaction and commits it. fn returns an SQLite
+    // result code; if it, BEGIN or COMMIT fails with SQLITE_BUSY (including
+    // SQLITE_BUSY_SNAPSHOT), the transaction is rolled back and retried.
+    template <class F>
+    int run_in_transaction(F fn, retry_policy const& policy = retry_policy());
+
+    contention_stats contention() const;
+    void reset_contention();
+
+    // When enabled, every statement adds the counters of each execution
+    // to a per-SQL registry when it finishes. Entries are keyed on the
+    // sqlite3_sql() text as written, so statements differing only in
+    // whitespace or case are counted separately.
+    void enable_statement_stats(bool enable = true);
+    std::map<std::string, statement_stats> statement_stats_by_sql() const;
+    // For each registry entry, its first execution with the bound
+    // parameters expanded (sqlite3_expanded_sql).
+    std::map<std::string, std::string> statement_samples() const;
+    void reset_statement_stats();
+
+    // A running statement whose deadline passes is interrupted: step()
+    // returns SQLITE_INTERRUPT and the statement is reset. Deadlines are
+    // armed once per execution and only checked while that statement is
+    // stepping. progress_check polls the clock every vm_interval VM
+    // instructions; timer_interrupt calls sqlite3_interrupt() from a shared
+    // timer thread, which also aborts the other statements running on the
+    // connection at that moment, e.g. an outer query of a nested one.
+    void set_deadline_mode(deadline_mode mode, int vm_interval = 1000);
+    // Connection-wide deadline, e.g. for a whole transaction.
+    void set_deadline(std::chrono::steady_clock::time_point deadline);
+    void clear_deadline();
 
    private:
-    database(sqlite3* pdb) : db_(pdb), borrowing_(true) {}
+    database(sqlite3* pdb);
     void rebind_handlers();
+    contention_monitor& monitor();
+
+    int wait_for_unlock();
+    int exec_impl(char const* sql);
+    int deserialize_impl(unsigned char* data, sqlite3_int64 size, unsigned flags, char const* schema);
+
+    static int progress_impl(void* p);
+    void install_progress_handler();
+    static int commit_impl(void* p);
+    static void rollback_impl(void* p);
+    void install_commit_hooks();
+    void check_committed();
+    bool has_deadline() const;
+    // Returns the timer id in timer_interrupt mode, 0 otherwise; pass it
+    // back to disarm_deadline().
+    unsigned long long arm_deadline(std::chrono::steady_clock::time_point deadline);
+    void disarm_deadline(unsigned long long timer_id);
 
    private:
     sqlite3* db_;
@@ -142,6 +651,137 @@ namespace sqlite3pp
     rollback_handler rh_;
     update_handler uh_;
     authorize_handler ah_;
+    progress_handler ph_;
+    int pn_;
+    int pinterval_;
+    int pticks_;
+    trace_handler th_;
+    unsigned tmask_;
+    execution_handler xh_;
+    std::chrono::nanoseconds xthreshold_;
+    committed_handler cdh_;
+    bool committing_;
+
+    std::shared_ptr<contention_monitor> cm_;
+
+    bool sreg_enabled_;
+    std::map<std::string, statement_stats> sreg_;
+    std::map<std::string, std::string> sreg_samples_;
+
+    bool unotify_;
+
+   protected:
+    // Only single_thread_database takes ownership; the owner is read by
+    // statements on whatever thread they run.
+    std::atomic<bool> owned_;
+    std::atomic<std::thread::id> owner_;
+
+   private:
+
+    deadline_mode dmode_;
+    int dinterval_;
+    std::chrono::steady_clock::time_point deadline_;
+    // Executions armed in progress_check mode, and the deadline of the one
+    // inside sqlite3_step(), which the progress handler checks.
+    int armed_;
+    std::chrono::steady_clock::time_point stepping_;
+
+    memory_account* macct_;
+
+    // Images of deserialize_file() in use, by schema. disconnect() hands
+    // them to the connection, which may outlive it as a zombie.
+    std::map<std::string, std::shared_ptr<void const>> images_;
+  };
+
+  // Connection opened with SQLITE_OPEN_NOMUTEX, so SQLite skips the
+  // connection mutex on every call. It is owned by the constructing thread.
+  class single_thread_database : public database
+  {
+   public:
+    explicit single_thread_database(char const* dbname = nullptr, int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, const char* vfs = nullptr);
+
+    // Debug builds make statement::step() and bind() return SQLITE_MISUSE
+    // on threads other than the owner. hand_off() passes the connection
+    // on; with no target it stays in transit until the receiving thread
+    // calls adopt().
+    void adopt();
+    void hand_off(std::thread::id to = std::thread::id());
+    bool owned_by_this_thread() const;
+  };
+
+  // Progress handler that hands the thread to other tasks, so that long
+  // queries do not starve short ones running on the same thread:
+  //   db.set_progress_handler(cooperative_yield([&] { loop.yield(); }), 1000);
+  // Copies share their statistics.
+  class cooperative_yield
+  {
+   public:
+    using yield_function = std::function<void ()>;
+
+    struct stats {
+      long long yields;
+      // Time spent inside the yield function, in nanoseconds.
+      histogram_snapshot yield_times;
+    };
+
+    explicit cooperative_yield(yield_function f = yield_function());
+
+    int operator()();
+
+    stats statistics() const;
+    void reset();
+
+   private:
+    struct state {
+      latency_histogram yield_times;
+      std::atomic<long long> yields;
+    };
+
+    yield_function f_;
+    std::shared_ptr<state> state_;
+  };
+
+  struct row_change
+  {
+    // SQLITE_INSERT, SQLITE_UPDATE or SQLITE_DELETE.
+    int op;
+    std::string dbname;
+    std::string table;
+    long long rowid;
+  };
+
+  // Stages row changes from the update hook and publishes them as one batch
+  // per committed transaction into a bounded queue, once the commit has
+  // completed (see database::set_committed_handler()); rolled back changes
+  // are discarded. The writer never blocks: when the queue is full the
+  // batch is counted in dropped().
+  class change_feed : noncopyable
+  {
+   public:
+    using batch = std::vector<row_change>;
+
+    explicit change_feed(std::size_t capacity = 1024);
+
+    // Installs the connection's update, rollback and committed handlers;
+    // returns SQLITE_MISUSE if any of them is already set.
+    int attach(database& db);
+
+    bool try_pop(batch& b);
+    // Waits up to timeout for a batch; for consumer threads.
+    bool pop(batch& b, std::chrono::milliseconds timeout);
+
+    long long dropped() const;
+
+   private:
+    struct state {
+      explicit state(std::size_t capacity) : queue(capacity), dropped(0) {}
+      ring_buffer<batch> queue;
+      std::atomic<long long> dropped;
+      std::mutex mutex;
+      std::condition_variable cv;
+    };
+
+    std::shared_ptr<state> state_;
   };
 
   class database_error : public std::runtime_error
@@ -151,8 +791,100 @@ namespace sqlite3pp
     explicit database_error(database& db);
   };
 
+  // Thrown instead of database_error when a statement ran past its deadline.
+  class deadline_exceeded : public database_error
+  {
+   public:
+    explicit deadline_exceeded(char const* msg = "deadline exceeded");
+  };
+
   enum copy_semantic { copy, nocopy };
 
+  // Non-owning views; C++11 lacks std::string_view.
+  struct text_view
+  {
+    char const* data;
+    std::size_t size;
+
+    std::string str() const;
+  };
+
+  struct blob_view
+  {
+    void const* data;
+    std::size_t size;
+  };
+
+  // A dynamically typed column value. Text shorter than inline_capacity
+  // bytes and blobs up to inline_capacity bytes are stored in the object
+  // itself; longer ones are copied to the heap. With nocopy the value only
+  // refers to the caller's data, which must outlive it.
+  class value
+  {
+   public:
+    static const std::size_t inline_capacity = 16;
+
+    value();
+    value(null_type);
+    value(int v);
+    value(long v);
+    value(long long int v);
+    value(unsigned v);
+    value(unsigned long v);
+    // Values above the long long range are stored as SQLITE_FLOAT.
+    value(unsigned long long v);
+    value(double v);
+    value(char const* s, copy_semantic fcopy = copy);
+    value(std::string const& s, copy_semantic fcopy = copy);
+    value(text_view s, copy_semantic fcopy = copy);
+    value(blob_view b, copy_semantic fcopy = copy);
+    value(value const& other);
+    value(value&& other);
+    ~value();
+
+    value& operator=(value const& other);
+    value& operator=(value&& other);
+
+    // A SQLITE_* fundamental type.
+    int type() const;
+    bool is_null() const;
+    // True if the text or blob lives in the object, not on the heap.
+    bool is_inline() const;
+    bool is_borrowed() const;
+
+    // Integers and doubles convert to each other; other types give 0.
+    long long int as_int() const;
+    double as_double() const;
+    // The bytes of a text or blob. Owned text is NUL-terminated.
+    text_view as_text() const;
+    blob_view as_blob() const;
+
+   private:
+    enum storage { local, heap, borrowed };
+
+    void assign(int type, void const* data, std::size_t n, copy_semantic fcopy);
+    void assign(value const& other);
+    void steal(value& other);
+    void release();
+
+    char const* data() const;
+    std::size_t size() const;
+
+   private:
+    int type_;
+    unsigned char storage_;
+    unsigned char size_;
+    union {
+      long long int i_;
+      double d_;
+      struct {
+        char const* data;
+        std::size_t size;
+      } ext_;
+      char buf_[inline_capacity];
+    };
+  };
+
   class statement : noncopyable
   {
    public:
@@ -168,6 +900,7 @@ namespace sqlite3pp
     int bind(int idx, char16_t const* value, copy_semantic fcopy);
     int bind(int idx);
     int bind(int idx, null_type);
+    int bind(int idx, value const& v, copy_semantic fcopy = copy);
 
     int bind(char const* name, int value);
     int bind(char const* name, double value);
@@ -178,11 +911,28 @@ namespace sqlite3pp
     int bind(char const* name, char16_t const* value, copy_semantic fcopy);
     int bind(char const* name);
     int bind(char const* name, null_type);
+    int bind(char const* name, value const& v, copy_semantic fcopy = copy);
 
     int step();
     int reset();
     int clear_bindings();
 
+    // Limits each execution, from the first step() after a reset, to ms
+    // milliseconds. 0 disables the limit.
+    void set_timeout(int ms);
+    // True if the last step() was interrupted by a deadline.
+    bool timed_out() const;
+
+    // Counters accumulated since the statement was prepared or the
+    // counters were last reset. The statement registry and execution
+    // handlers get per-execution deltas, so they are not affected.
+    statement_stats stats(bool reset = false) const;
+
+    // Per-loop counters of the last executions, as a tree; empty unless
+    // SQLITE_ENABLE_STMT_SCANSTATUS is defined.
+    std::vector<scan_node> scan_status() const;
+    void reset_scan_status();
+
    protected:
     explicit statement(database& db, char const* stmt = nullptr);
     ~statement();
@@ -190,10 +940,30 @@ namespace sqlite3pp
     int prepare_impl(char const* stmt);
     int finish_impl(sqlite3_stmt* stmt);
 
+    bool check_owner() const;
+    int step_impl();
+    void begin_execution();
+    void end_execution();
+
    protected:
     database& db_;
     sqlite3_stmt* stmt_;
     char const* tail_;
+
+    std::chrono::milliseconds timeout_;
+    // The deadline of the current execution, if armed.
+    std::chrono::steady_clock::time_point deadline_;
+    bool armed_;
+    unsigned long long timer_id_;
+    bool running_;
+    bool timed_out_;
+
+    bool observed_;
+    bool registered_;
+    std::chrono::steady_clock::time_point started_;
+    long long rows_;
+    // Counters at the start of the execution; see stats().
+    mutable statement_stats begin_stats_;
   };
 
   class command : public statement
@@ -237,6 +1007,14 @@ namespace sqlite3pp
         ++idx_;
         return *this;
       }
+      bindstream& operator << (sqlite3pp::value const& value) {
+        auto rc = cmd_.bind(idx_, value, copy);
+        if (rc != SQLITE_OK) {
+          throw database_error(cmd_.db_);
+        }
+        ++idx_;
+        return *this;
+      }
       bindstream& operator << (std::nullptr_t value) {
         auto rc = cmd_.bind(idx_);
         if (rc != SQLITE_OK) {
@@ -259,6 +1037,89 @@ namespace sqlite3pp
     int execute_all();
   };
 
+  // Bump allocator. Everything allocated from it is released at once by
+  // reset(), which keeps the blocks for reuse, or by the destructor.
+  class arena : noncopyable
+  {
+   public:
+    explicit arena(std::size_t block_size = 64 * 1024);
+    ~arena();
+
+    void* allocate(std::size_t n, std::size_t align = alignof(std::max_align_t));
+    char const* copy(void const* data, std::size_t n);
+
+    void reset();
+
+    std::size_t bytes_used() const;
+    std::size_t bytes_reserved() const;
+
+   private:
+    struct block {
+      block* next;
+      std::size_t size;
+    };
+
+    block* new_block(std::size_t min_size);
+    void enter(block* b);
+    char* fit(std::size_t n, std::size_t align) const;
+
+   private:
+    std::size_t block_size_;
+    block* head_;
+    block* current_;
+    char* cur_;
+    char* end_;
+    std::size_t used_;
+    std::size_t reserved_;
+  };
+
+  // One column of a materialized row. type is a SQLITE_* fundamental type.
+  struct cell
+  {
+    int type;
+    union {
+      long long int i;
+      double d;
+      text_view text;
+      blob_view blob;
+    };
+  };
+
+  // A result set copied into an arena; see query::materialize(). It is
+  // valid until the arena is reset or destroyed.
+  class result_set
+  {
+   public:
+    class row
+    {
+     public:
+      row(cell const* cells, int n);
+
+      int size() const;
+      cell const& operator[](int idx) const;
+
+     private:
+      cell const* cells_;
+      int n_;
+    };
+
+    result_set();
+
+    std::size_t size() const;
+    int column_count() const;
+    text_view column_name(int idx) const;
+
+    row operator[](std::size_t idx) const;
+
+   private:
+    friend class query;
+
+    text_view* names_;
+    cell* cells_;
+    std::size_t rows_;
+    int cols_;
+  };
+
   class query : public statement
   {
    public:
@@ -282,7 +1143,8 @@ namespace sqlite3pp
         int idx_;
       };
 
-      explicit rows(sqlite3_stmt* stmt);
+      // Type conversions that allocate are charged to macct.
+      explicit rows(sqlite3_stmt* stmt, memory_account* macct = nullptr);
 
       int data_count() const;
       int column_type(int idx) const;
@@ -300,6 +1162,11 @@ namespace sqlite3pp
 
       getstream getter(int idx = 0);
 
+      // get<value>() and the default copy text and blobs that do not fit
+      // inline. With nocopy they are borrowed from the statement and valid
+      // only until the next step, reset or finish.
+      sqlite3pp::value get_value(int idx, copy_semantic fcopy = copy) const;
+
      private:
       int get(int idx, int) const;
       double get(int idx, double) const;
@@ -309,9 +1176,11 @@ namespace sqlite3pp
       void const* get(int idx, void const*) const;
       char16_t const* get(int idx, char16_t const*) const;
       null_type get(int idx, null_type) const;
+      sqlite3pp::value get(int idx, sqlite3pp::value) const;
 
      private:
       sqlite3_stmt* stmt_;
+      memory_account* macct_;
     };
 
     class query_iterator
@@ -349,6 +1218,10 @@ namespace sqlite3pp
 
     iterator begin();
     iterator end();
+
+    // Steps through the remaining rows and copies them into a, so that
+    // freeing the result is a.reset(). Throws like the iterators do.
+    result_set materialize(arena& a);
   };
 
   class transaction : noncopyable
@@ -360,9 +1233,76 @@ namespace sqlite3pp
     int commit();
     int rollback();
 
+    // Sets a deadline ms milliseconds from now for everything executed on
+    // the connection until the transaction ends.
+    void set_timeout(int ms);
+
+   private:
+    void end();
+
    private:
     database* db_;
     bool fcommit_;
+    bool fdeadline_;
+  };
+
+  // Applies pragma settings for its lifetime and tries to restore the
+  // previous values of those it changed when destroyed. Throws
+  // database_error if the settings cannot be applied.
+  class pragma_scope : noncopyable
+  {
+   public:
+    pragma_scope(database& db, pragma_settings const& settings);
+    ~pragma_scope();
+
+    // Restores the settings early and returns the SQLite result code of
+    // the first one that could not be restored. The destructor cannot
+    // report failures, so call this to check.
+    int revert();
+
+   private:
+    database* db_;
+    pragma_settings saved_;
+  };
+
+  // Defers index maintenance while loading tables in the main schema. It
+  // applies pragma_settings::bulk_load(), raises limit_worker_threads to
+  // the given number of sorter threads and drops the indexes on the
+  // tables; finish(), or the destructor, recreates them and restores the
+  // previous settings. UNIQUE and partial indexes, and those backing
+  // constraints, are kept. Throws database_error if a transaction is open,
+  // since the settings cannot change inside one.
+  //
+  // The dropped definitions are saved in a sqlite3pp_bulk_load table in
+  // the same transaction as the DROPs, and removed once the indexes are
+  // back, so that recover() can rebuild them after a crash.
+  class bulk_load_session : noncopyable
+  {
+   public:
+    bulk_load_session(database& db, std::vector<std::string> const& tables, int threads = 4);
+    // Rolls back a transaction left open before recreating the indexes,
+    // and restores the settings even if that fails; the indexes then stay
+    // dropped until recover(). Call finish() first to see errors.
+    ~bulk_load_session();
+
+    // Recreates the indexes in one transaction and restores the settings.
+    // If an index fails, the transaction is rolled back, the session stays
+    // open so that finish() can be called again, and the error is returned.
+    int finish();
+
+    // CREATE INDEX statements of the dropped indexes.
+    std::vector<std::string> const& index_sql() const;
+
+    // Recreates the indexes of a session that never finished, e.g. at
+    // startup, in one transaction. Call it while no session is open.
+    static int recover(database& db);
+
+   private:
+    database* db_;
+    pragma_scope pragmas_;
+    int threads_;
+    std::vector<std::string> names_;
+    std::vector<std::string> indexes_;
   };
 
 } // namespace sqlite3pp
@@ -22,8 +22,24 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 // THE SOFTWARE.
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <limits>
 #include <memory>
+#include <new>
+#include <random>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace sqlite3pp
 {
@@ -38,18 +54,6 @@ namespace sqlite3pp
       return (*h)(cnt);
     }
 
-    int commit_hook_impl(void* p)
-    {
-      auto h = static_cast<database::commit_handler*>(p);
-      return (*h)();
-    }
-
-    void rollback_hook_impl(void* p)
-    {
-      auto h = static_cast<database::rollback_handler*>(p);
-      (*h)();
-    }
-
     void update_hook_impl(void* p, int opcode, char const* dbname, char const* tablename, long long int rowid)
     {
       auto h = static_cast<database::update_handler*>(p);
@@ -62,9 +66,680 @@ namespace sqlite3pp
       return (*h)(evcode, p1, p2, dbname, tvname);
     }
 
+    int trace_impl(unsigned type, void* p, void* arg1, void* arg2)
+    {
+      auto h = static_cast<database::trace_handler*>(p);
+      return (*h)(type, arg1, arg2);
+    }
+
+#ifdef SQLITE_ENABLE_UNLOCK_NOTIFY
+    struct unlock_notification
+    {
+      bool fired;
+      std::mutex mutex;
+      std::condition_variable cv;
+    };
+
+    void unlock_notify_impl(void** args, int nargs)
+    {
+      for (int i = 0; i < nargs; ++i) {
+        auto un = static_cast<unlock_notification*>(args[i]);
+        std::lock_guard<std::mutex> lock(un->mutex);
+        un->fired = true;
+        un->cv.notify_all();
+      }
+    }
+#endif
+
+    inline statement_stats stmt_status(sqlite3_stmt* stmt, bool reset)
+    {
+      statement_stats s;
+      if (stmt) {
+        auto r = reset ? 1 : 0;
+        s.fullscan_steps = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, r);
+        s.sorts = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_SORT, r);
+        s.autoindexes = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_AUTOINDEX, r);
+        s.vm_steps = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, r);
+        s.reprepares = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_REPREPARE, r);
+        s.runs = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_RUN, r);
+        s.memory_used = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_MEMUSED, 0);
+      }
+      return s;
+    }
+
+    inline bool is_shared_cache_locked(sqlite3* db, int rc)
+    {
+      return (rc & 0xff) == SQLITE_LOCKED && sqlite3_extended_errcode(db) == SQLITE_LOCKED_SHAREDCACHE;
+    }
+
+    inline bool is_busy(int rc)
+    {
+      return (rc & 0xff) == SQLITE_BUSY;
+    }
+
+    inline unsigned backoff_seed()
+    {
+      return static_cast<unsigned>(std::chrono::steady_clock::now().time_since_epoch().count());
+    }
+
+    inline std::chrono::nanoseconds backoff_delay(backoff_policy const& policy, int attempt, std::minstd_rand& rng)
+    {
+      double base = policy.initial_delay.count() * std::pow(policy.multiplier, std::min(attempt, 62));
+      base = std::min(base, static_cast<double>(policy.max_delay.count()));
+      auto u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+      auto us = base * (1.0 - policy.jitter * u);
+      return std::chrono::nanoseconds(static_cast<long long>(us * 1000));
+    }
+
+    class backoff_busy_handler
+    {
+     public:
+      backoff_busy_handler(backoff_policy const& policy, std::shared_ptr<contention_monitor> cm)
+        : policy_(policy), cm_(cm), rng_(backoff_seed()), recorded_(-1)
+      {
+      }
+
+      int operator()(int cnt)
+      {
+        auto now = std::chrono::steady_clock::now();
+        if (cnt == 0) {
+          start_ = now;
+          recorded_ = -1;
+        }
+        ++cm_->busy_calls;
+
+        auto elapsed = now - start_;
+        if (elapsed >= policy_.deadline) {
+          ++cm_->busy_timeouts;
+          update(elapsed);
+          return 0;
+        }
+
+        auto delay = std::min<std::chrono::nanoseconds>(backoff_delay(policy_, cnt, rng_), policy_.deadline - elapsed);
+        std::this_thread::sleep_for(delay);
+        update(std::chrono::steady_clock::now() - start_);
+        return 1;
+      }
+
+     private:
+      // Each busy episode is one sample, updated as the wait grows.
+      void update(std::chrono::steady_clock::duration waited)
+      {
+        if (recorded_ >= 0) {
+          cm_->lock_waits.erase(recorded_);
+        }
+        recorded_ = std::chrono::duration_cast<std::chrono::nanoseconds>(waited).count();
+        cm_->lock_waits.record(recorded_);
+      }
+
+     private:
+      backoff_policy policy_;
+      std::shared_ptr<contention_monitor> cm_;
+      std::minstd_rand rng_;
+      std::chrono::steady_clock::time_point start_;
+      long long recorded_;
+    };
+
+    char const* const journal_mode_names[] = { "delete", "truncate", "persist", "memory", "wal", "off" };
+
+    // Runs a PRAGMA and returns the first column of its first row, if any.
+    int pragma_impl(sqlite3* db, std::string const& sql, std::string* result = nullptr)
+    {
+      sqlite3_stmt* stmt = nullptr;
+      auto rc = sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr);
+      if (rc != SQLITE_OK) return rc;
+      rc = sqlite3_step(stmt);
+      if (rc == SQLITE_ROW) {
+        if (result) {
+          auto text = reinterpret_cast<char const*>(sqlite3_column_text(stmt, 0));
+          *result = text ? text : "";
+        }
+        rc = SQLITE_DONE;
+      }
+      sqlite3_finalize(stmt);
+      return rc == SQLITE_DONE ? SQLITE_OK : rc;
+    }
+
+    long long int pragma_int(sqlite3* db, char const* name)
+    {
+      std::string result;
+      pragma_impl(db, std::string("PRAGMA ") + name, &result);
+      return std::strtoll(result.c_str(), nullptr, 10);
+    }
+
+    // Stops at the first failure; rc is that failure or SQLITE_OK.
+    int apply_pragmas_impl(database& db, pragma_settings const& s)
+    {
+      int rc = SQLITE_OK;
+      // The page size cannot change once the database is in WAL mode.
+      if (rc == SQLITE_OK && s.page_size.set) rc = db.set_page_size(s.page_size.value);
+      if (rc == SQLITE_OK && s.journal.set) rc = db.set_journal_mode(s.journal.value);
+      if (rc == SQLITE_OK && s.synchronous.set) rc = db.set_synchronous(s.synchronous.value);
+      if (rc == SQLITE_OK && s.cache_size.set) rc = db.set_cache_size(s.cache_size.value);
+      if (rc == SQLITE_OK && s.mmap_size.set) rc = db.set_mmap_size(s.mmap_size.value);
+      if (rc == SQLITE_OK && s.temp_store.set) rc = db.set_temp_store(s.temp_store.value);
+      if (rc == SQLITE_OK && s.wal_autocheckpoint.set) rc = db.set_wal_autocheckpoint(s.wal_autocheckpoint.value);
+      if (rc == SQLITE_OK && s.busy_timeout.set) rc = db.set_busy_timeout(s.busy_timeout.value);
+      if (rc == SQLITE_OK && s.threads.set) rc = db.set_threads(s.threads.value);
+      return rc;
+    }
+
+    // Reads a whole file into memory from sqlite3_malloc64().
+    unsigned char* read_file(char const* path, sqlite3_int64& size)
+    {
+      auto f = std::fopen(path, "rb");
+      if (!f) return nullptr;
+      unsigned char* buf = nullptr;
+      if (std::fseek(f, 0, SEEK_END) == 0) {
+        auto end = std::ftell(f);
+        if (end >= 0 && std::fseek(f, 0, SEEK_SET) == 0) {
+          size = end;
+          buf = static_cast<unsigned char*>(sqlite3_malloc64(size > 0 ? size : 1));
+          if (buf && std::fread(buf, 1, size, f) != static_cast<std::size_t>(size)) {
+            sqlite3_free(buf);
+            buf = nullptr;
+          }
+        }
+      }
+      std::fclose(f);
+      return buf;
+    }
+
+    std::string quote_identifier(std::string const& name)
+    {
+      std::string quoted = "\"";
+      for (auto c : name) {
+        if (c == '"') quoted += '"';
+        quoted += c;
+      }
+      return quoted + "\"";
+    }
+
+    database& outside_transaction(database& db)
+    {
+      if (!db.autocommit())
+        throw database_error("bulk_load_session: a transaction is open");
+      return db;
+    }
+
+    // Runs body between BEGIN and COMMIT and rolls back if either fails.
+    template <class F>
+    int within_transaction(database& db, F body)
+    {
+      auto rc = db.execute("BEGIN");
+      if (rc != SQLITE_OK) return rc;
+      rc = body();
+      if (rc == SQLITE_OK) {
+        rc = db.execute("COMMIT");
+      }
+      // A failed COMMIT may have rolled back already.
+      if (rc != SQLITE_OK && !db.autocommit()) {
+        db.execute("ROLLBACK");
+      }
+      return rc;
+    }
+
+    // Removes the saved definitions of names, and the table once empty.
+    int forget_dropped_indexes(database& db, std::vector<std::string> const& names)
+    {
+      command del(db, "DELETE FROM sqlite3pp_bulk_load WHERE name = ?");
+      for (auto const& name : names) {
+        del.reset();
+        del.bind(1, name, nocopy);
+        auto rc = del.execute();
+        if (rc != SQLITE_OK) return rc;
+      }
+      query left(db, "SELECT count(*) FROM sqlite3pp_bulk_load");
+      if ((*left.begin()).get<int>(0) != 0) return SQLITE_OK;
+      left.finish();
+      return db.execute("DROP TABLE sqlite3pp_bulk_load");
+    }
+
+    pragma_settings bulk_load_settings()
+    {
+      // Sorter threads are set through limit_worker_threads instead.
+      auto s = pragma_settings::bulk_load();
+      s.threads = pragma_value<int>();
+      return s;
+    }
+
+    // The current values of the settings that s changes.
+    pragma_settings saved_pragmas(database const& db, pragma_settings const& s)
+    {
+      auto current = db.pragmas();
+      pragma_settings saved;
+      if (s.page_size.set) saved.page_size = current.page_size;
+      if (s.journal.set) saved.journal = current.journal;
+      if (s.synchronous.set) saved.synchronous = current.synchronous;
+      if (s.cache_size.set) saved.cache_size = current.cache_size;
+      if (s.mmap_size.set) saved.mmap_size = current.mmap_size;
+      if (s.temp_store.set) saved.temp_store = current.temp_store;
+      if (s.wal_autocheckpoint.set) saved.wal_autocheckpoint = current.wal_autocheckpoint;
+      if (s.busy_timeout.set) saved.busy_timeout = current.busy_timeout;
+      if (s.threads.set) saved.threads = current.threads;
+      return saved;
+    }
+
   } // namespace
 
-  inline database::database(char const* dbname, int flags, char const* vfs) : db_(nullptr), borrowing_(false)
+
+  inline statement_stats& statement_stats::operator+=(statement_stats const& other)
+  {
+    fullscan_steps += other.fullscan_steps;
+    sorts += other.sorts;
+    autoindexes += other.autoindexes;
+    vm_steps += other.vm_steps;
+    reprepares += other.reprepares;
+    runs += other.runs;
+    memory_used = std::max(memory_used, other.memory_used);
+    return *this;
+  }
+
+  inline statement_stats& statement_stats::operator-=(statement_stats const& other)
+  {
+    fullscan_steps -= other.fullscan_steps;
+    sorts -= other.sorts;
+    autoindexes -= other.autoindexes;
+    vm_steps -= other.vm_steps;
+    reprepares -= other.reprepares;
+    runs -= other.runs;
+    return *this;
+  }
+
+  template <class T>
+  inline ring_buffer<T>::ring_buffer(std::size_t capacity) : mask_(0), head_(0), tail_(0)
+  {
+    std::size_t n = 2;
+    while (n < capacity) n <<= 1;
+    cells_.reset(new cell[n]);
+    for (std::size_t i = 0; i < n; ++i) {
+      cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+    mask_ = n - 1;
+  }
+
+  template <class T>
+  inline bool ring_buffer<T>::try_push(T&& value)
+  {
+    auto pos = tail_.load(std::memory_order_relaxed);
+    for (;;) {
+      auto& c = cells_[pos & mask_];
+      auto seq = c.seq.load(std::memory_order_acquire);
+      auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          c.value = std::move(value);
+          c.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  template <class T>
+  inline bool ring_buffer<T>::try_pop(T& value)
+  {
+    auto pos = head_.load(std::memory_order_relaxed);
+    for (;;) {
+      auto& c = cells_[pos & mask_];
+      auto seq = c.seq.load(std::memory_order_acquire);
+      auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos + 1);
+      if (diff == 0) {
+        if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          value = std::move(c.value);
+          c.seq.store(pos + mask_ + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = head_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  template <class T>
+  inline std::size_t ring_buffer<T>::capacity() const
+  {
+    return mask_ + 1;
+  }
+
+  inline histogram_snapshot::histogram_snapshot() : counts_(latency_histogram::bucket_count, 0), sum_(0), max_(0)
+  {
+  }
+
+  inline long long histogram_snapshot::count() const
+  {
+    long long n = 0;
+    for (auto c : counts_) n += c;
+    return n;
+  }
+
+  inline long long histogram_snapshot::sum() const
+  {
+    return sum_;
+  }
+
+  inline long long histogram_snapshot::max() const
+  {
+    return max_;
+  }
+
+  inline double histogram_snapshot::mean() const
+  {
+    auto n = count();
+    return n ? static_cast<double>(sum_) / n : 0.0;
+  }
+
+  inline long long histogram_snapshot::percentile(double p) const
+  {
+    auto n = count();
+    if (n == 0) return 0;
+    auto target = static_cast<long long>(std::ceil(n * std::min(std::max(p, 0.0), 100.0) / 100.0));
+    if (target < 1) target = 1;
+    long long seen = 0;
+    for (int i = 0; i < latency_histogram::bucket_count; ++i) {
+      seen += counts_[i];
+      if (seen >= target) {
+        return std::min(latency_histogram::bucket_upper_bound(i), max_);
+      }
+    }
+    return max_;
+  }
+
+  inline histogram_snapshot& histogram_snapshot::operator+=(histogram_snapshot const& other)
+  {
+    for (int i = 0; i < latency_histogram::bucket_count; ++i) {
+      counts_[i] += other.counts_[i];
+    }
+    sum_ += other.sum_;
+    max_ = std::max(max_, other.max_);
+    return *this;
+  }
+
+  inline latency_histogram::latency_histogram()
+  {
+    reset();
+  }
+
+  inline int latency_histogram::bucket_index(long long value)
+  {
+    if (value < (2 << sub_bucket_bits)) {
+      return value < 0 ? 0 : static_cast<int>(value);
+    }
+    int msb = 0;
+    for (int step = 32; step > 0; step >>= 1) {
+      if (value >> (msb + step)) msb += step;
+    }
+    int shift = msb - sub_bucket_bits;
+    return ((shift + 1) << sub_bucket_bits) + static_cast<int>((value >> shift) & ((1 << sub_bucket_bits) - 1));
+  }
+
+  inline long long latency_histogram::bucket_upper_bound(int idx)
+  {
+    if (idx < (2 << sub_bucket_bits)) {
+      return idx;
+    }
+    int shift = (idx >> sub_bucket_bits) - 1;
+    long long lower = static_cast<long long>((1 << sub_bucket_bits) + (idx & ((1 << sub_bucket_bits) - 1))) << shift;
+    return lower + ((1LL << shift) - 1);
+  }
+
+  inline void latency_histogram::record(long long value)
+  {
+    counts_[bucket_index(value)].fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+    auto m = max_.load(std::memory_order_relaxed);
+    while (value > m && !max_.compare_exchange_weak(m, value, std::memory_order_relaxed)) {
+    }
+  }
+
+  inline void latency_histogram::erase(long long value)
+  {
+    counts_[bucket_index(value)].fetch_sub(1, std::memory_order_relaxed);
+    sum_.fetch_sub(value, std::memory_order_relaxed);
+  }
+
+  inline histogram_snapshot latency_histogram::snapshot() const
+  {
+    histogram_snapshot s;
+    for (int i = 0; i < bucket_count; ++i) {
+      s.counts_[i] = counts_[i].load(std::memory_order_relaxed);
+    }
+    s.sum_ = sum_.load(std::memory_order_relaxed);
+    s.max_ = max_.load(std::memory_order_relaxed);
+    return s;
+  }
+
+  inline void latency_histogram::reset()
+  {
+    for (auto& c : counts_) {
+      c.store(0, std::memory_order_relaxed);
+    }
+    sum_.store(0, std::memory_order_relaxed);
+    max_.store(0, std::memory_order_relaxed);
+  }
+
+  inline contention_monitor::contention_monitor()
+    : busy_calls(0), busy_timeouts(0), transaction_retries(0), transaction_failures(0)
+  {
+  }
+
+  inline contention_stats contention_monitor::stats() const
+  {
+    contention_stats s;
+    s.lock_waits = lock_waits.snapshot();
+    s.transaction_waits = transaction_waits.snapshot();
+    s.busy_calls = busy_calls.load();
+    s.busy_timeouts = busy_timeouts.load();
+    s.transaction_retries = transaction_retries.load();
+    s.transaction_failures = transaction_failures.load();
+    return s;
+  }
+
+  inline void contention_monitor::reset()
+  {
+    lock_waits.reset();
+    transaction_waits.reset();
+    busy_calls = 0;
+    busy_timeouts = 0;
+    transaction_retries = 0;
+    transaction_failures = 0;
+  }
+
+  inline interrupt_timer& interrupt_timer::instance()
+  {
+    static interrupt_timer timer;
+    return timer;
+  }
+
+  inline interrupt_timer::interrupt_timer() : next_id_(1), stop_(false)
+  {
+  }
+
+  inline interrupt_timer::~interrupt_timer()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_one();
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+
+  inline unsigned long long interrupt_timer::schedule(sqlite3* db, std::chrono::steady_clock::time_point when)
+  {
+    unsigned long long id;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      id = next_id_++;
+      entry e = {db, when, false, false};
+      entries_[id] = e;
+      if (!thread_.joinable()) {
+        thread_ = std::thread(&interrupt_timer::run, this);
+      }
+    }
+    cv_.notify_one();
+    return id;
+  }
+
+  inline bool interrupt_timer::cancel(unsigned long long id)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(id);
+    if (it == entries_.end()) {
+      return false;
+    }
+    auto fired = it->second.fired;
+    entries_.erase(it);
+    return fired;
+  }
+
+  inline bool interrupt_timer::enter(unsigned long long id)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(id);
+    if (it == entries_.end()) return true;
+    it->second.active = true;
+    return !it->second.fired;
+  }
+
+  inline void interrupt_timer::leave(unsigned long long id)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(id);
+    if (it != entries_.end()) it->second.active = false;
+  }
+
+  inline void interrupt_timer::run()
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_) {
+      auto now = std::chrono::steady_clock::now();
+      auto next = std::chrono::steady_clock::time_point::max();
+      for (auto& kv : entries_) {
+        auto& e = kv.second;
+        if (e.fired) continue;
+        if (e.when <= now) {
+          // Delivered under the lock, so a cancelled or idle entry is never
+          // interrupted.
+          if (e.active) sqlite3_interrupt(e.db);
+          e.fired = true;
+        } else if (e.when < next) {
+          next = e.when;
+        }
+      }
+      if (next == std::chrono::steady_clock::time_point::max()) {
+        cv_.wait(lock);
+      } else {
+        cv_.wait_until(lock, next);
+      }
+    }
+  }
+
+
+  inline memory_account::memory_account() : current_(0), highwater_(0), allocations_(0), next_free_(nullptr)
+  {
+  }
+
+  inline memory_account::scope::scope(memory_account* a) : prev_(active())
+  {
+    active() = a;
+  }
+
+  inline memory_account::scope::~scope()
+  {
+    active() = prev_;
+  }
+
+  inline memory_account::pool_state& memory_account::pool()
+  {
+    static pool_state p;
+    return p;
+  }
+
+  inline memory_account* memory_account::acquire()
+  {
+    auto& state = pool();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    // An account still holding memory of its previous owner, e.g. a
+    // statement that outlived its connection, stays in the pool until
+    // that memory is freed, so a new owner never sees bytes it did not
+    // allocate.
+    for (auto p = &state.free; *p; p = &(*p)->next_free_) {
+      auto a = *p;
+      if (a->current_.load() == 0) {
+        *p = a->next_free_;
+        a->highwater_ = 0;
+        a->allocations_ = 0;
+        return a;
+      }
+    }
+    return new memory_account();
+  }
+
+  inline void memory_account::release(memory_account* a)
+  {
+    if (!a) return;
+    auto& state = pool();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    a->next_free_ = state.free;
+    state.free = a;
+  }
+
+  inline memory_account*& memory_account::active()
+  {
+    static thread_local memory_account* a = nullptr;
+    return a;
+  }
+
+  inline std::atomic<bool>& memory_account::enabled()
+  {
+    static std::atomic<bool> on(false);
+    return on;
+  }
+
+  inline void memory_account::charge(long long n, bool counted)
+  {
+    auto cur = current_.fetch_add(n, std::memory_order_relaxed) + n;
+    if (counted && n > 0) allocations_.fetch_add(1, std::memory_order_relaxed);
+    auto hw = highwater_.load(std::memory_order_relaxed);
+    while (cur > hw && !highwater_.compare_exchange_weak(hw, cur, std::memory_order_relaxed)) {
+    }
+  }
+
+  inline memory_usage memory_account::usage() const
+  {
+    memory_usage u;
+    u.current = current_.load();
+    u.highwater = highwater_.load();
+    u.allocations = allocations_.load();
+    return u;
+  }
+
+  inline database::database(char const* dbname, int flags, char const* vfs) : db_(nullptr), borrowing_(false),
+    pn_(0),
+    pinterval_(0),
+    pticks_(0),
+    tmask_(0),
+    xthreshold_(0),
+    committing_(false),
+    sreg_enabled_(false),
+    unotify_(false),
+    owned_(false),
+    owner_(std::thread::id()),
+    dmode_(progress_check),
+    dinterval_(1000),
+    deadline_(std::chrono::steady_clock::time_point::max()),
+    armed_(0),
+    stepping_(std::chrono::steady_clock::time_point::max()),
+    macct_(nullptr)
   {
     if (dbname) {
       auto rc = connect(dbname, flags, vfs);
@@ -84,9 +759,37 @@ namespace sqlite3pp
     ch_(std::move(db.ch_)),
     rh_(std::move(db.rh_)),
     uh_(std::move(db.uh_)),
-    ah_(std::move(db.ah_))
+    ah_(std::move(db.ah_)),
+    ph_(std::move(db.ph_)),
+    pn_(db.pn_),
+    pinterval_(0),
+    pticks_(0),
+    th_(std::move(db.th_)),
+    tmask_(db.tmask_),
+    xh_(std::move(db.xh_)),
+    xthreshold_(db.xthreshold_),
+    cdh_(std::move(db.cdh_)),
+    committing_(db.committing_),
+    cm_(std::move(db.cm_)),
+    sreg_enabled_(db.sreg_enabled_),
+    sreg_(std::move(db.sreg_)),
+    sreg_samples_(std::move(db.sreg_samples_)),
+    unotify_(db.unotify_),
+    owned_(db.owned_.load()),
+    owner_(db.owner_.load()),
+    dmode_(db.dmode_),
+    dinterval_(db.dinterval_),
+    deadline_(db.deadline_),
+    armed_(0),
+    stepping_(std::chrono::steady_clock::time_point::max()),
+    macct_(db.macct_),
+    images_(std::move(db.images_))
   {
     db.db_ = nullptr;
+    db.macct_ = nullptr;
+    db.armed_ = 0;
+    db.stepping_ = std::chrono::steady_clock::time_point::max();
+    db.pinterval_ = 0;
     rebind_handlers();
   }
 
@@ -106,6 +809,42 @@ namespace sqlite3pp
       rh_ = std::move(db.rh_);
       uh_ = std::move(db.uh_);
       ah_ = std::move(db.ah_);
+      ph_ = std::move(db.ph_);
+      pn_ = db.pn_;
+      th_ = std::move(db.th_);
+      tmask_ = db.tmask_;
+      xh_ = std::move(db.xh_);
+      xthreshold_ = db.xthreshold_;
+      cdh_ = std::move(db.cdh_);
+      committing_ = db.committing_;
+
+      cm_ = std::move(db.cm_);
+
+      sreg_enabled_ = db.sreg_enabled_;
+      sreg_ = std::move(db.sreg_);
+      sreg_samples_ = std::move(db.sreg_samples_);
+
+      unotify_ = db.unotify_;
+
+      owned_ = db.owned_.load();
+      owner_ = db.owner_.load();
+
+      dmode_ = db.dmode_;
+      dinterval_ = db.dinterval_;
+      deadline_ = db.deadline_;
+      armed_ = 0;
+      stepping_ = std::chrono::steady_clock::time_point::max();
+      pinterval_ = 0;
+      pticks_ = 0;
+      db.armed_ = 0;
+      db.stepping_ = std::chrono::steady_clock::time_point::max();
+      db.pinterval_ = 0;
+
+      memory_account::release(macct_);
+      macct_ = db.macct_;
+      db.macct_ = nullptr;
+
+      images_ = std::move(db.images_);
 
       rebind_handlers();
     }
@@ -113,11 +852,32 @@ namespace sqlite3pp
     return *this;
   }
 
+  inline database::database(sqlite3* pdb) : db_(pdb), borrowing_(true),
+    pn_(0),
+    pinterval_(0),
+    pticks_(0),
+    tmask_(0),
+    xthreshold_(0),
+    committing_(false),
+    sreg_enabled_(false),
+    unotify_(false),
+    owned_(false),
+    owner_(std::thread::id()),
+    dmode_(progress_check),
+    dinterval_(1000),
+    deadline_(std::chrono::steady_clock::time_point::max()),
+    armed_(0),
+    stepping_(std::chrono::steady_clock::time_point::max()),
+    macct_(nullptr)
+  {
+  }
+
   inline database::~database()
   {
     if (!borrowing_) {
       disconnect();
     }
+    memory_account::release(macct_);
   }
 
   inline int database::connect(char const* dbname, int flags, char const* vfs)
@@ -126,6 +886,10 @@ namespace sqlite3pp
       disconnect();
     }
 
+    if (!macct_ && memory_account::enabled()) {
+      macct_ = memory_account::acquire();
+    }
+    memory_account::scope ms(macct_);
     return sqlite3_open_v2(dbname, &db_, flags, vfs);
   }
 
@@ -133,6 +897,17 @@ namespace sqlite3pp
   {
     auto rc = SQLITE_OK;
     if (db_) {
+      memory_account::scope ms(macct_);
+      if (!images_.empty()) {
+        // With unfinalized statements the connection lives on as a zombie
+        // that can still read the images. SQLite destroys user functions
+        // only when it is really gone, so a no-op one carries them.
+        auto images = new std::map<std::string, std::shared_ptr<void const>>(std::move(images_));
+        images_.clear();
+        sqlite3_create_function_v2(db_, "sqlite3pp_deserialized_images", 0, SQLITE_UTF8, images,
+                                   [](sqlite3_context*, int, sqlite3_value**) {}, nullptr, nullptr,
+                                   [](void* p) { delete static_cast<std::map<std::string, std::shared_ptr<void const>>*>(p); });
+      }
       rc = sqlite3_close_v2(db_);
       if (rc == SQLITE_OK) {
         db_ = nullptr;
@@ -149,7 +924,17 @@ namespace sqlite3pp
 
   inline int database::detach(char const* name)
   {
-    return executef("DETACH '%q'", name);
+    auto rc = executef("DETACH '%q'", name);
+    if (rc == SQLITE_OK) {
+      // DETACH fails while a statement uses the schema.
+      for (auto it = images_.begin(); it != images_.end(); ++it) {
+        if (sqlite3_stricmp(it->first.c_str(), name) == 0) {
+          images_.erase(it);
+          break;
+        }
+      }
+    }
+    return rc;
   }
 
   inline int database::backup(database& destdb, backup_handler h)
@@ -183,46 +968,284 @@ namespace sqlite3pp
   inline void database::set_commit_handler(commit_handler h)
   {
     ch_ = h;
-    sqlite3_commit_hook(db_, ch_ ? commit_hook_impl : nullptr, &ch_);
+    install_commit_hooks();
   }
 
   inline void database::set_rollback_handler(rollback_handler h)
   {
     rh_ = h;
-    sqlite3_rollback_hook(db_, rh_ ? rollback_hook_impl : nullptr, &rh_);
+    install_commit_hooks();
   }
 
-  inline void database::set_update_handler(update_handler h)
+  inline void database::set_committed_handler(committed_handler h)
   {
-    uh_ = h;
-    sqlite3_update_hook(db_, uh_ ? update_hook_impl : nullptr, &uh_);
+    cdh_ = h;
+    committing_ = false;
+    install_commit_hooks();
   }
 
-  inline void database::set_authorize_handler(authorize_handler h)
+  inline int database::commit_impl(void* p)
   {
-    ah_ = h;
-    sqlite3_set_authorizer(db_, ah_ ? authorizer_impl : nullptr, &ah_);
+    auto db = static_cast<database*>(p);
+    auto rc = db->ch_ ? db->ch_() : 0;
+    db->committing_ = rc == 0;
+    return rc;
   }
 
-  inline void database::rebind_handlers()
+  inline void database::rollback_impl(void* p)
   {
-    if (db_) {
-      if (bh_) sqlite3_busy_handler(db_, busy_handler_impl, &bh_);
-      if (ch_) sqlite3_commit_hook(db_, commit_hook_impl, &ch_);
-      if (rh_) sqlite3_rollback_hook(db_, rollback_hook_impl, &rh_);
-      if (uh_) sqlite3_update_hook(db_, update_hook_impl, &uh_);
-      if (ah_) sqlite3_set_authorizer(db_, authorizer_impl, &ah_);
-    }
+    auto db = static_cast<database*>(p);
+    db->committing_ = false;
+    if (db->rh_) db->rh_();
   }
 
-  inline long long int database::last_insert_rowid() const
+  inline void database::install_commit_hooks()
   {
-    return sqlite3_last_insert_rowid(db_);
+    auto tracking = static_cast<bool>(cdh_);
+    sqlite3_commit_hook(db_, ch_ || tracking ? commit_impl : nullptr, this);
+    sqlite3_rollback_hook(db_, rh_ || tracking ? rollback_impl : nullptr, this);
   }
 
-  inline int database::enable_foreign_keys(bool enable)
+  inline void database::check_committed()
   {
-    return sqlite3_db_config(db_, SQLITE_DBCONFIG_ENABLE_FKEY, enable ? 1 : 0, nullptr);
+    // A COMMIT that failed either rolled back, which cleared the flag, or
+    // left the transaction open.
+    if (committing_ && sqlite3_get_autocommit(db_)) {
+      committing_ = false;
+      if (cdh_) cdh_();
+    }
+  }
+
+  inline void database::set_update_handler(update_handler h)
+  {
+    uh_ = h;
+    sqlite3_update_hook(db_, uh_ ? update_hook_impl : nullptr, &uh_);
+  }
+
+  inline void database::set_authorize_handler(authorize_handler h)
+  {
+    ah_ = h;
+    sqlite3_set_authorizer(db_, ah_ ? authorizer_impl : nullptr, &ah_);
+  }
+
+  inline void database::set_progress_handler(progress_handler h, int n)
+  {
+    ph_ = h;
+    pn_ = n > 0 ? n : 1;
+    install_progress_handler();
+  }
+
+  inline void database::set_trace_handler(unsigned mask, trace_handler h)
+  {
+    th_ = h;
+    tmask_ = th_ ? mask : 0;
+    sqlite3_trace_v2(db_, tmask_, th_ ? trace_impl : nullptr, &th_);
+  }
+
+  inline void database::set_execution_handler(execution_handler h, std::chrono::nanoseconds threshold)
+  {
+    xh_ = h;
+    xthreshold_ = threshold;
+  }
+
+  inline void database::set_busy_backoff(backoff_policy const& policy)
+  {
+    monitor();
+    set_busy_handler(backoff_busy_handler(policy, cm_));
+  }
+
+  template <class F>
+  inline int database::run_in_transaction(F fn, retry_policy const& policy)
+  {
+    auto& cm = monitor();
+    std::minstd_rand rng(backoff_seed());
+    auto start = std::chrono::steady_clock::now();
+    std::chrono::nanoseconds waited(0);
+
+    for (int attempt = 0;; ++attempt) {
+      auto rc = SQLITE_OK;
+      auto begun = false;
+      try {
+        transaction xct(*this, false, policy.immediate);
+        begun = true;
+        try {
+          rc = fn();
+        } catch (database_error const&) {
+          if (!is_busy(extended_error_code())) throw;
+          rc = SQLITE_BUSY;
+        }
+        if (rc == SQLITE_OK) {
+          rc = xct.commit();
+          // A COMMIT that fails with SQLITE_BUSY leaves the transaction open.
+          if (rc != SQLITE_OK && !sqlite3_get_autocommit(db_)) {
+            execute("ROLLBACK");
+          }
+        }
+      } catch (database_error const&) {
+        if (begun || !is_busy(extended_error_code())) throw;
+        rc = SQLITE_BUSY;
+      }
+
+      if (!is_busy(rc)) {
+        cm.transaction_waits.record(waited.count());
+        return rc;
+      }
+
+      auto elapsed = std::chrono::steady_clock::now() - start;
+      if (attempt + 1 >= policy.max_attempts || elapsed >= policy.backoff.deadline) {
+        ++cm.transaction_failures;
+        cm.transaction_waits.record(waited.count());
+        return rc;
+      }
+
+      ++cm.transaction_retries;
+      auto delay = std::min<std::chrono::nanoseconds>(backoff_delay(policy.backoff, attempt, rng), policy.backoff.deadline - elapsed);
+      std::this_thread::sleep_for(delay);
+      waited += delay;
+    }
+  }
+
+  inline contention_stats database::contention() const
+  {
+    return cm_ ? cm_->stats() : contention_stats();
+  }
+
+  inline void database::reset_contention()
+  {
+    if (cm_) cm_->reset();
+  }
+
+  inline void database::enable_statement_stats(bool enable)
+  {
+    sreg_enabled_ = enable;
+  }
+
+  inline std::map<std::string, statement_stats> database::statement_stats_by_sql() const
+  {
+    return sreg_;
+  }
+
+  inline std::map<std::string, std::string> database::statement_samples() const
+  {
+    return sreg_samples_;
+  }
+
+  inline void database::reset_statement_stats()
+  {
+    sreg_.clear();
+    sreg_samples_.clear();
+  }
+
+  inline contention_monitor& database::monitor()
+  {
+    if (!cm_) {
+      cm_ = std::make_shared<contention_monitor>();
+    }
+    return *cm_;
+  }
+
+  inline void database::set_deadline_mode(deadline_mode mode, int vm_interval)
+  {
+    dmode_ = mode;
+    dinterval_ = vm_interval > 0 ? vm_interval : 1;
+  }
+
+  inline void database::set_deadline(std::chrono::steady_clock::time_point deadline)
+  {
+    deadline_ = deadline;
+  }
+
+  inline void database::clear_deadline()
+  {
+    deadline_ = std::chrono::steady_clock::time_point::max();
+  }
+
+  inline bool database::has_deadline() const
+  {
+    return deadline_ != std::chrono::steady_clock::time_point::max();
+  }
+
+  // One SQLite progress handler serves both the deadline check and the
+  // user handler; it runs at the finer of the two intervals.
+  inline int database::progress_impl(void* p)
+  {
+    auto db = static_cast<database*>(p);
+    if (db->stepping_ != std::chrono::steady_clock::time_point::max() &&
+        std::chrono::steady_clock::now() >= db->stepping_) {
+      return 1;
+    }
+    if (db->ph_) {
+      db->pticks_ += db->pinterval_;
+      if (db->pticks_ >= db->pn_) {
+        db->pticks_ = 0;
+        return db->ph_();
+      }
+    }
+    return 0;
+  }
+
+  inline void database::install_progress_handler()
+  {
+    auto deadline = armed_ > 0;
+    if (deadline && ph_) {
+      pinterval_ = std::min(dinterval_, pn_);
+    } else if (deadline) {
+      pinterval_ = dinterval_;
+    } else if (ph_) {
+      pinterval_ = pn_;
+    } else {
+      pinterval_ = 0;
+    }
+    pticks_ = 0;
+    sqlite3_progress_handler(db_, pinterval_, pinterval_ ? progress_impl : nullptr, pinterval_ ? this : nullptr);
+  }
+
+  inline unsigned long long database::arm_deadline(std::chrono::steady_clock::time_point deadline)
+  {
+    if (!db_) return 0;
+    if (dmode_ == timer_interrupt) {
+      return interrupt_timer::instance().schedule(db_, deadline);
+    }
+    if (++armed_ == 1) install_progress_handler();
+    return 0;
+  }
+
+  inline void database::disarm_deadline(unsigned long long timer_id)
+  {
+    if (timer_id) {
+      interrupt_timer::instance().cancel(timer_id);
+      return;
+    }
+    if (armed_ > 0 && --armed_ == 0) install_progress_handler();
+  }
+
+  inline void database::rebind_handlers()
+  {
+    if (db_) {
+      if (bh_) sqlite3_busy_handler(db_, busy_handler_impl, &bh_);
+      install_commit_hooks();
+      if (uh_) sqlite3_update_hook(db_, update_hook_impl, &uh_);
+      if (ah_) sqlite3_set_authorizer(db_, authorizer_impl, &ah_);
+      // Also clears a handler still pointing at a moved-from object.
+      install_progress_handler();
+      if (th_) sqlite3_trace_v2(db_, tmask_, trace_impl, &th_);
+    }
+  }
+
+  inline long long int database::last_insert_rowid() const
+  {
+    return sqlite3_last_insert_rowid(db_);
+  }
+
+  inline char const* database::filename(char const* schema) const
+  {
+    auto name = db_ ? sqlite3_db_filename(db_, schema) : nullptr;
+    return name ? name : "";
+  }
+
+  inline int database::enable_foreign_keys(bool enable)
+  {
+    return sqlite3_db_config(db_, SQLITE_DBCONFIG_ENABLE_FKEY, enable ? 1 : 0, nullptr);
   }
 
   inline int database::enable_triggers(bool enable)
@@ -235,11 +1258,109 @@ namespace sqlite3pp
     return sqlite3_extended_result_codes(db_, enable ? 1 : 0);
   }
 
+  inline int database::enable_unlock_notify(bool enable)
+  {
+#ifdef SQLITE_ENABLE_UNLOCK_NOTIFY
+    unotify_ = enable;
+    return SQLITE_OK;
+#else
+    return enable ? SQLITE_ERROR : SQLITE_OK;
+#endif
+  }
+
+  // Blocks until the connection holding the lock that made the last call
+  // fail ends its transaction. Returns SQLITE_LOCKED if waiting would
+  // deadlock.
+  inline int database::wait_for_unlock()
+  {
+#ifdef SQLITE_ENABLE_UNLOCK_NOTIFY
+    unlock_notification un;
+    un.fired = false;
+    auto rc = sqlite3_unlock_notify(db_, unlock_notify_impl, &un);
+    if (rc == SQLITE_OK) {
+      std::unique_lock<std::mutex> lock(un.mutex);
+      while (!un.fired) {
+        un.cv.wait(lock);
+      }
+    }
+    return rc;
+#else
+    return SQLITE_LOCKED;
+#endif
+  }
+
+  // sqlite3_exec() that, with unlock notify enabled, runs the statements
+  // one by one and waits out shared-cache locks like statement::step().
+  inline int database::exec_impl(char const* sql)
+  {
+    if (!unotify_) return sqlite3_exec(db_, sql, 0, 0, 0);
+
+    auto rc = SQLITE_OK;
+    while (rc == SQLITE_OK && *sql) {
+      sqlite3_stmt* stmt = nullptr;
+      char const* tail = nullptr;
+      rc = sqlite3_prepare_v2(db_, sql, -1, &stmt, &tail);
+      while (is_shared_cache_locked(db_, rc)) {
+        if ((rc = wait_for_unlock()) != SQLITE_OK) break;
+        rc = sqlite3_prepare_v2(db_, sql, -1, &stmt, &tail);
+      }
+      if (rc != SQLITE_OK) break;
+      sql = tail;
+      if (!stmt) continue;
+
+      while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+      }
+      while (is_shared_cache_locked(db_, rc)) {
+        if ((rc = wait_for_unlock()) != SQLITE_OK) break;
+        sqlite3_reset(stmt);
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        }
+      }
+      if (rc == SQLITE_DONE) {
+        rc = sqlite3_finalize(stmt);
+      } else {
+        sqlite3_finalize(stmt);
+      }
+    }
+    return rc;
+  }
+
   inline int database::changes() const
   {
     return sqlite3_changes(db_);
   }
 
+  inline bool database::autocommit() const
+  {
+    return sqlite3_get_autocommit(db_) != 0;
+  }
+
+  inline database_status database::status(bool reset) const
+  {
+    database_status s;
+    auto r = reset ? 1 : 0;
+    int cur = 0, hw = 0;
+    auto get = [&](int op) {
+      cur = hw = 0;
+      sqlite3_db_status(db_, op, &cur, &hw, r);
+    };
+
+    get(SQLITE_DBSTATUS_CACHE_HIT); s.cache_hit = cur;
+    get(SQLITE_DBSTATUS_CACHE_MISS); s.cache_miss = cur;
+    get(SQLITE_DBSTATUS_CACHE_WRITE); s.cache_write = cur;
+    get(SQLITE_DBSTATUS_CACHE_SPILL); s.cache_spill = cur;
+    get(SQLITE_DBSTATUS_CACHE_USED); s.cache_used = cur;
+    get(SQLITE_DBSTATUS_CACHE_USED_SHARED); s.cache_used_shared = cur;
+    get(SQLITE_DBSTATUS_LOOKASIDE_USED); s.lookaside_used = cur; s.lookaside_highwater = hw;
+    get(SQLITE_DBSTATUS_LOOKASIDE_HIT); s.lookaside_hit = hw;
+    get(SQLITE_DBSTATUS_LOOKASIDE_MISS_SIZE); s.lookaside_miss_size = hw;
+    get(SQLITE_DBSTATUS_LOOKASIDE_MISS_FULL); s.lookaside_miss_full = hw;
+    get(SQLITE_DBSTATUS_SCHEMA_USED); s.schema_used = cur;
+    get(SQLITE_DBSTATUS_STMT_USED); s.stmt_used = cur;
+    get(SQLITE_DBSTATUS_DEFERRED_FKS); s.deferred_fks = cur;
+    return s;
+  }
+
   inline int database::error_code() const
   {
     return sqlite3_errcode(db_);
@@ -255,9 +1376,48 @@ namespace sqlite3pp
     return sqlite3_errmsg(db_);
   }
 
+  inline int database::configure_lookaside(int slot_size, int slots, void* buf)
+  {
+    return sqlite3_db_config(db_, SQLITE_DBCONFIG_LOOKASIDE, buf, slot_size, slots);
+  }
+
+  inline int database::release_memory()
+  {
+    return sqlite3_db_release_memory(db_);
+  }
+
+  inline memory_usage database::memory() const
+  {
+    return macct_ ? macct_->usage() : memory_usage();
+  }
+
   inline int database::execute(char const* sql)
   {
-    return sqlite3_exec(db_, sql, 0, 0, 0);
+    memory_account::scope ms(macct_);
+    if (!has_deadline()) {
+      auto rc = exec_impl(sql);
+      check_committed();
+      return rc;
+    }
+    if (std::chrono::steady_clock::now() >= deadline_) {
+      return SQLITE_INTERRUPT;
+    }
+    auto timer_id = arm_deadline(deadline_);
+    auto outer = stepping_;
+    auto rc = SQLITE_INTERRUPT;
+    if (timer_id) {
+      if (interrupt_timer::instance().enter(timer_id)) {
+        rc = exec_impl(sql);
+      }
+      interrupt_timer::instance().leave(timer_id);
+    } else {
+      stepping_ = deadline_;
+      rc = exec_impl(sql);
+      stepping_ = outer;
+    }
+    disarm_deadline(timer_id);
+    check_committed();
+    return rc;
   }
 
   inline int database::executef(char const* sql, ...)
@@ -277,11 +1437,263 @@ namespace sqlite3pp
 
   inline int database::set_busy_timeout(int ms)
   {
+    // SQLite drops the busy handler; keep rebind_handlers() from
+    // reinstalling it after a move.
+    bh_ = nullptr;
     return sqlite3_busy_timeout(db_, ms);
   }
 
+  inline int database::set_journal_mode(journal_mode mode)
+  {
+    std::string result;
+    auto rc = pragma_impl(db_, std::string("PRAGMA journal_mode = ") + journal_mode_names[mode], &result);
+    if (rc == SQLITE_OK && result != journal_mode_names[mode]) rc = SQLITE_ERROR;
+    return rc;
+  }
+
+  inline int database::set_synchronous(synchronous_mode mode)
+  {
+    return pragma_impl(db_, "PRAGMA synchronous = " + std::to_string(static_cast<int>(mode)));
+  }
+
+  inline int database::set_cache_size(long long int size)
+  {
+    return pragma_impl(db_, "PRAGMA cache_size = " + std::to_string(size));
+  }
+
+  inline int database::set_mmap_size(long long int bytes)
+  {
+    return pragma_impl(db_, "PRAGMA mmap_size = " + std::to_string(bytes));
+  }
+
+  inline int database::set_temp_store(temp_store_mode mode)
+  {
+    return pragma_impl(db_, "PRAGMA temp_store = " + std::to_string(static_cast<int>(mode)));
+  }
+
+  inline int database::set_page_size(int bytes)
+  {
+    return pragma_impl(db_, "PRAGMA page_size = " + std::to_string(bytes));
+  }
+
+  inline int database::set_wal_autocheckpoint(int pages)
+  {
+    return pragma_impl(db_, "PRAGMA wal_autocheckpoint = " + std::to_string(pages));
+  }
+
+  inline int database::set_threads(int n)
+  {
+    return pragma_impl(db_, "PRAGMA threads = " + std::to_string(n));
+  }
+
+  inline database_image::database_image() : data_(nullptr, sqlite3_free), size_(0)
+  {
+  }
+
+  inline unsigned char const* database_image::data() const
+  {
+    return data_.get();
+  }
+
+  inline std::size_t database_image::size() const
+  {
+    return size_;
+  }
+
+  inline bool database_image::empty() const
+  {
+    return !data_;
+  }
+
+  inline database_image database::serialize(char const* schema) const
+  {
+    database_image image;
+#ifndef SQLITE_OMIT_DESERIALIZE
+    sqlite3_int64 size = 0;
+    image.data_.reset(sqlite3_serialize(db_, schema, &size, 0));
+    if (image.data_) image.size_ = static_cast<std::size_t>(size);
+#endif
+    return image;
+  }
+
+  inline int database::deserialize(void const* data, std::size_t size, deserialize_mode mode, char const* schema)
+  {
+    if (mode == deserialize_read_only) {
+      // SQLite does not write to a read-only image.
+      return deserialize_impl(static_cast<unsigned char*>(const_cast<void*>(data)), size, SQLITE_DESERIALIZE_READONLY, schema);
+    }
+    auto buf = static_cast<unsigned char*>(sqlite3_malloc64(size > 0 ? size : 1));
+    if (!buf) return SQLITE_NOMEM;
+    if (size > 0) std::memcpy(buf, data, size);
+    return deserialize_impl(buf, size, SQLITE_DESERIALIZE_FREEONCLOSE | SQLITE_DESERIALIZE_RESIZEABLE, schema);
+  }
+
+  inline int database::deserialize_file(char const* path, deserialize_mode mode, char const* schema)
+  {
+    std::shared_ptr<void const> image;
+    void const* data = nullptr;
+    sqlite3_int64 size = 0;
+#ifndef _WIN32
+    if (mode == deserialize_read_only) {
+      int fd = ::open(path, O_RDONLY);
+      if (fd < 0) return SQLITE_CANTOPEN;
+      struct stat st;
+      if (::fstat(fd, &st) != 0) {
+        ::close(fd);
+        return SQLITE_IOERR;
+      }
+      size = st.st_size;
+      // An empty file cannot be mapped; it is read below instead.
+      if (size > 0) {
+        auto p = ::mmap(nullptr, static_cast<std::size_t>(size), PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) return SQLITE_IOERR;
+        std::size_t n = static_cast<std::size_t>(size);
+        image.reset(p, [n](void const* q) { ::munmap(const_cast<void*>(q), n); });
+        data = p;
+      }
+      else {
+        ::close(fd);
+      }
+    }
+#endif
+    if (!image) {
+      auto buf = read_file(path, size);
+      if (!buf) return SQLITE_CANTOPEN;
+      if (mode == deserialize_copy) {
+        return deserialize_impl(buf, size, SQLITE_DESERIALIZE_FREEONCLOSE | SQLITE_DESERIALIZE_RESIZEABLE, schema);
+      }
+      image.reset(buf, [](void const* q) { sqlite3_free(const_cast<void*>(q)); });
+      data = buf;
+    }
+    auto rc = deserialize(data, static_cast<std::size_t>(size), deserialize_read_only, schema);
+    if (rc == SQLITE_OK) {
+      images_[schema] = image;
+    }
+    return rc;
+  }
+
+  inline int database::deserialize_impl(unsigned char* data, sqlite3_int64 size, unsigned flags, char const* schema)
+  {
+#ifndef SQLITE_OMIT_DESERIALIZE
+    auto rc = sqlite3_deserialize(db_, schema, data, size, size, flags);
+    if (rc == SQLITE_OK) {
+      // The previous image of the schema is no longer referenced.
+      images_.erase(schema);
+    }
+    return rc;
+#else
+    if (flags & SQLITE_DESERIALIZE_FREEONCLOSE) sqlite3_free(data);
+    return SQLITE_ERROR;
+#endif
+  }
+
+  inline int database::limit(limit_category category) const
+  {
+    return sqlite3_limit(db_, category, -1);
+  }
+
+  inline int database::set_limit(limit_category category, int value)
+  {
+    return sqlite3_limit(db_, category, value);
+  }
+
+  inline pragma_settings database::pragmas() const
+  {
+    pragma_settings s;
+    std::string mode;
+    pragma_impl(db_, "PRAGMA journal_mode", &mode);
+    s.journal = journal_delete;
+    for (int i = journal_delete; i <= journal_off; ++i) {
+      if (mode == journal_mode_names[i]) s.journal = static_cast<journal_mode>(i);
+    }
+    s.synchronous = static_cast<synchronous_mode>(pragma_int(db_, "synchronous"));
+    s.cache_size = pragma_int(db_, "cache_size");
+    s.mmap_size = pragma_int(db_, "mmap_size");
+    s.temp_store = static_cast<temp_store_mode>(pragma_int(db_, "temp_store"));
+    s.page_size = static_cast<int>(pragma_int(db_, "page_size"));
+    s.wal_autocheckpoint = static_cast<int>(pragma_int(db_, "wal_autocheckpoint"));
+    s.busy_timeout = static_cast<int>(pragma_int(db_, "busy_timeout"));
+    s.threads = static_cast<int>(pragma_int(db_, "threads"));
+    return s;
+  }
+
+  inline int database::apply_pragmas(pragma_settings const& settings, int* restored)
+  {
+    auto saved = saved_pragmas(*this, settings);
+    auto rc = apply_pragmas_impl(*this, settings);
+    auto rrc = rc != SQLITE_OK ? apply_pragmas_impl(*this, saved) : SQLITE_OK;
+    if (restored) *restored = rrc;
+    return rc;
+  }
+
+  inline pragma_settings pragma_settings::oltp()
+  {
+    pragma_settings s;
+    s.journal = journal_wal;
+    s.synchronous = synchronous_normal;
+    s.cache_size = -64 * 1024;
+    s.temp_store = temp_store_memory;
+    s.wal_autocheckpoint = 1000;
+    s.busy_timeout = 5000;
+    return s;
+  }
+
+  inline pragma_settings pragma_settings::bulk_load()
+  {
+    pragma_settings s;
+    s.journal = journal_memory;
+    s.synchronous = synchronous_off;
+    s.cache_size = -256 * 1024;
+    s.temp_store = temp_store_memory;
+    s.threads = 4;
+    return s;
+  }
+
+  inline pragma_settings pragma_settings::read_mostly_analytics()
+  {
+    pragma_settings s;
+    s.mmap_size = 1LL << 30;
+    s.cache_size = -128 * 1024;
+    s.temp_store = temp_store_memory;
+    s.threads = 4;
+    return s;
+  }
+
+
+  inline single_thread_database::single_thread_database(char const* dbname, int flags, char const* vfs)
+    : database(dbname, flags | SQLITE_OPEN_NOMUTEX, vfs)
+  {
+    adopt();
+  }
+
+  inline void single_thread_database::adopt()
+  {
+    owner_ = std::this_thread::get_id();
+    owned_ = true;
+  }
+
+  inline void single_thread_database::hand_off(std::thread::id to)
+  {
+    owner_ = to;
+    owned_ = true;
+  }
+
+  inline bool single_thread_database::owned_by_this_thread() const
+  {
+    return !owned_ || owner_ == std::this_thread::get_id();
+  }
+
 
-  inline statement::statement(database& db, char const* stmt) : db_(db), stmt_(nullptr), tail_(nullptr)
+  inline statement::statement(database& db, char const* stmt) : db_(db), stmt_(nullptr), tail_(nullptr),
+    timeout_(0),
+    armed_(false),
+    timer_id_(0),
+    running_(false),
+    timed_out_(false),
+    observed_(false),
+    registered_(false),
+    rows_(0)
   {
     if (stmt) {
       auto rc = prepare(stmt);
@@ -290,311 +1702,1026 @@ namespace sqlite3pp
     }
   }
 
-  inline statement::~statement()
+  inline statement::~statement()
+  {
+    // finish() can return error. If you want to check the error, call
+    // finish() explicitly before this object is destructed.
+    finish();
+  }
+
+  inline int statement::prepare(char const* stmt)
+  {
+    auto rc = finish();
+    if (rc != SQLITE_OK)
+      return rc;
+
+    return prepare_impl(stmt);
+  }
+
+  inline int statement::prepare_impl(char const* stmt)
+  {
+    memory_account::scope ms(db_.macct_);
+    auto rc = sqlite3_prepare_v2(db_.db_, stmt, std::strlen(stmt), &stmt_, &tail_);
+    while (db_.unotify_ && is_shared_cache_locked(db_.db_, rc)) {
+      if ((rc = db_.wait_for_unlock()) != SQLITE_OK) break;
+      rc = sqlite3_prepare_v2(db_.db_, stmt, std::strlen(stmt), &stmt_, &tail_);
+    }
+    return rc;
+  }
+
+  inline int statement::finish()
+  {
+    end_execution();
+
+    auto rc = SQLITE_OK;
+    if (stmt_) {
+      rc = finish_impl(stmt_);
+      stmt_ = nullptr;
+      db_.check_committed();
+    }
+    tail_ = nullptr;
+
+    return rc;
+  }
+
+  inline int statement::finish_impl(sqlite3_stmt* stmt)
+  {
+    memory_account::scope ms(db_.macct_);
+    return sqlite3_finalize(stmt);
+  }
+
+  inline bool statement::check_owner() const
+  {
+#ifdef NDEBUG
+    return true;
+#else
+    // Plain connections are never owned and stop at the first load.
+    return !db_.owned_.load(std::memory_order_relaxed) || db_.owner_.load() == std::this_thread::get_id();
+#endif
+  }
+
+  inline int statement::step()
+  {
+    if (!check_owner()) return SQLITE_MISUSE;
+    memory_account::scope ms(db_.macct_);
+    if (!running_) {
+      begin_execution();
+    }
+    auto rc = SQLITE_INTERRUPT;
+    if (!armed_) {
+      if (!timed_out_) rc = step_impl();
+    } else if (timer_id_) {
+      auto& timer = interrupt_timer::instance();
+      if (timer.enter(timer_id_)) {
+        rc = step_impl();
+      }
+      timer.leave(timer_id_);
+    } else {
+      // Only this statement's deadline applies while it steps; a nested
+      // one restores the outer deadline when it returns.
+      auto outer = db_.stepping_;
+      db_.stepping_ = deadline_;
+      rc = step_impl();
+      db_.stepping_ = outer;
+    }
+    if (rc == SQLITE_INTERRUPT && armed_) {
+      timed_out_ = std::chrono::steady_clock::now() >= deadline_;
+    }
+    if (timed_out_) {
+      // Leave the statement reusable; bindings are kept.
+      end_execution();
+      sqlite3_reset(stmt_);
+      db_.check_committed();
+      return SQLITE_INTERRUPT;
+    }
+    if (rc == SQLITE_ROW) {
+      ++rows_;
+    } else {
+      end_execution();
+      db_.check_committed();
+    }
+    return rc;
+  }
+
+  inline void statement::begin_execution()
+  {
+    running_ = true;
+    rows_ = 0;
+    timed_out_ = false;
+    if (timeout_.count() != 0 || db_.has_deadline()) {
+      auto now = std::chrono::steady_clock::now();
+      deadline_ = db_.deadline_;
+      if (timeout_.count() != 0 && now + timeout_ < deadline_) {
+        deadline_ = now + timeout_;
+      }
+      if (now >= deadline_) {
+        timed_out_ = true;
+      } else {
+        timer_id_ = db_.arm_deadline(deadline_);
+        armed_ = true;
+      }
+    }
+    observed_ = static_cast<bool>(db_.xh_);
+    registered_ = db_.sreg_enabled_;
+    if (observed_ || registered_) {
+      begin_stats_ = stmt_status(stmt_, false);
+    }
+    if (observed_) {
+      started_ = std::chrono::steady_clock::now();
+    }
+  }
+
+  inline void statement::end_execution()
+  {
+    if (!running_) return;
+    running_ = false;
+    if (armed_) {
+      db_.disarm_deadline(timer_id_);
+      armed_ = false;
+    }
+    if (observed_ && db_.xh_ && stmt_) {
+      auto elapsed = std::chrono::steady_clock::now() - started_;
+      if (elapsed >= db_.xthreshold_) {
+        execution_info info;
+        info.stmt = stmt_;
+        info.elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed);
+        info.rows = rows_;
+        info.stats = stmt_status(stmt_, false);
+        info.stats -= begin_stats_;
+        db_.xh_(info);
+      }
+    }
+    observed_ = false;
+    if (registered_ && db_.sreg_enabled_ && stmt_) {
+      auto delta = stmt_status(stmt_, false);
+      delta -= begin_stats_;
+      auto ins = db_.sreg_.insert(std::make_pair(std::string(sqlite3_sql(stmt_)), delta));
+      if (ins.second) {
+        auto expanded = sqlite3_expanded_sql(stmt_);
+        db_.sreg_samples_[ins.first->first] = expanded ? expanded : ins.first->first;
+        sqlite3_free(expanded);
+      } else {
+        ins.first->second += delta;
+      }
+    }
+  }
+
+  inline statement_stats statement::stats(bool reset) const
+  {
+    auto s = stmt_status(stmt_, reset);
+    if (reset && running_) {
+      begin_stats_ = statement_stats();
+    }
+    return s;
+  }
+
+  inline std::vector<scan_node> statement::scan_status() const
+  {
+    std::vector<scan_node> flat;
+#ifdef SQLITE_ENABLE_STMT_SCANSTATUS
+    for (int idx = 0; stmt_; ++idx) {
+      scan_node n;
+      sqlite3_int64 loops = 0, rows = 0;
+      double est = 0.0;
+      char const* name = nullptr;
+      char const* explain = nullptr;
+      // The v2 interface comes with SQLITE_SCANSTAT_COMPLEX.
+#ifdef SQLITE_SCANSTAT_COMPLEX
+      int const flags = SQLITE_SCANSTAT_COMPLEX;
+      if (sqlite3_stmt_scanstatus_v2(stmt_, idx, SQLITE_SCANSTAT_SELECTID, flags, &n.id) != 0) break;
+      sqlite3_stmt_scanstatus_v2(stmt_, idx, SQLITE_SCANSTAT_PARENTID, flags, &n.parent);
+      sqlite3_stmt_scanstatus_v2(stmt_, idx, SQLITE_SCANSTAT_NLOOP, flags, &loops);
+      sqlite3_stmt_scanstatus_v2(stmt_, idx, SQLITE_SCANSTAT_NVISIT, flags, &rows);
+      sqlite3_stmt_scanstatus_v2(stmt_, idx, SQLITE_SCANSTAT_EST, flags, &est);
+      sqlite3_stmt_scanstatus_v2(stmt_, idx, SQLITE_SCANSTAT_NAME, flags, &name);
+      sqlite3_stmt_scanstatus_v2(stmt_, idx, SQLITE_SCANSTAT_EXPLAIN, flags, &explain);
+      sqlite3_int64 cycles = -1;
+      if (sqlite3_stmt_scanstatus_v2(stmt_, idx, SQLITE_SCANSTAT_NCYCLE, flags, &cycles) == 0) {
+        n.cycles = cycles;
+      }
+#else
+      if (sqlite3_stmt_scanstatus(stmt_, idx, SQLITE_SCANSTAT_SELECTID, &n.id) != 0) break;
+      sqlite3_stmt_scanstatus(stmt_, idx, SQLITE_SCANSTAT_NLOOP, &loops);
+      sqlite3_stmt_scanstatus(stmt_, idx, SQLITE_SCANSTAT_NVISIT, &rows);
+      sqlite3_stmt_scanstatus(stmt_, idx, SQLITE_SCANSTAT_EST, &est);
+      sqlite3_stmt_scanstatus(stmt_, idx, SQLITE_SCANSTAT_NAME, &name);
+      sqlite3_stmt_scanstatus(stmt_, idx, SQLITE_SCANSTAT_EXPLAIN, &explain);
+#endif
+      n.loops = loops;
+      n.rows = rows;
+      n.estimated_rows = est;
+      n.name = name ? name : "";
+      n.explain = explain ? explain : "";
+      flat.push_back(n);
+    }
+#endif
+
+    // Without the v2 interface there are no parent links and every loop is a root, in
+    // plan order. Otherwise nest each node under the node it names.
+    std::function<std::vector<scan_node>(int)> children_of = [&](int parent) {
+      std::vector<scan_node> out;
+      for (auto& n : flat) {
+        if (n.parent != parent) continue;
+        out.push_back(n);
+        if (n.id != parent) out.back().children = children_of(n.id);
+      }
+      return out;
+    };
+    return children_of(0);
+  }
+
+  inline void statement::reset_scan_status()
+  {
+#ifdef SQLITE_ENABLE_STMT_SCANSTATUS
+    sqlite3_stmt_scanstatus_reset(stmt_);
+#endif
+  }
+
+  inline std::string format_scan_status(std::vector<scan_node> const& nodes)
+  {
+    std::string out;
+    std::function<void(std::vector<scan_node> const&, int)> print = [&](std::vector<scan_node> const& level, int depth) {
+      for (auto& n : level) {
+        char counts[160];
+        if (n.cycles >= 0) {
+          std::snprintf(counts, sizeof(counts), "  (loops=%lld rows=%lld est=%.0f cycles=%lld)",
+                        n.loops, n.rows, n.estimated_rows * n.loops, n.cycles);
+        } else {
+          std::snprintf(counts, sizeof(counts), "  (loops=%lld rows=%lld est=%.0f)",
+                        n.loops, n.rows, n.estimated_rows * n.loops);
+        }
+        out += std::string(depth * 2, ' ') + n.explain + counts + "\n";
+        print(n.children, depth + 1);
+      }
+    };
+    print(nodes, 0);
+    return out;
+  }
+
+  inline int statement::step_impl()
+  {
+    auto rc = sqlite3_step(stmt_);
+    while (db_.unotify_ && is_shared_cache_locked(db_.db_, rc)) {
+      if ((rc = db_.wait_for_unlock()) != SQLITE_OK) break;
+      sqlite3_reset(stmt_);
+      rc = sqlite3_step(stmt_);
+    }
+    return rc;
+  }
+
+  inline int statement::reset()
+  {
+    memory_account::scope ms(db_.macct_);
+    end_execution();
+    auto rc = sqlite3_reset(stmt_);
+    db_.check_committed();
+    return rc;
+  }
+
+  inline void statement::set_timeout(int ms)
+  {
+    timeout_ = std::chrono::milliseconds(ms);
+  }
+
+  inline bool statement::timed_out() const
+  {
+    return timed_out_;
+  }
+
+  inline int statement::clear_bindings()
+  {
+    return sqlite3_clear_bindings(stmt_);
+  }
+
+  inline int statement::bind(int idx, int value)
+  {
+    if (!check_owner()) return SQLITE_MISUSE;
+    return sqlite3_bind_int(stmt_, idx, value);
+  }
+
+  inline int statement::bind(int idx, double value)
+  {
+    if (!check_owner()) return SQLITE_MISUSE;
+    return sqlite3_bind_double(stmt_, idx, value);
+  }
+
+  inline int statement::bind(int idx, long long int value)
+  {
+    if (!check_owner()) return SQLITE_MISUSE;
+    return sqlite3_bind_int64(stmt_, idx, value);
+  }
+
+  inline int statement::bind(int idx, char const* value, copy_semantic fcopy)
+  {
+    if (!check_owner()) return SQLITE_MISUSE;
+    memory_account::scope ms(db_.macct_);
+    return sqlite3_bind_text(stmt_, idx, value, std::strlen(value), fcopy == copy ? SQLITE_TRANSIENT : SQLITE_STATIC );
+  }
+
+  inline int statement::bind(int idx, char16_t const* value, copy_semantic fcopy)
+  {
+    if (!check_owner()) return SQLITE_MISUSE;
+    memory_account::scope ms(db_.macct_);
+    return sqlite3_bind_text16(stmt_, idx, value, std::char_traits<char16_t>::length(value) * sizeof(char16_t), fcopy == copy ? SQLITE_TRANSIENT : SQLITE_STATIC );
+  }
+
+  inline int statement::bind(int idx, void const* value, int n, copy_semantic fcopy)
+  {
+    if (!check_owner()) return SQLITE_MISUSE;
+    memory_account::scope ms(db_.macct_);
+    return sqlite3_bind_blob(stmt_, idx, value, n, fcopy == copy ? SQLITE_TRANSIENT : SQLITE_STATIC );
+  }
+
+  inline int statement::bind(int idx, std::string const& value, copy_semantic fcopy)
+  {
+    if (!check_owner()) return SQLITE_MISUSE;
+    memory_account::scope ms(db_.macct_);
+    return sqlite3_bind_text(stmt_, idx, value.c_str(), value.size(), fcopy == copy ? SQLITE_TRANSIENT : SQLITE_STATIC );
+  }
+
+  inline int statement::bind(int idx)
+  {
+    if (!check_owner()) return SQLITE_MISUSE;
+    return sqlite3_bind_null(stmt_, idx);
+  }
+
+  inline int statement::bind(int idx, null_type)
+  {
+    return bind(idx);
+  }
+
+  inline int statement::bind(int idx, value const& v, copy_semantic fcopy)
+  {
+    if (!check_owner()) return SQLITE_MISUSE;
+    memory_account::scope ms(db_.macct_);
+    auto destructor = fcopy == copy ? SQLITE_TRANSIENT : SQLITE_STATIC;
+    switch (v.type()) {
+      case SQLITE_INTEGER:
+        return sqlite3_bind_int64(stmt_, idx, v.as_int());
+      case SQLITE_FLOAT:
+        return sqlite3_bind_double(stmt_, idx, v.as_double());
+      case SQLITE_TEXT: {
+        auto t = v.as_text();
+        return sqlite3_bind_text64(stmt_, idx, t.data, t.size, destructor, SQLITE_UTF8);
+      }
+      case SQLITE_BLOB: {
+        auto b = v.as_blob();
+        return sqlite3_bind_blob64(stmt_, idx, b.data, b.size, destructor);
+      }
+      default:
+        return sqlite3_bind_null(stmt_, idx);
+    }
+  }
+
+  inline int statement::bind(char const* name, int value)
+  {
+    auto idx = sqlite3_bind_parameter_index(stmt_, name);
+    return bind(idx, value);
+  }
+
+  inline int statement::bind(char const* name, double value)
+  {
+    auto idx = sqlite3_bind_parameter_index(stmt_, name);
+    return bind(idx, value);
+  }
+
+  inline int statement::bind(char const* name, long long int value)
+  {
+    auto idx = sqlite3_bind_parameter_index(stmt_, name);
+    return bind(idx, value);
+  }
+
+  inline int statement::bind(char const* name, char const* value, copy_semantic fcopy)
+  {
+    auto idx = sqlite3_bind_parameter_index(stmt_, name);
+    return bind(idx, value, fcopy);
+  }
+
+  inline int statement::bind(char const* name, void const* value, int n, copy_semantic fcopy)
+  {
+    auto idx = sqlite3_bind_parameter_index(stmt_, name);
+    return bind(idx, value, n, fcopy);
+  }
+
+  inline int statement::bind(char const* name, std::string const& value, copy_semantic fcopy)
+  {
+    auto idx = sqlite3_bind_parameter_index(stmt_, name);
+    return bind(idx, value, fcopy);
+  }
+
+  inline int statement::bind(char const* name, char16_t const* value, copy_semantic fcopy)
+  {
+    auto idx = sqlite3_bind_parameter_index(stmt_, name);
+    return bind(idx, value, fcopy);
+  }
+
+  inline int statement::bind(char const* name)
+  {
+    auto idx = sqlite3_bind_parameter_index(stmt_, name);
+    return bind(idx);
+  }
+
+  inline int statement::bind(char const* name, null_type)
+  {
+    return bind(name);
+  }
+
+  inline int statement::bind(char const* name, value const& v, copy_semantic fcopy)
+  {
+    auto idx = sqlite3_bind_parameter_index(stmt_, name);
+    return bind(idx, v, fcopy);
+  }
+
+
+  inline command::bindstream::bindstream(command& cmd, int idx) : cmd_(cmd), idx_(idx)
+  {
+  }
+
+  inline command::command(database& db, char const* stmt) : statement(db, stmt)
+  {
+  }
+
+  inline command::bindstream command::binder(int idx)
+  {
+    return bindstream(*this, idx);
+  }
+
+  inline int command::execute()
+  {
+    auto rc = step();
+    if (rc == SQLITE_DONE) rc = SQLITE_OK;
+
+    return rc;
+  }
+
+  inline int command::execute_all()
+  {
+    auto rc = execute();
+    if (rc != SQLITE_OK) return rc;
+
+    char const* sql = tail_;
+
+    while (std::strlen(sql) > 0) { // sqlite3_complete() is broken.
+      sqlite3_stmt* old_stmt = stmt_;
+
+      if ((rc = prepare_impl(sql)) != SQLITE_OK) return rc;
+
+      if (stmt_) {
+        // Best-effort transfer: allows mixing parameterized and non-parameterized statements.
+        sqlite3_transfer_bindings(old_stmt, stmt_);
+
+        finish_impl(old_stmt);
+
+        if ((rc = execute()) != SQLITE_OK) return rc;
+      } else {
+        finish_impl(old_stmt);
+      }
+
+      sql = tail_;
+    }
+
+    return rc;
+  }
+
+
+  inline query::rows::getstream::getstream(rows* rws, int idx) : rws_(rws), idx_(idx)
+  {
+  }
+
+  inline query::rows::rows(sqlite3_stmt* stmt, memory_account* macct) : stmt_(stmt), macct_(macct)
+  {
+  }
+
+  inline int query::rows::data_count() const
+  {
+    return sqlite3_data_count(stmt_);
+  }
+
+  inline int query::rows::column_type(int idx) const
+  {
+    return sqlite3_column_type(stmt_, idx);
+  }
+
+  inline int query::rows::column_bytes(int idx) const
+  {
+    memory_account::scope ms(macct_);
+    return sqlite3_column_bytes(stmt_, idx);
+  }
+
+  inline int query::rows::get(int idx, int) const
+  {
+    return sqlite3_column_int(stmt_, idx);
+  }
+
+  inline double query::rows::get(int idx, double) const
+  {
+    return sqlite3_column_double(stmt_, idx);
+  }
+
+  inline long long int query::rows::get(int idx, long long int) const
+  {
+    return sqlite3_column_int64(stmt_, idx);
+  }
+
+  inline char const* query::rows::get(int idx, char const*) const
+  {
+    memory_account::scope ms(macct_);
+    return reinterpret_cast<char const*>(sqlite3_column_text(stmt_, idx));
+  }
+
+  inline char16_t const* query::rows::get(int idx, char16_t const*) const
+  {
+    memory_account::scope ms(macct_);
+    return reinterpret_cast<char16_t const*>(sqlite3_column_text16(stmt_, idx));
+  }
+
+  inline std::string query::rows::get(int idx, std::string) const
+  {
+    char const* c = get(idx, (char const*)0);
+    return c ? std::string(c) : std::string();
+  }
+
+  inline void const* query::rows::get(int idx, void const*) const
+  {
+    memory_account::scope ms(macct_);
+    return sqlite3_column_blob(stmt_, idx);
+  }
+
+  inline null_type query::rows::get(int /*idx*/, null_type) const
+  {
+    return ignore;
+  }
+
+  inline value query::rows::get(int idx, value) const
+  {
+    return get_value(idx);
+  }
+
+  inline value query::rows::get_value(int idx, copy_semantic fcopy) const
+  {
+    memory_account::scope ms(macct_);
+    switch (sqlite3_column_type(stmt_, idx)) {
+      case SQLITE_INTEGER:
+        return value(static_cast<long long int>(sqlite3_column_int64(stmt_, idx)));
+      case SQLITE_FLOAT:
+        return value(sqlite3_column_double(stmt_, idx));
+      case SQLITE_TEXT: {
+        auto data = reinterpret_cast<char const*>(sqlite3_column_text(stmt_, idx));
+        std::size_t size = sqlite3_column_bytes(stmt_, idx);
+        return value(text_view{data, size}, fcopy);
+      }
+      case SQLITE_BLOB: {
+        auto data = sqlite3_column_blob(stmt_, idx);
+        std::size_t size = sqlite3_column_bytes(stmt_, idx);
+        return value(blob_view{data, size}, fcopy);
+      }
+      default:
+        return value();
+    }
+  }
+  
+  inline query::rows::getstream query::rows::getter(int idx)
+  {
+    return getstream(this, idx);
+  }
+
+  inline query::query_iterator::query_iterator() : cmd_(nullptr)
+  {
+    rc_ = SQLITE_DONE;
+  }
+
+  inline query::query_iterator::query_iterator(query* cmd) : cmd_(cmd)
+  {
+    rc_ = cmd_->step();
+    if (rc_ != SQLITE_ROW && rc_ != SQLITE_DONE) {
+      if (cmd_->timed_out()) throw deadline_exceeded();
+      throw database_error(cmd_->db_);
+    }
+  }
+
+  inline bool query::query_iterator::operator==(query::query_iterator const& other) const
+  {
+    return rc_ == other.rc_;
+  }
+
+  inline bool query::query_iterator::operator!=(query::query_iterator const& other) const
+  {
+    return rc_ != other.rc_;
+  }
+
+  inline query::query_iterator& query::query_iterator::operator++()
+  {
+    rc_ = cmd_->step();
+    if (rc_ != SQLITE_ROW && rc_ != SQLITE_DONE) {
+      if (cmd_->timed_out()) throw deadline_exceeded();
+      throw database_error(cmd_->db_);
+    }
+    return *this;
+  }
+
+  inline query::query_iterator::value_type query::query_iterator::operator*() const
   {
-    // finish() can return error. If you want to check the error, call
-    // finish() explicitly before this object is destructed.
-    finish();
+    return rows(cmd_->stmt_, cmd_->db_.macct_);
   }
 
-  inline int statement::prepare(char const* stmt)
+  inline result_set query::materialize(arena& a)
   {
-    auto rc = finish();
-    if (rc != SQLITE_OK)
-      return rc;
+    result_set r;
+    r.cols_ = column_count();
+    r.names_ = static_cast<text_view*>(a.allocate(sizeof(text_view) * (r.cols_ ? r.cols_ : 1), alignof(text_view)));
+    for (int c = 0; c < r.cols_; ++c) {
+      auto name = column_name(c);
+      auto n = std::strlen(name);
+      r.names_[c].data = a.copy(name, n + 1);
+      r.names_[c].size = n;
+    }
 
-    return prepare_impl(stmt);
+    // Grows by doubling; the outgrown arrays stay in the arena until reset.
+    std::size_t capacity = 0;
+    int rc;
+    while ((rc = step()) == SQLITE_ROW) {
+      if (r.rows_ == capacity) {
+        capacity = capacity ? capacity * 2 : 16;
+        auto cells = static_cast<cell*>(a.allocate(sizeof(cell) * capacity * (r.cols_ ? r.cols_ : 1), alignof(cell)));
+        if (r.rows_) std::memcpy(cells, r.cells_, sizeof(cell) * r.rows_ * r.cols_);
+        r.cells_ = cells;
+      }
+      auto row = r.cells_ + r.rows_ * r.cols_;
+      for (int c = 0; c < r.cols_; ++c) {
+        auto& cl = row[c];
+        cl.type = sqlite3_column_type(stmt_, c);
+        switch (cl.type) {
+          case SQLITE_INTEGER:
+            cl.i = sqlite3_column_int64(stmt_, c);
+            break;
+          case SQLITE_FLOAT:
+            cl.d = sqlite3_column_double(stmt_, c);
+            break;
+          case SQLITE_TEXT: {
+            auto p = reinterpret_cast<char const*>(sqlite3_column_text(stmt_, c));
+            cl.text.size = sqlite3_column_bytes(stmt_, c);
+            // Keep a terminator so data can be used as a C string.
+            auto d = static_cast<char*>(a.allocate(cl.text.size + 1, 1));
+            std::memcpy(d, p, cl.text.size);
+            d[cl.text.size] = '\0';
+            cl.text.data = d;
+            break;
+          }
+          case SQLITE_BLOB:
+            cl.blob.size = sqlite3_column_bytes(stmt_, c);
+            cl.blob.data = a.copy(sqlite3_column_blob(stmt_, c), cl.blob.size);
+            break;
+          default:
+            cl.i = 0;
+            break;
+        }
+      }
+      ++r.rows_;
+    }
+    if (rc != SQLITE_DONE) {
+      if (timed_out()) throw deadline_exceeded();
+      throw database_error(db_);
+    }
+    return r;
   }
 
-  inline int statement::prepare_impl(char const* stmt)
+  inline arena::arena(std::size_t block_size)
+    : block_size_(block_size), head_(nullptr), current_(nullptr), cur_(nullptr), end_(nullptr), used_(0), reserved_(0)
   {
-    return sqlite3_prepare_v2(db_.db_, stmt, std::strlen(stmt), &stmt_, &tail_);
   }
 
-  inline int statement::finish()
+  inline arena::~arena()
   {
-    auto rc = SQLITE_OK;
-    if (stmt_) {
-      rc = finish_impl(stmt_);
-      stmt_ = nullptr;
+    while (head_) {
+      auto next = head_->next;
+      std::free(head_);
+      head_ = next;
     }
-    tail_ = nullptr;
-
-    return rc;
   }
 
-  inline int statement::finish_impl(sqlite3_stmt* stmt)
+  inline arena::block* arena::new_block(std::size_t min_size)
   {
-    return sqlite3_finalize(stmt);
+    auto size = std::max(block_size_, min_size + sizeof(block));
+    auto b = static_cast<block*>(std::malloc(size));
+    if (!b) throw std::bad_alloc();
+    b->next = nullptr;
+    b->size = size;
+    reserved_ += size;
+    return b;
   }
 
-  inline int statement::step()
+  inline void arena::enter(block* b)
   {
-    return sqlite3_step(stmt_);
+    current_ = b;
+    cur_ = reinterpret_cast<char*>(b + 1);
+    end_ = reinterpret_cast<char*>(b) + b->size;
   }
 
-  inline int statement::reset()
+  inline char* arena::fit(std::size_t n, std::size_t align) const
   {
-    return sqlite3_reset(stmt_);
+    if (!current_) return nullptr;
+    auto p = (reinterpret_cast<std::uintptr_t>(cur_) + align - 1) & ~static_cast<std::uintptr_t>(align - 1);
+    return p + n <= reinterpret_cast<std::uintptr_t>(end_) ? reinterpret_cast<char*>(p) : nullptr;
   }
 
-  inline int statement::clear_bindings()
+  inline void* arena::allocate(std::size_t n, std::size_t align)
   {
-    return sqlite3_clear_bindings(stmt_);
+    auto p = fit(n, align);
+    // Reuse the blocks kept by reset() before asking for more.
+    while (!p && current_ && current_->next) {
+      enter(current_->next);
+      p = fit(n, align);
+    }
+    if (!p) {
+      auto b = new_block(n + align);
+      if (current_) {
+        b->next = current_->next;
+        current_->next = b;
+      } else {
+        b->next = head_;
+        head_ = b;
+      }
+      enter(b);
+      p = fit(n, align);
+    }
+    cur_ = p + n;
+    used_ += n;
+    return p;
   }
 
-  inline int statement::bind(int idx, int value)
+  inline char const* arena::copy(void const* data, std::size_t n)
   {
-    return sqlite3_bind_int(stmt_, idx, value);
+    auto p = static_cast<char*>(allocate(n ? n : 1, 1));
+    if (n) std::memcpy(p, data, n);
+    return p;
   }
 
-  inline int statement::bind(int idx, double value)
+  inline void arena::reset()
   {
-    return sqlite3_bind_double(stmt_, idx, value);
+    if (head_) enter(head_);
+    used_ = 0;
   }
 
-  inline int statement::bind(int idx, long long int value)
+  inline std::size_t arena::bytes_used() const
   {
-    return sqlite3_bind_int64(stmt_, idx, value);
+    return used_;
   }
 
-  inline int statement::bind(int idx, char const* value, copy_semantic fcopy)
+  inline std::size_t arena::bytes_reserved() const
   {
-    return sqlite3_bind_text(stmt_, idx, value, std::strlen(value), fcopy == copy ? SQLITE_TRANSIENT : SQLITE_STATIC );
+    return reserved_;
   }
 
-  inline int statement::bind(int idx, char16_t const* value, copy_semantic fcopy)
+  inline std::string text_view::str() const
   {
-    return sqlite3_bind_text16(stmt_, idx, value, std::char_traits<char16_t>::length(value) * sizeof(char16_t), fcopy == copy ? SQLITE_TRANSIENT : SQLITE_STATIC );
+    return std::string(data, size);
   }
 
-  inline int statement::bind(int idx, void const* value, int n, copy_semantic fcopy)
+  inline value::value() : type_(SQLITE_NULL), storage_(local), size_(0), i_(0)
   {
-    return sqlite3_bind_blob(stmt_, idx, value, n, fcopy == copy ? SQLITE_TRANSIENT : SQLITE_STATIC );
   }
 
-  inline int statement::bind(int idx, std::string const& value, copy_semantic fcopy)
+  inline value::value(null_type) : value()
   {
-    return sqlite3_bind_text(stmt_, idx, value.c_str(), value.size(), fcopy == copy ? SQLITE_TRANSIENT : SQLITE_STATIC );
   }
 
-  inline int statement::bind(int idx)
+  inline value::value(int v) : type_(SQLITE_INTEGER), storage_(local), size_(0), i_(v)
   {
-    return sqlite3_bind_null(stmt_, idx);
   }
 
-  inline int statement::bind(int idx, null_type)
+  inline value::value(long v) : value(static_cast<long long int>(v))
   {
-    return bind(idx);
   }
 
-  inline int statement::bind(char const* name, int value)
+  inline value::value(long long int v) : type_(SQLITE_INTEGER), storage_(local), size_(0), i_(v)
   {
-    auto idx = sqlite3_bind_parameter_index(stmt_, name);
-    return bind(idx, value);
   }
 
-  inline int statement::bind(char const* name, double value)
+  inline value::value(unsigned v) : value(static_cast<long long int>(v))
   {
-    auto idx = sqlite3_bind_parameter_index(stmt_, name);
-    return bind(idx, value);
   }
 
-  inline int statement::bind(char const* name, long long int value)
+  inline value::value(unsigned long v) : value(static_cast<unsigned long long>(v))
   {
-    auto idx = sqlite3_bind_parameter_index(stmt_, name);
-    return bind(idx, value);
   }
 
-  inline int statement::bind(char const* name, char const* value, copy_semantic fcopy)
+  inline value::value(unsigned long long v) : type_(SQLITE_INTEGER), storage_(local), size_(0), i_(0)
   {
-    auto idx = sqlite3_bind_parameter_index(stmt_, name);
-    return bind(idx, value, fcopy);
+    if (v > static_cast<unsigned long long>(std::numeric_limits<long long int>::max())) {
+      type_ = SQLITE_FLOAT;
+      d_ = static_cast<double>(v);
+    } else {
+      i_ = static_cast<long long int>(v);
+    }
   }
 
-  inline int statement::bind(char const* name, void const* value, int n, copy_semantic fcopy)
+  inline value::value(double v) : type_(SQLITE_FLOAT), storage_(local), size_(0), d_(v)
   {
-    auto idx = sqlite3_bind_parameter_index(stmt_, name);
-    return bind(idx, value, n, fcopy);
   }
 
-  inline int statement::bind(char const* name, std::string const& value, copy_semantic fcopy)
+  inline value::value(char const* s, copy_semantic fcopy) : value()
   {
-    auto idx = sqlite3_bind_parameter_index(stmt_, name);
-    return bind(idx, value, fcopy);
+    if (s) assign(SQLITE_TEXT, s, std::strlen(s), fcopy);
   }
 
-  inline int statement::bind(char const* name, char16_t const* value, copy_semantic fcopy)
+  inline value::value(std::string const& s, copy_semantic fcopy) : value()
   {
-    auto idx = sqlite3_bind_parameter_index(stmt_, name);
-    return bind(idx, value, fcopy);
+    assign(SQLITE_TEXT, s.data(), s.size(), fcopy);
   }
 
-  inline int statement::bind(char const* name)
+  inline value::value(text_view s, copy_semantic fcopy) : value()
   {
-    auto idx = sqlite3_bind_parameter_index(stmt_, name);
-    return bind(idx);
+    assign(SQLITE_TEXT, s.data, s.size, fcopy);
   }
 
-  inline int statement::bind(char const* name, null_type)
+  inline value::value(blob_view b, copy_semantic fcopy) : value()
   {
-    return bind(name);
+    assign(SQLITE_BLOB, b.data, b.size, fcopy);
   }
 
-
-  inline command::bindstream::bindstream(command& cmd, int idx) : cmd_(cmd), idx_(idx)
+  inline value::value(value const& other) : value()
   {
+    assign(other);
   }
 
-  inline command::command(database& db, char const* stmt) : statement(db, stmt)
+  inline value::value(value&& other) : value()
   {
+    steal(other);
   }
 
-  inline command::bindstream command::binder(int idx)
+  inline value::~value()
   {
-    return bindstream(*this, idx);
+    release();
   }
 
-  inline int command::execute()
+  inline value& value::operator=(value const& other)
   {
-    auto rc = step();
-    if (rc == SQLITE_DONE) rc = SQLITE_OK;
-
-    return rc;
+    if (this != &other) {
+      release();
+      assign(other);
+    }
+    return *this;
   }
 
-  inline int command::execute_all()
+  inline value& value::operator=(value&& other)
   {
-    auto rc = execute();
-    if (rc != SQLITE_OK) return rc;
-
-    char const* sql = tail_;
-
-    while (std::strlen(sql) > 0) { // sqlite3_complete() is broken.
-      sqlite3_stmt* old_stmt = stmt_;
-
-      if ((rc = prepare_impl(sql)) != SQLITE_OK) return rc;
-
-      if (stmt_) {
-        // Best-effort transfer: allows mixing parameterized and non-parameterized statements.
-        sqlite3_transfer_bindings(old_stmt, stmt_);
-
-        finish_impl(old_stmt);
-
-        if ((rc = execute()) != SQLITE_OK) return rc;
-      } else {
-        finish_impl(old_stmt);
-      }
-
-      sql = tail_;
+    if (this != &other) {
+      release();
+      steal(other);
     }
+    return *this;
+  }
 
-    return rc;
+  inline int value::type() const
+  {
+    return type_;
   }
 
+  inline bool value::is_null() const
+  {
+    return type_ == SQLITE_NULL;
+  }
 
-  inline query::rows::getstream::getstream(rows* rws, int idx) : rws_(rws), idx_(idx)
+  inline bool value::is_inline() const
   {
+    return storage_ == local;
   }
 
-  inline query::rows::rows(sqlite3_stmt* stmt) : stmt_(stmt)
+  inline bool value::is_borrowed() const
   {
+    return storage_ == borrowed;
   }
 
-  inline int query::rows::data_count() const
+  inline long long int value::as_int() const
   {
-    return sqlite3_data_count(stmt_);
+    if (type_ == SQLITE_INTEGER) return i_;
+    if (type_ == SQLITE_FLOAT) return static_cast<long long int>(d_);
+    return 0;
   }
 
-  inline int query::rows::column_type(int idx) const
+  inline double value::as_double() const
   {
-    return sqlite3_column_type(stmt_, idx);
+    if (type_ == SQLITE_FLOAT) return d_;
+    if (type_ == SQLITE_INTEGER) return static_cast<double>(i_);
+    return 0;
   }
 
-  inline int query::rows::column_bytes(int idx) const
+  inline text_view value::as_text() const
   {
-    return sqlite3_column_bytes(stmt_, idx);
+    if (type_ != SQLITE_TEXT && type_ != SQLITE_BLOB) return text_view{"", 0};
+    return text_view{data(), size()};
   }
 
-  inline int query::rows::get(int idx, int) const
+  inline blob_view value::as_blob() const
   {
-    return sqlite3_column_int(stmt_, idx);
+    if (type_ != SQLITE_TEXT && type_ != SQLITE_BLOB) return blob_view{nullptr, 0};
+    return blob_view{data(), size()};
   }
 
-  inline double query::rows::get(int idx, double) const
+  inline void value::assign(int type, void const* data, std::size_t n, copy_semantic fcopy)
   {
-    return sqlite3_column_double(stmt_, idx);
+    type_ = type;
+    // Empty values are kept inline so that data() is never null; a null
+    // blob pointer would bind as NULL.
+    std::size_t limit = inline_capacity;
+    if (type == SQLITE_TEXT) --limit;
+    if (n == 0 || (fcopy == copy && n <= limit)) {
+      storage_ = local;
+      size_ = static_cast<unsigned char>(n);
+      if (n) std::memcpy(buf_, data, n);
+      if (n < inline_capacity) buf_[n] = '\0';
+    }
+    else if (fcopy == copy) {
+      auto p = new char[n + 1];
+      std::memcpy(p, data, n);
+      p[n] = '\0';
+      storage_ = heap;
+      ext_.data = p;
+      ext_.size = n;
+    }
+    else {
+      storage_ = borrowed;
+      ext_.data = static_cast<char const*>(data);
+      ext_.size = n;
+    }
   }
 
-  inline long long int query::rows::get(int idx, long long int) const
+  inline void value::assign(value const& other)
   {
-    return sqlite3_column_int64(stmt_, idx);
+    if (other.storage_ == heap) {
+      assign(other.type_, other.ext_.data, other.ext_.size, copy);
+      return;
+    }
+    type_ = other.type_;
+    storage_ = other.storage_;
+    size_ = other.size_;
+    std::memcpy(buf_, other.buf_, inline_capacity);
   }
 
-  inline char const* query::rows::get(int idx, char const*) const
+  inline void value::steal(value& other)
   {
-    return reinterpret_cast<char const*>(sqlite3_column_text(stmt_, idx));
+    type_ = other.type_;
+    storage_ = other.storage_;
+    size_ = other.size_;
+    std::memcpy(buf_, other.buf_, inline_capacity);
+    other.storage_ = local;
+    other.type_ = SQLITE_NULL;
   }
 
-  inline char16_t const* query::rows::get(int idx, char16_t const*) const
+  inline void value::release()
   {
-    return reinterpret_cast<char16_t const*>(sqlite3_column_text16(stmt_, idx));
+    if (storage_ == heap) delete[] ext_.data;
+    type_ = SQLITE_NULL;
+    storage_ = local;
+    size_ = 0;
   }
 
-  inline std::string query::rows::get(int idx, std::string) const
+  inline char const* value::data() const
   {
-    char const* c = get(idx, (char const*)0);
-    return c ? std::string(c) : std::string();
+    return storage_ == local ? buf_ : ext_.data;
   }
 
-  inline void const* query::rows::get(int idx, void const*) const
+  inline std::size_t value::size() const
   {
-    return sqlite3_column_blob(stmt_, idx);
+    return storage_ == local ? size_ : ext_.size;
   }
 
-  inline null_type query::rows::get(int /*idx*/, null_type) const
+  inline result_set::row::row(cell const* cells, int n) : cells_(cells), n_(n)
   {
-    return ignore;
   }
-  
-  inline query::rows::getstream query::rows::getter(int idx)
+
+  inline int result_set::row::size() const
   {
-    return getstream(this, idx);
+    return n_;
   }
 
-  inline query::query_iterator::query_iterator() : cmd_(nullptr)
+  inline cell const& result_set::row::operator[](int idx) const
   {
-    rc_ = SQLITE_DONE;
+    return cells_[idx];
   }
 
-  inline query::query_iterator::query_iterator(query* cmd) : cmd_(cmd)
+  inline result_set::result_set() : names_(nullptr), cells_(nullptr), rows_(0), cols_(0)
   {
-    rc_ = cmd_->step();
-    if (rc_ != SQLITE_ROW && rc_ != SQLITE_DONE)
-      throw database_error(cmd_->db_);
   }
 
-  inline bool query::query_iterator::operator==(query::query_iterator const& other) const
+  inline std::size_t result_set::size() const
   {
-    return rc_ == other.rc_;
+    return rows_;
   }
 
-  inline bool query::query_iterator::operator!=(query::query_iterator const& other) const
+  inline int result_set::column_count() const
   {
-    return rc_ != other.rc_;
+    return cols_;
   }
 
-  inline query::query_iterator& query::query_iterator::operator++()
+  inline text_view result_set::column_name(int idx) const
   {
-    rc_ = cmd_->step();
-    if (rc_ != SQLITE_ROW && rc_ != SQLITE_DONE)
-      throw database_error(cmd_->db_);
-    return *this;
+    return names_[idx];
   }
 
-  inline query::query_iterator::value_type query::query_iterator::operator*() const
+  inline result_set::row result_set::operator[](std::size_t idx) const
   {
-    return rows(cmd_->stmt_);
+    return row(cells_ + idx * cols_, cols_);
   }
 
   inline query::query(database& db, char const* stmt) : statement(db, stmt)
@@ -628,7 +2755,7 @@ namespace sqlite3pp
   }
 
 
-  inline transaction::transaction(database& db, bool fcommit, bool freserve) : db_(&db), fcommit_(fcommit)
+  inline transaction::transaction(database& db, bool fcommit, bool freserve) : db_(&db), fcommit_(fcommit), fdeadline_(false)
   {
     int rc = db_->execute(freserve ? "BEGIN IMMEDIATE" : "BEGIN");
     if (rc != SQLITE_OK)
@@ -638,6 +2765,7 @@ namespace sqlite3pp
   inline transaction::~transaction()
   {
     if (db_) {
+      end();
       // execute() can return error. If you want to check the error,
       // call commit() or rollback() explicitly before this object is
       // destructed.
@@ -647,6 +2775,7 @@ namespace sqlite3pp
 
   inline int transaction::commit()
   {
+    end();
     auto db = db_;
     db_ = nullptr;
     int rc = db->execute("COMMIT");
@@ -655,6 +2784,7 @@ namespace sqlite3pp
 
   inline int transaction::rollback()
   {
+    end();
     auto db = db_;
     db_ = nullptr;
     int rc = db->execute("ROLLBACK");
@@ -662,6 +2792,259 @@ namespace sqlite3pp
   }
 
 
+  inline void transaction::set_timeout(int ms)
+  {
+    if (!db_) return;
+    db_->set_deadline(std::chrono::steady_clock::now() + std::chrono::milliseconds(ms));
+    fdeadline_ = true;
+  }
+
+  inline void transaction::end()
+  {
+    // COMMIT and ROLLBACK themselves are never cut short.
+    if (fdeadline_) {
+      db_->clear_deadline();
+      fdeadline_ = false;
+    }
+  }
+
+
+  inline pragma_scope::pragma_scope(database& db, pragma_settings const& settings) : db_(&db)
+  {
+    saved_ = saved_pragmas(db, settings);
+    auto rc = db.apply_pragmas(settings);
+    if (rc != SQLITE_OK)
+      throw database_error(sqlite3_errstr(rc));
+  }
+
+  inline pragma_scope::~pragma_scope()
+  {
+    revert();
+  }
+
+  inline int pragma_scope::revert()
+  {
+    if (!db_) return SQLITE_OK;
+    auto db = db_;
+    db_ = nullptr;
+    return apply_pragmas_impl(*db, saved_);
+  }
+
+
+  inline bulk_load_session::bulk_load_session(database& db, std::vector<std::string> const& tables, int threads)
+    : db_(&outside_transaction(db)), pragmas_(db, bulk_load_settings()), threads_(db.set_limit(limit_worker_threads, threads))
+  {
+    try {
+      {
+        // UNIQUE indexes enforce constraints while loading, and partial
+        // ones are cheap to maintain.
+        query qry(db,
+                  "SELECT m.name, m.sql FROM sqlite_master m "
+                  "WHERE m.type = 'index' AND m.sql IS NOT NULL AND m.tbl_name = ? COLLATE NOCASE "
+                  "AND NOT EXISTS (SELECT 1 FROM pragma_index_list(m.tbl_name) l "
+                  "                WHERE l.name = m.name AND (l.\"unique\" OR l.partial))");
+        for (auto const& table : tables) {
+          qry.reset();
+          qry.bind(1, table, nocopy);
+          for (auto row : qry) {
+            names_.push_back(row.get<std::string>(0));
+            indexes_.push_back(row.get<std::string>(1));
+          }
+        }
+      }
+
+      if (!names_.empty()) {
+        // Saved with the DROPs so that recover() finds them after a crash.
+        transaction xct(db);
+        if (db.execute("CREATE TABLE IF NOT EXISTS sqlite3pp_bulk_load (name TEXT, tbl_name TEXT, sql TEXT)") != SQLITE_OK)
+          throw database_error(db);
+        {
+          command save(db, "INSERT INTO sqlite3pp_bulk_load SELECT name, tbl_name, sql FROM sqlite_master "
+                           "WHERE type = 'index' AND name = ?");
+          for (auto const& name : names_) {
+            save.reset();
+            save.bind(1, name, nocopy);
+            if (save.execute() != SQLITE_OK)
+              throw database_error(db);
+          }
+        }
+        for (auto const& name : names_) {
+          if (db.execute(("DROP INDEX " + quote_identifier(name)).c_str()) != SQLITE_OK)
+            throw database_error(db);
+        }
+        if (xct.commit() != SQLITE_OK)
+          throw database_error(db);
+      }
+    } catch (...) {
+      // pragmas_ is restored by its own destructor.
+      db.set_limit(limit_worker_threads, threads_);
+      throw;
+    }
+  }
+
+  inline bulk_load_session::~bulk_load_session()
+  {
+    if (finish() != SQLITE_OK && db_) {
+      // E.g. unwinding past a transaction that is still open.
+      if (!db_->autocommit()) {
+        db_->execute("ROLLBACK");
+        finish();
+      }
+    }
+    if (db_) {
+      db_->set_limit(limit_worker_threads, threads_);
+      pragmas_.revert();
+    }
+  }
+
+  inline int bulk_load_session::finish()
+  {
+    if (!db_) return SQLITE_OK;
+
+    if (!names_.empty()) {
+      auto rc = within_transaction(*db_, [this]() {
+        for (auto const& sql : indexes_) {
+          auto rc = db_->execute(sql.c_str());
+          if (rc != SQLITE_OK) return rc;
+        }
+        return forget_dropped_indexes(*db_, names_);
+      });
+      if (rc != SQLITE_OK) return rc;
+    }
+
+    auto db = db_;
+    db_ = nullptr;
+    db->set_limit(limit_worker_threads, threads_);
+    return pragmas_.revert();
+  }
+
+  inline std::vector<std::string> const& bulk_load_session::index_sql() const
+  {
+    return indexes_;
+  }
+
+  inline int bulk_load_session::recover(database& db)
+  {
+    {
+      query exists(db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = 'sqlite3pp_bulk_load'");
+      if (exists.begin() == exists.end()) return SQLITE_OK;
+    }
+    return within_transaction(db, [&db]() {
+      std::vector<std::string> names;
+      std::vector<std::string> indexes;
+      {
+        // Indexes whose table has been dropped since are forgotten.
+        query qry(db, "SELECT b.name, b.sql FROM sqlite3pp_bulk_load b "
+                      "WHERE EXISTS (SELECT 1 FROM sqlite_master t WHERE t.type = 'table' AND t.name = b.tbl_name) "
+                      "AND NOT EXISTS (SELECT 1 FROM sqlite_master i WHERE i.name = b.name)");
+        for (auto row : qry) {
+          names.push_back(row.get<std::string>(0));
+          indexes.push_back(row.get<std::string>(1));
+        }
+      }
+      for (auto const& sql : indexes) {
+        auto rc = db.execute(sql.c_str());
+        if (rc != SQLITE_OK) return rc;
+      }
+      return db.execute("DROP TABLE sqlite3pp_bulk_load");
+    });
+  }
+
+
+  inline cooperative_yield::cooperative_yield(yield_function f) : f_(f), state_(std::make_shared<state>())
+  {
+    state_->yields = 0;
+  }
+
+  inline change_feed::change_feed(std::size_t capacity) : state_(std::make_shared<state>(capacity))
+  {
+  }
+
+  inline int change_feed::attach(database& db)
+  {
+    if (db.uh_ || db.rh_ || db.cdh_) return SQLITE_MISUSE;
+    auto st = state_;
+    // Each connection stages its own transaction.
+    auto pending = std::make_shared<batch>();
+    db.set_update_handler([pending](int op, char const* dbname, char const* table, long long int rowid) {
+      row_change c;
+      c.op = op;
+      c.dbname = dbname;
+      c.table = table;
+      c.rowid = rowid;
+      pending->push_back(std::move(c));
+    });
+    db.set_committed_handler([st, pending]() {
+      if (!pending->empty()) {
+        batch b;
+        b.swap(*pending);
+        if (st->queue.try_push(std::move(b))) {
+          st->cv.notify_one();
+        } else {
+          ++st->dropped;
+        }
+      }
+    });
+    db.set_rollback_handler([pending]() {
+      pending->clear();
+    });
+    return SQLITE_OK;
+  }
+
+  inline bool change_feed::try_pop(batch& b)
+  {
+    return state_->queue.try_pop(b);
+  }
+
+  inline bool change_feed::pop(batch& b, std::chrono::milliseconds timeout)
+  {
+    if (try_pop(b)) return true;
+    // The writer notifies without the mutex, so a wakeup can be missed;
+    // waiting in short slices bounds the delay.
+    auto until = std::chrono::steady_clock::now() + timeout;
+    std::unique_lock<std::mutex> lock(state_->mutex);
+    while (!try_pop(b)) {
+      auto now = std::chrono::steady_clock::now();
+      if (now >= until) return false;
+      state_->cv.wait_for(lock, std::min<std::chrono::steady_clock::duration>(until - now, std::chrono::milliseconds(10)));
+    }
+    return true;
+  }
+
+  inline long long change_feed::dropped() const
+  {
+    return state_->dropped.load();
+  }
+
+  inline int cooperative_yield::operator()()
+  {
+    auto start = std::chrono::steady_clock::now();
+    if (f_) {
+      f_();
+    } else {
+      std::this_thread::yield();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    state_->yield_times.record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    ++state_->yields;
+    return 0;
+  }
+
+  inline cooperative_yield::stats cooperative_yield::statistics() const
+  {
+    stats s;
+    s.yields = state_->yields.load();
+    s.yield_times = state_->yield_times.snapshot();
+    return s;
+  }
+
+  inline void cooperative_yield::reset()
+  {
+    state_->yield_times.reset();
+    state_->yields = 0;
+  }
+
+
   inline database_error::database_error(char const* msg) : std::runtime_error(msg)
   {
   }
@@ -670,4 +3053,8 @@ namespace sqlite3pp
   {
   }
 
+  inline deadline_exceeded::deadline_exceeded(char const* msg) : database_error(msg)
+  {
+  }
+
 } // namespace sqlite3pp
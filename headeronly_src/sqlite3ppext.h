@@ -28,6 +28,7 @@
 #include <cstddef>
 #include <map>
 #include <memory>
+#include <string>
 #include <tuple>
 #include <type_traits>
 #include <utility>
@@ -71,6 +72,34 @@ namespace sqlite3pp
       return Apply<std::tuple_size<typename std::decay<T>::type>::value>::apply(
           std::forward<F>(f), std::forward<T>(t));
     }
+
+    template<size_t... Is>
+    struct index_sequence {};
+
+    template<size_t N, size_t... Is>
+    struct make_index_sequence : make_index_sequence<N-1, N-1, Is...> {};
+
+    template<size_t... Is>
+    struct make_index_sequence<0, Is...> : index_sequence<Is...> {};
+
+    // Same conversions as ext::context::get(), straight from the value.
+    inline int value_as(sqlite3_value* v, int) { return sqlite3_value_int(v); }
+    inline double value_as(sqlite3_value* v, double) { return sqlite3_value_double(v); }
+    inline long long int value_as(sqlite3_value* v, long long int) { return sqlite3_value_int64(v); }
+    inline char const* value_as(sqlite3_value* v, char const*) {
+      return reinterpret_cast<char const*>(sqlite3_value_text(v));
+    }
+    inline std::string value_as(sqlite3_value* v, std::string) {
+      auto c = reinterpret_cast<char const*>(sqlite3_value_text(v));
+      return c ? std::string(c, sqlite3_value_bytes(v)) : std::string();
+    }
+    inline void const* value_as(sqlite3_value* v, void const*) { return sqlite3_value_blob(v); }
+
+    template<typename T>
+    inline typename std::decay<T>::type arg_as(sqlite3_value* v)
+    {
+      return value_as(v, typename std::decay<T>::type());
+    }
   }
 
 
@@ -156,12 +185,35 @@ namespace sqlite3pp
 
     namespace
     {
-      template <class R, class... Ps>
-      void functionx_impl(sqlite3_context* ctx, int nargs, sqlite3_value** values)
+      template <class R>
+      struct Invoke {
+        template <class H, class... Ps, size_t... Is>
+        static void call(sqlite3_context* ctx, H& h, sqlite3_value** values, index_sequence<Is...>) {
+          context c(ctx);
+          c.result(static_cast<R>(h(arg_as<Ps>(values[Is])...)));
+        }
+      };
+
+      template <>
+      struct Invoke<void> {
+        template <class H, class... Ps, size_t... Is>
+        static void call(sqlite3_context* ctx, H& h, sqlite3_value** values, index_sequence<Is...>) {
+          h(arg_as<Ps>(values[Is])...);
+          sqlite3_result_null(ctx);
+        }
+      };
+
+      template <class H, class R, class... Ps>
+      void functionx_impl(sqlite3_context* ctx, int, sqlite3_value** values)
       {
-        context c(ctx, nargs, values);
-        auto f = static_cast<std::function<R (Ps...)>*>(sqlite3_user_data(ctx));
-        Result<R>::set(c, *f, c.to_tuple<Ps...>());
+        auto h = static_cast<H*>(sqlite3_user_data(ctx));
+        Invoke<R>::template call<H, Ps...>(ctx, *h, values, make_index_sequence<sizeof...(Ps)>());
+      }
+
+      template <class H>
+      void destroy_impl(void* p)
+      {
+        delete static_cast<H*>(p);
       }
     }
 
@@ -175,9 +227,16 @@ namespace sqlite3pp
 
       int create(char const* name, function_handler h, int nargs = 0);
 
+      // F is the SQL-facing signature, e.g. int (int, int). The callable is
+      // stored as is and owned by the connection, which destroys it when
+      // the function is replaced or the connection closes.
+      template <class F, class H> int create(char const* name, H h) {
+        return create_function_impl<F>()(db_, new H(std::move(h)), name);
+      }
+
+      // The signature is deduced from a std::function.
       template <class F> int create(char const* name, std::function<F> h) {
-        fh_[name] = std::shared_ptr<void>(new std::function<F>(h));
-        return create_function_impl<F>()(db_, fh_[name].get(), name);
+        return create_function_impl<F>()(db_, new std::function<F>(std::move(h)), name);
       }
 
      private:
@@ -188,10 +247,12 @@ namespace sqlite3pp
       template<class R, class... Ps>
       struct create_function_impl<R (Ps...)>
       {
-        int operator()(sqlite3* db, void* fh, char const* name) {
-          return sqlite3_create_function(db, name, sizeof...(Ps), SQLITE_UTF8, fh,
-                                         functionx_impl<R, Ps...>,
-                                         0, 0);
+        template <class H>
+        int operator()(sqlite3* db, H* h, char const* name) {
+          // On failure SQLite calls destroy_impl itself.
+          return sqlite3_create_function_v2(db, name, sizeof...(Ps), SQLITE_UTF8, h,
+                                            functionx_impl<H, R, Ps...>,
+                                            0, 0, destroy_impl<H>);
         }
       };
 
@@ -203,14 +264,19 @@ namespace sqlite3pp
 
     namespace
     {
+      template <class T, class... Ps, size_t... Is>
+      void step_args(T* t, sqlite3_value** values, index_sequence<Is...>)
+      {
+        t->step(arg_as<Ps>(values[Is])...);
+      }
+
       template <class T, class... Ps>
       void stepx_impl(sqlite3_context* ctx, int nargs, sqlite3_value** values)
       {
         context c(ctx, nargs, values);
         T* t = static_cast<T*>(c.aggregate_data(sizeof(T)));
         if (c.aggregate_count() == 1) new (t) T;
-        apply_f([](T* tt, Ps... ps){tt->step(ps...);},
-              std::tuple_cat(std::make_tuple(t), c.to_tuple<Ps...>()));
+        step_args<T, Ps...>(t, values, make_index_sequence<sizeof...(Ps)>());
       }
 
       template <class T>
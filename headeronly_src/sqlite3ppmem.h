@@ -0,0 +1,254 @@
+// sqlite3ppmem.h
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef SQLITE3PPMEM_H
+#define SQLITE3PPMEM_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "sqlite3pp.h"
+
+namespace sqlite3pp
+{
+  struct memory_counter
+  {
+    long long current = 0;
+    long long highwater = 0;
+  };
+
+  // Process-wide counters from sqlite3_status64(). memory_used is what
+  // sqlite3_memory_used() and sqlite3_memory_highwater() report.
+  struct memory_status
+  {
+    memory_counter memory_used;
+    // Largest single allocation requested, in bytes.
+    memory_counter malloc_size;
+    memory_counter malloc_count;
+    // Page cache slots in use, bytes that did not fit, and largest request.
+    memory_counter pagecache_used;
+    memory_counter pagecache_overflow;
+    memory_counter pagecache_size;
+  };
+
+  // reset sets the high-water marks to the current values.
+  memory_status global_memory_status(bool reset = false);
+
+  // Wraps the configured SQLite allocator so that each allocation is charged
+  // to the connection active on the calling thread; see database::memory().
+  // Like every SQLITE_CONFIG option it must run before SQLite is
+  // initialized, i.e. before the first database is opened or after
+  // sqlite3_shutdown(); otherwise SQLITE_MISUSE is returned.
+  int enable_memory_accounting();
+
+  struct pool_options
+  {
+    // Larger requests go to the allocator that was configured before.
+    int max_pooled_size = 4096;
+    // Free blocks a thread keeps per size class before returning half of
+    // them to the shared lists.
+    int thread_cache_blocks = 256;
+    // Blocks are carved from chunks of this many bytes.
+    int chunk_size = 256 * 1024;
+  };
+
+  struct pool_stats
+  {
+    long long pooled_allocations = 0;
+    long long fallback_allocations = 0;
+    long long frees = 0;
+    // Bytes requested by SQLite and bytes of the size-class slots holding
+    // them, for live pooled allocations.
+    long long live_requested = 0;
+    long long live_reserved = 0;
+    // Bytes obtained for chunks so far.
+    long long chunk_bytes = 0;
+
+    // Share of slot bytes lost to rounding up to a size class.
+    double internal_fragmentation() const;
+    // Share of chunk bytes sitting in free lists.
+    double external_fragmentation() const;
+  };
+
+  enum huge_page_mode { no_huge_pages, transparent_huge_pages, explicit_huge_pages };
+
+  // Anonymous memory mapping for SQLite buffers. explicit_huge_pages uses
+  // MAP_HUGETLB and falls back to normal pages when none are reserved;
+  // transparent_huge_pages asks for them with madvise(MADV_HUGEPAGE).
+  class mapped_buffer : noncopyable
+  {
+   public:
+    explicit mapped_buffer(std::size_t size, huge_page_mode mode = no_huge_pages);
+    ~mapped_buffer();
+
+    void* data() const;
+    std::size_t size() const;
+    // Whether huge pages were granted, or at least requested for THP.
+    bool huge_pages() const;
+
+   private:
+    void* data_;
+    std::size_t size_;
+    std::size_t mapped_;
+    bool huge_;
+  };
+
+  struct page_cache_stats
+  {
+    int slot_size = 0;
+    int slots = 0;
+    bool huge_pages = false;
+    // Slots in use, bytes that had to come from the heap instead, and the
+    // largest page cache request.
+    memory_counter used;
+    memory_counter overflow;
+    memory_counter largest;
+
+    // False once any page did not fit in the configured slots.
+    bool sufficient() const;
+  };
+
+  struct shared_page_cache_stats
+  {
+    long long hits = 0;
+    long long misses = 0;
+    long long evictions = 0;
+    long long pages = 0;
+    // Bytes of pages from purgeable (file backed) caches, and their budget.
+    long long bytes = 0;
+    long long budget = 0;
+
+    double hit_rate() const;
+  };
+
+  // Process-wide SQLite configuration. Like sqlite3_config() these must run
+  // before SQLite is initialized and return SQLITE_MISUSE otherwise.
+  class config
+  {
+   public:
+    // Serves small allocations from per-thread size-class free lists and
+    // falls back to the previously configured allocator for the rest.
+    // When combined with enable_memory_accounting(), install this first.
+    // Once installed, calling it again with different options returns
+    // SQLITE_MISUSE.
+    static int use_pool_allocator(pool_options const& opts = pool_options());
+    static pool_stats pool_statistics();
+
+    // Bytes SQLite adds to each page cache slot (SQLITE_CONFIG_PCACHE_HDRSZ).
+    static int page_cache_header_size();
+    // Gives SQLite a mapped buffer of slots for pages of page_size bytes
+    // (SQLITE_CONFIG_PAGECACHE). Pages that do not fit go to the heap and
+    // show up in page_cache_statistics().overflow.
+    static int use_page_cache(int page_size, int slots, huge_page_mode mode = no_huge_pages);
+    static page_cache_stats page_cache_statistics(bool reset = false);
+
+    // Replaces the per-connection page caches with one pool
+    // (SQLITE_CONFIG_PCACHE2): all file backed connections draw pages from
+    // a single byte budget, and unpinned pages are evicted with a CLOCK
+    // sweep over lock-striped shards, whichever connection owns them. The
+    // budget takes the place of each connection's cache_size. Pages are
+    // still private to their connection; SQLITE_OPEN_SHAREDCACHE is what
+    // shares page contents.
+    static int use_shared_page_cache(long long budget_bytes, int shards = 16);
+    static shared_page_cache_stats shared_page_cache_statistics();
+
+   private:
+    static std::unique_ptr<mapped_buffer>& page_cache_buffer();
+    static page_cache_stats& page_cache_config();
+  };
+
+  struct release_event
+  {
+    std::chrono::system_clock::time_point when;
+    std::string name;
+    // Page cache bytes of the connection before and after the release.
+    long long cache_before = 0;
+    long long cache_after = 0;
+    // Drop in sqlite3_memory_used() across the release.
+    long long released = 0;
+    std::chrono::nanoseconds took = std::chrono::nanoseconds(0);
+  };
+
+  // Keeps SQLite's heap under a budget across many connections. It sets
+  // sqlite3_soft_heap_limit64() to the budget and, when usage is above it,
+  // calls release_memory() on the connections whose caches were used least
+  // recently until usage is back under. Connections must allow calls from
+  // the manager's thread, i.e. not be opened with SQLITE_OPEN_NOMUTEX.
+  class memory_budget : noncopyable
+  {
+   public:
+    using event_handler = std::function<void (release_event const&)>;
+
+    explicit memory_budget(long long budget_bytes, event_handler h = event_handler());
+    ~memory_budget();
+
+    // Sets sqlite3_hard_heap_limit64(); 0 removes it.
+    void set_hard_limit(long long bytes);
+
+    void add(database& db, std::string const& name);
+    void remove(database& db);
+
+    // Returns the bytes released.
+    long long enforce();
+
+    void start(std::chrono::milliseconds interval);
+    void stop();
+
+   private:
+    struct entry {
+      std::string name;
+      database* db;
+      long long accesses;
+      std::chrono::steady_clock::time_point last_used;
+    };
+
+    void run(std::chrono::milliseconds interval);
+
+   private:
+    long long budget_;
+    long long prev_limit_;
+    event_handler h_;
+
+    std::mutex mutex_;
+    std::vector<entry> dbs_;
+
+    std::mutex run_mutex_;
+    std::condition_variable cv_;
+    bool stop_;
+    std::thread thread_;
+  };
+
+} // namespace sqlite3pp
+
+#include "sqlite3ppmem.ipp"
+
+#endif
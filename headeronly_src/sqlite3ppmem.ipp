@@ -0,0 +1,1065 @@
+// sqlite3ppmem.ipp
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <unordered_map>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace sqlite3pp
+{
+
+  namespace
+  {
+    // Each block starts with a header naming the account it was charged
+    // to; 16 bytes keeps the payload aligned like the underlying allocator.
+    struct counting_malloc
+    {
+      static const int header = 16;
+
+      static sqlite3_mem_methods& base() {
+        static sqlite3_mem_methods m;
+        return m;
+      }
+
+      static memory_account*& owner(void* block) {
+        return *static_cast<memory_account**>(block);
+      }
+
+      static void* xmalloc(int n) {
+        auto p = static_cast<char*>(base().xMalloc(n + header));
+        if (!p) return nullptr;
+        auto a = memory_account::active();
+        owner(p) = a;
+        if (a) a->charge(base().xSize(p) - header);
+        return p + header;
+      }
+
+      static void xfree(void* q) {
+        if (!q) return;
+        auto p = static_cast<char*>(q) - header;
+        if (auto a = owner(p)) a->charge(-(base().xSize(p) - header), false);
+        base().xFree(p);
+      }
+
+      static void* xrealloc(void* q, int n) {
+        auto p = static_cast<char*>(q) - header;
+        auto a = owner(p);
+        auto old = base().xSize(p);
+        auto np = static_cast<char*>(base().xRealloc(p, n + header));
+        if (!np) return nullptr;
+        if (a) a->charge(base().xSize(np) - old, false);
+        return np + header;
+      }
+
+      static int xsize(void* q) {
+        return base().xSize(static_cast<char*>(q) - header) - header;
+      }
+
+      static int xroundup(int n) {
+        return base().xRoundup(n + header) - header;
+      }
+
+      static int xinit(void*) {
+        return base().xInit(base().pAppData);
+      }
+
+      static void xshutdown(void*) {
+        base().xShutdown(base().pAppData);
+      }
+    };
+    // Size classes step by a quarter of the power of two below them:
+    // 16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, ...
+    struct size_classes
+    {
+      static int size_of(int cls) {
+        if (cls < 8) return (cls + 1) * 16;
+        auto base = 128 << ((cls - 8) / 4);
+        return base + (base / 4) * ((cls - 8) % 4 + 1);
+      }
+
+      static int class_of(int n) {
+        if (n <= 128) return n <= 16 ? 0 : (n - 1) / 16;
+        int cls = 8;
+        while (size_of(cls) < n) ++cls;
+        return cls;
+      }
+    };
+
+    // Blocks start with a header holding the size class, or fallback, and
+    // the requested size; 16 bytes keeps the payload aligned.
+    struct pool_header
+    {
+      static const int size = 16;
+      static const unsigned fallback = 0xffffffffu;
+      unsigned cls;
+      int requested;
+    };
+
+    struct pool_allocator
+    {
+      struct free_block {
+        free_block* next;
+      };
+
+      struct free_list {
+        free_block* head = nullptr;
+        int count = 0;
+      };
+
+      struct thread_cache;
+
+      struct shared_state {
+        pool_options opts;
+        int classes = 0;
+        sqlite3_mem_methods base;
+
+        std::mutex mutex;
+        std::vector<free_list> central;
+        char* chunk = nullptr;
+        int chunk_left = 0;
+        std::vector<thread_cache*> caches;
+
+        // Counters of threads that have exited.
+        pool_stats retired;
+        std::atomic<long long> chunk_bytes;
+        std::atomic<bool> installed;
+
+        shared_state() : chunk_bytes(0), installed(false) {}
+      };
+
+      static shared_state& shared() {
+        static shared_state* s = new shared_state();
+        return *s;
+      }
+
+      struct thread_cache {
+        std::vector<free_list> lists;
+        // Written by the owning thread only, read by pool_statistics().
+        std::atomic<long long> pooled, fallback, frees, requested, reserved;
+
+        thread_cache() : lists(shared().classes), pooled(0), fallback(0), frees(0), requested(0), reserved(0) {
+          std::lock_guard<std::mutex> lock(shared().mutex);
+          shared().caches.push_back(this);
+        }
+
+        ~thread_cache() {
+          auto& s = shared();
+          std::lock_guard<std::mutex> lock(s.mutex);
+          for (int cls = 0; cls < s.classes; ++cls) {
+            give_back(s.central[cls], lists[cls], lists[cls].count);
+          }
+          s.retired.pooled_allocations += pooled;
+          s.retired.fallback_allocations += fallback;
+          s.retired.frees += frees;
+          s.retired.live_requested += requested;
+          s.retired.live_reserved += reserved;
+          s.caches.erase(std::find(s.caches.begin(), s.caches.end(), this));
+          gone() = true;
+        }
+
+        void add(std::atomic<long long>& c, long long n) {
+          c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+      };
+
+      // Set once the thread's cache is destroyed. Trivially destructible,
+      // so later thread_local destructors that free memory can still read it.
+      static bool& gone() {
+        static thread_local bool g = false;
+        return g;
+      }
+
+      // Null after the thread's cache is destroyed; callers then use the
+      // shared lists.
+      static thread_cache* cache() {
+        if (gone()) return nullptr;
+        static thread_local thread_cache c;
+        return &c;
+      }
+
+      // Moves n blocks from the head of from to to.
+      static void give_back(free_list& to, free_list& from, int n) {
+        for (; n > 0 && from.head; --n) {
+          auto b = from.head;
+          from.head = b->next;
+          --from.count;
+          b->next = to.head;
+          to.head = b;
+          ++to.count;
+        }
+      }
+
+      static char* refill(thread_cache& tc, int cls) {
+        auto& s = shared();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        if (s.central[cls].head) {
+          give_back(tc.lists[cls], s.central[cls], std::max(1, s.opts.thread_cache_blocks / 2));
+          auto b = tc.lists[cls].head;
+          tc.lists[cls].head = b->next;
+          --tc.lists[cls].count;
+          return reinterpret_cast<char*>(b);
+        }
+        return carve(s, cls);
+      }
+
+      // A block from the shared list or a new chunk; callers hold the mutex.
+      static char* take(shared_state& s, int cls) {
+        auto& fl = s.central[cls];
+        if (fl.head) {
+          auto b = fl.head;
+          fl.head = b->next;
+          --fl.count;
+          return reinterpret_cast<char*>(b);
+        }
+        return carve(s, cls);
+      }
+
+      static char* carve(shared_state& s, int cls) {
+        auto slot = pool_header::size + size_classes::size_of(cls);
+        if (s.chunk_left < slot) {
+          s.chunk = static_cast<char*>(s.base.xMalloc(s.opts.chunk_size));
+          if (!s.chunk) {
+            s.chunk_left = 0;
+            return nullptr;
+          }
+          s.chunk_left = s.opts.chunk_size;
+          s.chunk_bytes += s.opts.chunk_size;
+        }
+        auto p = s.chunk;
+        s.chunk += slot;
+        s.chunk_left -= slot;
+        return p;
+      }
+
+      static void* xmalloc(int n) {
+        auto& s = shared();
+        auto tc = cache();
+        char* p;
+        pool_header h;
+        h.requested = n;
+        if (n > s.opts.max_pooled_size) {
+          p = static_cast<char*>(s.base.xMalloc(n + pool_header::size));
+          if (!p) return nullptr;
+          h.cls = pool_header::fallback;
+          if (tc) {
+            tc->add(tc->fallback, 1);
+          } else {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            ++s.retired.fallback_allocations;
+          }
+        } else if (!tc) {
+          auto cls = size_classes::class_of(n);
+          std::lock_guard<std::mutex> lock(s.mutex);
+          if (!(p = take(s, cls))) return nullptr;
+          h.cls = cls;
+          ++s.retired.pooled_allocations;
+          s.retired.live_requested += n;
+          s.retired.live_reserved += size_classes::size_of(cls);
+        } else {
+          auto cls = size_classes::class_of(n);
+          auto& fl = tc->lists[cls];
+          if (fl.head) {
+            p = reinterpret_cast<char*>(fl.head);
+            fl.head = fl.head->next;
+            --fl.count;
+          } else if (!(p = refill(*tc, cls))) {
+            return nullptr;
+          }
+          h.cls = cls;
+          tc->add(tc->pooled, 1);
+          tc->add(tc->requested, n);
+          tc->add(tc->reserved, size_classes::size_of(cls));
+        }
+        std::memcpy(p, &h, sizeof(h));
+        return p + pool_header::size;
+      }
+
+      static pool_header header_of(void* q) {
+        pool_header h;
+        std::memcpy(&h, static_cast<char*>(q) - pool_header::size, sizeof(h));
+        return h;
+      }
+
+      static void xfree(void* q) {
+        if (!q) return;
+        auto& s = shared();
+        auto tc = cache();
+        auto p = static_cast<char*>(q) - pool_header::size;
+        auto h = header_of(q);
+        auto b = reinterpret_cast<free_block*>(p);
+        if (!tc) {
+          if (h.cls == pool_header::fallback) s.base.xFree(p);
+          std::lock_guard<std::mutex> lock(s.mutex);
+          ++s.retired.frees;
+          if (h.cls == pool_header::fallback) return;
+          s.retired.live_requested -= h.requested;
+          s.retired.live_reserved -= size_classes::size_of(h.cls);
+          b->next = s.central[h.cls].head;
+          s.central[h.cls].head = b;
+          ++s.central[h.cls].count;
+          return;
+        }
+        tc->add(tc->frees, 1);
+        if (h.cls == pool_header::fallback) {
+          s.base.xFree(p);
+          return;
+        }
+        tc->add(tc->requested, -h.requested);
+        tc->add(tc->reserved, -size_classes::size_of(h.cls));
+        auto& fl = tc->lists[h.cls];
+        b->next = fl.head;
+        fl.head = b;
+        if (++fl.count > s.opts.thread_cache_blocks) {
+          std::lock_guard<std::mutex> lock(s.mutex);
+          give_back(s.central[h.cls], fl, fl.count / 2);
+        }
+      }
+
+      static int xsize(void* q) {
+        if (!q) return 0;
+        auto h = header_of(q);
+        if (h.cls == pool_header::fallback) {
+          return shared().base.xSize(static_cast<char*>(q) - pool_header::size) - pool_header::size;
+        }
+        return size_classes::size_of(h.cls);
+      }
+
+      static void* xrealloc(void* q, int n) {
+        auto h = header_of(q);
+        if (h.cls != pool_header::fallback && n <= size_classes::size_of(h.cls) &&
+            n > (h.cls == 0 ? 0 : size_classes::size_of(h.cls - 1))) {
+          if (auto tc = cache()) {
+            tc->add(tc->requested, n - h.requested);
+          } else {
+            auto& s = shared();
+            std::lock_guard<std::mutex> lock(s.mutex);
+            s.retired.live_requested += n - h.requested;
+          }
+          h.requested = n;
+          std::memcpy(static_cast<char*>(q) - pool_header::size, &h, sizeof(h));
+          return q;
+        }
+        auto r = xmalloc(n);
+        if (!r) return nullptr;
+        std::memcpy(r, q, std::min(n, xsize(q)));
+        xfree(q);
+        return r;
+      }
+
+      static int xroundup(int n) {
+        auto& s = shared();
+        if (n > s.opts.max_pooled_size) {
+          return s.base.xRoundup(n + pool_header::size) - pool_header::size;
+        }
+        return size_classes::size_of(size_classes::class_of(n));
+      }
+
+      static int xinit(void*) {
+        auto& s = shared();
+        return s.base.xInit(s.base.pAppData);
+      }
+
+      static void xshutdown(void*) {
+        auto& s = shared();
+        s.base.xShutdown(s.base.pAppData);
+      }
+    };
+    struct shared_pcache
+    {
+      struct cache;
+
+      struct page {
+        // First, so that SQLite's page pointer is the page pointer.
+        sqlite3_pcache_page base;
+        cache* owner;
+        unsigned key;
+        std::size_t bytes;
+        std::size_t shard;
+        // Ring of unpinned purgeable pages in the shard. Neighbours change
+        // under the shard's mutex only; in_ring changes under both the
+        // shard's and the owner's, so the owner may read it alone.
+        page* prev;
+        page* next;
+        bool in_ring;
+        bool pinned;
+        bool referenced;
+      };
+
+      struct shard {
+        std::mutex mutex;
+        page* hand = nullptr;
+        std::size_t unpinned = 0;
+      };
+
+      struct cache {
+        std::mutex mutex;
+        int page_size;
+        int extra;
+        bool purgeable;
+        std::unordered_map<unsigned, page*> pages;
+      };
+
+      struct state {
+        std::vector<std::unique_ptr<shard> > shards;
+        std::atomic<long long> budget;
+        std::atomic<long long> bytes;
+        std::atomic<long long> pages;
+        std::atomic<long long> hits;
+        std::atomic<long long> misses;
+        std::atomic<long long> evictions;
+        std::atomic<bool> installed;
+
+        state() : budget(0), bytes(0), pages(0), hits(0), misses(0), evictions(0), installed(false) {}
+      };
+
+      static state& global() {
+        static state* s = new state();
+        return *s;
+      }
+
+      // Callers hold the shard's mutex.
+      static void ring_insert(shard& s, page* p) {
+        if (!s.hand) {
+          p->prev = p->next = p;
+          s.hand = p;
+        } else {
+          p->next = s.hand;
+          p->prev = s.hand->prev;
+          s.hand->prev->next = p;
+          s.hand->prev = p;
+        }
+        p->in_ring = true;
+        ++s.unpinned;
+      }
+
+      static void ring_remove(shard& s, page* p) {
+        if (p->next == p) {
+          s.hand = nullptr;
+        } else {
+          p->prev->next = p->next;
+          p->next->prev = p->prev;
+          if (s.hand == p) s.hand = p->next;
+        }
+        p->prev = p->next = nullptr;
+        p->in_ring = false;
+        --s.unpinned;
+      }
+
+      // Callers hold the owning cache's mutex.
+      static void unlink(page* p) {
+        if (p->in_ring) {
+          auto& s = *global().shards[p->shard];
+          std::lock_guard<std::mutex> lock(s.mutex);
+          ring_remove(s, p);
+        }
+      }
+
+      static void free_page(page* p) {
+        auto& g = global();
+        if (p->owner->purgeable) g.bytes -= p->bytes;
+        --g.pages;
+        sqlite3_free(p);
+      }
+
+      // Evicts one unpinned page from any cache; self is locked by the
+      // caller. Other caches are only try-locked, so that two evicting
+      // threads never wait on each other.
+      static bool evict_one(cache* self, std::size_t start) {
+        auto& g = global();
+        auto n = g.shards.size();
+        for (std::size_t i = 0; i < n; ++i) {
+          auto& s = *g.shards[(start + i) % n];
+          std::lock_guard<std::mutex> lock(s.mutex);
+          for (std::size_t steps = 0; s.hand && steps < 2 * s.unpinned; ++steps) {
+            auto p = s.hand;
+            if (p->referenced) {
+              p->referenced = false;
+              s.hand = p->next;
+              continue;
+            }
+            std::unique_lock<std::mutex> owner(p->owner->mutex, std::defer_lock);
+            if (p->owner != self && !owner.try_lock()) {
+              s.hand = p->next;
+              continue;
+            }
+            ring_remove(s, p);
+            p->owner->pages.erase(p->key);
+            free_page(p);
+            ++g.evictions;
+            return true;
+          }
+        }
+        return false;
+      }
+
+      static int xinit(void*) {
+        return SQLITE_OK;
+      }
+
+      static void xshutdown(void*) {
+      }
+
+      static sqlite3_pcache* xcreate(int page_size, int extra, int purgeable) {
+        auto c = new (std::nothrow) cache();
+        if (!c) return nullptr;
+        c->page_size = page_size;
+        c->extra = extra;
+        c->purgeable = purgeable != 0;
+        return reinterpret_cast<sqlite3_pcache*>(c);
+      }
+
+      static void xcachesize(sqlite3_pcache*, int) {
+      }
+
+      static int xpagecount(sqlite3_pcache* pc) {
+        auto c = reinterpret_cast<cache*>(pc);
+        std::lock_guard<std::mutex> lock(c->mutex);
+        return static_cast<int>(c->pages.size());
+      }
+
+      static sqlite3_pcache_page* xfetch(sqlite3_pcache* pc, unsigned key, int create) {
+        auto& g = global();
+        auto c = reinterpret_cast<cache*>(pc);
+        std::lock_guard<std::mutex> lock(c->mutex);
+
+        auto it = c->pages.find(key);
+        if (it != c->pages.end()) {
+          ++g.hits;
+          auto p = it->second;
+          unlink(p);
+          p->pinned = true;
+          return &p->base;
+        }
+        ++g.misses;
+        if (create == 0) return nullptr;
+
+        auto bytes = sizeof(page) + c->page_size + c->extra;
+        auto shard = (std::hash<void*>()(c) ^ (key * 2654435761u)) % g.shards.size();
+        if (c->purgeable) {
+          while (g.bytes + static_cast<long long>(bytes) > g.budget && evict_one(c, shard)) {
+          }
+          // SQLite spills dirty pages and asks again with create == 2.
+          if (create == 1 && g.bytes + static_cast<long long>(bytes) > g.budget) return nullptr;
+        }
+
+        auto p = static_cast<page*>(sqlite3_malloc64(bytes));
+        if (!p) return nullptr;
+        p->base.pBuf = reinterpret_cast<char*>(p) + sizeof(page);
+        p->base.pExtra = static_cast<char*>(p->base.pBuf) + c->page_size;
+        std::memset(p->base.pExtra, 0, c->extra);
+        p->owner = c;
+        p->key = key;
+        p->bytes = bytes;
+        p->shard = shard;
+        p->prev = p->next = nullptr;
+        p->in_ring = false;
+        p->pinned = true;
+        p->referenced = false;
+        c->pages[key] = p;
+        if (c->purgeable) g.bytes += bytes;
+        ++g.pages;
+        return &p->base;
+      }
+
+      static void xunpin(sqlite3_pcache* pc, sqlite3_pcache_page* pg, int discard) {
+        auto c = reinterpret_cast<cache*>(pc);
+        auto p = reinterpret_cast<page*>(pg);
+        std::lock_guard<std::mutex> lock(c->mutex);
+        p->pinned = false;
+        if (discard) {
+          c->pages.erase(p->key);
+          free_page(p);
+        } else if (c->purgeable) {
+          auto& s = *global().shards[p->shard];
+          std::lock_guard<std::mutex> slock(s.mutex);
+          p->referenced = true;
+          ring_insert(s, p);
+        }
+      }
+
+      static void xrekey(sqlite3_pcache* pc, sqlite3_pcache_page* pg, unsigned old_key, unsigned new_key) {
+        auto c = reinterpret_cast<cache*>(pc);
+        auto p = reinterpret_cast<page*>(pg);
+        std::lock_guard<std::mutex> lock(c->mutex);
+        auto it = c->pages.find(new_key);
+        if (it != c->pages.end()) {
+          auto q = it->second;
+          unlink(q);
+          c->pages.erase(it);
+          free_page(q);
+        }
+        c->pages.erase(old_key);
+        p->key = new_key;
+        c->pages[new_key] = p;
+      }
+
+      static void truncate(cache* c, unsigned limit) {
+        for (auto it = c->pages.begin(); it != c->pages.end();) {
+          if (it->first >= limit) {
+            auto p = it->second;
+            unlink(p);
+            it = c->pages.erase(it);
+            free_page(p);
+          } else {
+            ++it;
+          }
+        }
+      }
+
+      static void xtruncate(sqlite3_pcache* pc, unsigned limit) {
+        auto c = reinterpret_cast<cache*>(pc);
+        std::lock_guard<std::mutex> lock(c->mutex);
+        truncate(c, limit);
+      }
+
+      static void xdestroy(sqlite3_pcache* pc) {
+        auto c = reinterpret_cast<cache*>(pc);
+        {
+          std::lock_guard<std::mutex> lock(c->mutex);
+          truncate(c, 0);
+        }
+        delete c;
+      }
+
+      static void xshrink(sqlite3_pcache* pc) {
+        auto c = reinterpret_cast<cache*>(pc);
+        std::lock_guard<std::mutex> lock(c->mutex);
+        for (auto it = c->pages.begin(); it != c->pages.end();) {
+          auto p = it->second;
+          if (p->in_ring) {
+            unlink(p);
+            it = c->pages.erase(it);
+            free_page(p);
+          } else {
+            ++it;
+          }
+        }
+      }
+    };
+  } // namespace
+
+  inline memory_status global_memory_status(bool reset)
+  {
+    memory_status s;
+    auto r = reset ? 1 : 0;
+    auto get = [r](int op, memory_counter& c) {
+      sqlite3_int64 cur = 0, hw = 0;
+      sqlite3_status64(op, &cur, &hw, r);
+      c.current = cur;
+      c.highwater = hw;
+    };
+
+    get(SQLITE_STATUS_MEMORY_USED, s.memory_used);
+    get(SQLITE_STATUS_MALLOC_SIZE, s.malloc_size);
+    get(SQLITE_STATUS_MALLOC_COUNT, s.malloc_count);
+    get(SQLITE_STATUS_PAGECACHE_USED, s.pagecache_used);
+    get(SQLITE_STATUS_PAGECACHE_OVERFLOW, s.pagecache_overflow);
+    get(SQLITE_STATUS_PAGECACHE_SIZE, s.pagecache_size);
+    return s;
+  }
+
+  inline int enable_memory_accounting()
+  {
+    if (memory_account::enabled()) return SQLITE_OK;
+
+    auto rc = sqlite3_config(SQLITE_CONFIG_GETMALLOC, &counting_malloc::base());
+    if (rc != SQLITE_OK) return rc;
+
+    sqlite3_mem_methods m = {
+      counting_malloc::xmalloc,
+      counting_malloc::xfree,
+      counting_malloc::xrealloc,
+      counting_malloc::xsize,
+      counting_malloc::xroundup,
+      counting_malloc::xinit,
+      counting_malloc::xshutdown,
+      nullptr
+    };
+    rc = sqlite3_config(SQLITE_CONFIG_MALLOC, &m);
+    if (rc == SQLITE_OK) {
+      memory_account::enabled() = true;
+    }
+    return rc;
+  }
+
+  inline double pool_stats::internal_fragmentation() const
+  {
+    return live_reserved > 0 ? 1.0 - static_cast<double>(live_requested) / live_reserved : 0.0;
+  }
+
+  inline double pool_stats::external_fragmentation() const
+  {
+    return chunk_bytes > 0 ? 1.0 - static_cast<double>(live_reserved) / chunk_bytes : 0.0;
+  }
+
+  inline int config::use_pool_allocator(pool_options const& opts)
+  {
+    auto& s = pool_allocator::shared();
+    auto classes = size_classes::class_of(opts.max_pooled_size) + 1;
+    if (s.installed) {
+      // The free lists are already laid out for the first options.
+      auto same = s.classes == classes && s.opts.thread_cache_blocks == opts.thread_cache_blocks &&
+                  s.opts.chunk_size == opts.chunk_size;
+      return same ? SQLITE_OK : SQLITE_MISUSE;
+    }
+
+    auto rc = sqlite3_config(SQLITE_CONFIG_GETMALLOC, &s.base);
+    if (rc != SQLITE_OK) return rc;
+
+    s.opts = opts;
+    s.classes = classes;
+    s.opts.max_pooled_size = size_classes::size_of(s.classes - 1);
+    s.central.resize(s.classes);
+
+    sqlite3_mem_methods m = {
+      pool_allocator::xmalloc,
+      pool_allocator::xfree,
+      pool_allocator::xrealloc,
+      pool_allocator::xsize,
+      pool_allocator::xroundup,
+      pool_allocator::xinit,
+      pool_allocator::xshutdown,
+      nullptr
+    };
+    rc = sqlite3_config(SQLITE_CONFIG_MALLOC, &m);
+    if (rc == SQLITE_OK) {
+      s.installed = true;
+    }
+    return rc;
+  }
+
+  inline pool_stats config::pool_statistics()
+  {
+    auto& s = pool_allocator::shared();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto st = s.retired;
+    for (auto c : s.caches) {
+      st.pooled_allocations += c->pooled;
+      st.fallback_allocations += c->fallback;
+      st.frees += c->frees;
+      st.live_requested += c->requested;
+      st.live_reserved += c->reserved;
+    }
+    st.chunk_bytes = s.chunk_bytes;
+    return st;
+  }
+
+  inline mapped_buffer::mapped_buffer(std::size_t size, huge_page_mode mode)
+    : data_(nullptr), size_(size), mapped_(0), huge_(false)
+  {
+#ifdef _WIN32
+    data_ = std::malloc(size);
+    if (!data_) throw std::bad_alloc();
+    (void) mode;
+#else
+    auto page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+#ifdef MAP_HUGETLB
+    if (mode == explicit_huge_pages) {
+      std::size_t const huge = 2 * 1024 * 1024;
+      mapped_ = (size + huge - 1) / huge * huge;
+      data_ = mmap(nullptr, mapped_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (data_ == MAP_FAILED) {
+        data_ = nullptr;
+      } else {
+        huge_ = true;
+      }
+    }
+#endif
+    if (!data_) {
+      mapped_ = (size + page - 1) / page * page;
+      data_ = mmap(nullptr, mapped_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (data_ == MAP_FAILED) {
+        data_ = nullptr;
+        throw std::bad_alloc();
+      }
+#ifdef MADV_HUGEPAGE
+      if (mode != no_huge_pages) {
+        huge_ = madvise(data_, mapped_, MADV_HUGEPAGE) == 0;
+      }
+#endif
+    }
+#endif
+  }
+
+  inline mapped_buffer::~mapped_buffer()
+  {
+#ifdef _WIN32
+    std::free(data_);
+#else
+    if (data_) munmap(data_, mapped_);
+#endif
+  }
+
+  inline void* mapped_buffer::data() const
+  {
+    return data_;
+  }
+
+  inline std::size_t mapped_buffer::size() const
+  {
+    return size_;
+  }
+
+  inline bool mapped_buffer::huge_pages() const
+  {
+    return huge_;
+  }
+
+  inline bool page_cache_stats::sufficient() const
+  {
+    return overflow.highwater == 0;
+  }
+
+  inline std::unique_ptr<mapped_buffer>& config::page_cache_buffer()
+  {
+    static std::unique_ptr<mapped_buffer> buf;
+    return buf;
+  }
+
+  inline page_cache_stats& config::page_cache_config()
+  {
+    static page_cache_stats st;
+    return st;
+  }
+
+  inline int config::page_cache_header_size()
+  {
+    int n = 0;
+    sqlite3_config(SQLITE_CONFIG_PCACHE_HDRSZ, &n);
+    return n;
+  }
+
+  inline int config::use_page_cache(int page_size, int slots, huge_page_mode mode)
+  {
+    // Slots are 8-byte aligned; SQLite rounds sz down otherwise.
+    auto sz = (page_size + page_cache_header_size() + 7) & ~7;
+    std::unique_ptr<mapped_buffer> buf(new mapped_buffer(static_cast<std::size_t>(sz) * slots, mode));
+    auto rc = sqlite3_config(SQLITE_CONFIG_PAGECACHE, buf->data(), sz, slots);
+    if (rc != SQLITE_OK) return rc;
+
+    auto& st = page_cache_config();
+    st.slot_size = sz;
+    st.slots = slots;
+    st.huge_pages = buf->huge_pages();
+    // SQLite is not initialized here, so the previous buffer is unused.
+    page_cache_buffer() = std::move(buf);
+
+    // Start sizing from the new configuration.
+    page_cache_statistics(true);
+    return SQLITE_OK;
+  }
+
+  inline page_cache_stats config::page_cache_statistics(bool reset)
+  {
+    auto st = page_cache_config();
+    auto r = reset ? 1 : 0;
+    auto get = [r](int op, memory_counter& c) {
+      sqlite3_int64 cur = 0, hw = 0;
+      sqlite3_status64(op, &cur, &hw, r);
+      c.current = cur;
+      c.highwater = hw;
+    };
+    get(SQLITE_STATUS_PAGECACHE_USED, st.used);
+    get(SQLITE_STATUS_PAGECACHE_OVERFLOW, st.overflow);
+    get(SQLITE_STATUS_PAGECACHE_SIZE, st.largest);
+    return st;
+  }
+
+  inline double shared_page_cache_stats::hit_rate() const
+  {
+    return hits + misses > 0 ? static_cast<double>(hits) / (hits + misses) : 0.0;
+  }
+
+  inline int config::use_shared_page_cache(long long budget_bytes, int shards)
+  {
+    auto& g = shared_pcache::global();
+    if (g.installed) {
+      g.budget = budget_bytes;
+      return SQLITE_OK;
+    }
+
+    g.budget = budget_bytes;
+    for (int i = 0; i < std::max(shards, 1); ++i) {
+      g.shards.push_back(std::unique_ptr<shared_pcache::shard>(new shared_pcache::shard()));
+    }
+
+    sqlite3_pcache_methods2 m = {
+      1,
+      nullptr,
+      shared_pcache::xinit,
+      shared_pcache::xshutdown,
+      shared_pcache::xcreate,
+      shared_pcache::xcachesize,
+      shared_pcache::xpagecount,
+      shared_pcache::xfetch,
+      shared_pcache::xunpin,
+      shared_pcache::xrekey,
+      shared_pcache::xtruncate,
+      shared_pcache::xdestroy,
+      shared_pcache::xshrink
+    };
+    auto rc = sqlite3_config(SQLITE_CONFIG_PCACHE2, &m);
+    if (rc == SQLITE_OK) {
+      g.installed = true;
+    } else {
+      g.shards.clear();
+    }
+    return rc;
+  }
+
+  inline shared_page_cache_stats config::shared_page_cache_statistics()
+  {
+    auto& g = shared_pcache::global();
+    shared_page_cache_stats st;
+    st.hits = g.hits;
+    st.misses = g.misses;
+    st.evictions = g.evictions;
+    st.pages = g.pages;
+    st.bytes = g.bytes;
+    st.budget = g.budget;
+    return st;
+  }
+
+  inline memory_budget::memory_budget(long long budget_bytes, event_handler h)
+    : budget_(budget_bytes), prev_limit_(sqlite3_soft_heap_limit64(budget_bytes)), h_(h), stop_(false)
+  {
+  }
+
+  inline memory_budget::~memory_budget()
+  {
+    stop();
+    sqlite3_soft_heap_limit64(prev_limit_);
+  }
+
+  inline void memory_budget::set_hard_limit(long long bytes)
+  {
+    sqlite3_hard_heap_limit64(bytes);
+  }
+
+  inline void memory_budget::add(database& db, std::string const& name)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entry e;
+    e.name = name;
+    e.db = &db;
+    auto st = db.status();
+    e.accesses = st.cache_hit + st.cache_miss;
+    e.last_used = std::chrono::steady_clock::now();
+    dbs_.push_back(e);
+  }
+
+  inline void memory_budget::remove(database& db)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    dbs_.erase(std::remove_if(dbs_.begin(), dbs_.end(), [&db](entry const& e) {
+      return e.db == &db;
+    }), dbs_.end());
+  }
+
+  inline long long memory_budget::enforce()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // A connection counts as used when its cache saw hits or misses since
+    // the last check.
+    auto now = std::chrono::steady_clock::now();
+    for (auto& e : dbs_) {
+      auto st = e.db->status();
+      auto accesses = st.cache_hit + st.cache_miss;
+      if (accesses != e.accesses) {
+        e.accesses = accesses;
+        e.last_used = now;
+      }
+    }
+
+    long long total = 0;
+    if (sqlite3_memory_used() <= budget_) return total;
+
+    std::vector<entry*> order;
+    for (auto& e : dbs_) {
+      order.push_back(&e);
+    }
+    std::stable_sort(order.begin(), order.end(), [](entry const* a, entry const* b) {
+      return a->last_used < b->last_used;
+    });
+
+    for (auto e : order) {
+      if (sqlite3_memory_used() <= budget_) break;
+
+      release_event ev;
+      ev.when = std::chrono::system_clock::now();
+      ev.name = e->name;
+      ev.cache_before = e->db->status().cache_used;
+      auto before = sqlite3_memory_used();
+      auto start = std::chrono::steady_clock::now();
+      e->db->release_memory();
+      ev.took = std::chrono::steady_clock::now() - start;
+      ev.released = before - sqlite3_memory_used();
+      ev.cache_after = e->db->status().cache_used;
+      total += ev.released;
+      if (h_) h_(ev);
+    }
+    return total;
+  }
+
+  inline void memory_budget::start(std::chrono::milliseconds interval)
+  {
+    stop();
+    stop_ = false;
+    thread_ = std::thread(&memory_budget::run, this, interval);
+  }
+
+  inline void memory_budget::stop()
+  {
+    {
+      std::lock_guard<std::mutex> lock(run_mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+
+  inline void memory_budget::run(std::chrono::milliseconds interval)
+  {
+    std::unique_lock<std::mutex> lock(run_mutex_);
+    while (!stop_) {
+      lock.unlock();
+      enforce();
+      lock.lock();
+      cv_.wait_for(lock, interval, [this] { return stop_; });
+    }
+  }
+
+} // namespace sqlite3pp
@@ -0,0 +1,395 @@
+// sqlite3ppprof.h
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef SQLITE3PPPROF_H
+#define SQLITE3PPPROF_H
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <istream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "sqlite3pp.h"
+
+namespace sqlite3pp
+{
+  namespace prof
+  {
+    struct sql_profile
+    {
+      // Normalized SQL text.
+      std::string sql;
+      // Statement starts seen through SQLITE_TRACE_STMT.
+      long long executions = 0;
+      // Run times from SQLITE_TRACE_PROFILE, in nanoseconds.
+      histogram_snapshot latency;
+    };
+
+    // Per-SQL latency histograms fed by sqlite3_trace_v2. Each thread
+    // finds the histogram of a known statement in its own cache without
+    // locking, and histograms are updated wait-free; the first execution
+    // of new SQL takes a per-thread shard lock. Copies share state.
+    class sql_profiler
+    {
+     public:
+      explicit sql_profiler(int shards = 16);
+
+      // Installs the profiler as the trace handler of db.
+      void attach(database& db);
+
+      // Sorted by total time, most expensive first.
+      std::vector<sql_profile> snapshot() const;
+      void reset();
+
+      // Replaces literals with '?', drops comments and collapses whitespace.
+      static std::string normalize(char const* sql);
+
+     private:
+      struct entry {
+        entry();
+
+        latency_histogram latency;
+        std::atomic<long long> executions;
+      };
+
+      struct shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, std::unique_ptr<entry> > entries;
+      };
+
+      struct state {
+        state();
+        ~state();
+
+        // Tells apart the thread caches of different profilers.
+        unsigned long long id;
+        std::vector<std::unique_ptr<shard> > shards;
+      };
+
+      // A statement's entry and the hash of its SQL text, which tells a
+      // reused sqlite3_stmt address from the statement that was cached.
+      struct cached_stmt {
+        unsigned long long hash;
+        entry* e;
+      };
+
+      // start is true for SQLITE_TRACE_STMT, where the cache is checked
+      // against the SQL text; the SQLITE_TRACE_PROFILE event of the same
+      // execution only needs the statement pointer.
+      static entry* lookup(std::shared_ptr<state> const& st, sqlite3_stmt* stmt, bool start);
+
+     private:
+      std::shared_ptr<state> state_;
+    };
+
+    // EXPLAIN QUERY PLAN output, one line per plan node, indented by depth.
+    std::string explain_query_plan(database& db, char const* sql);
+
+    struct slow_query_record
+    {
+      std::chrono::system_clock::time_point when;
+      // SQL with bound parameters expanded.
+      std::string sql;
+      std::chrono::nanoseconds elapsed;
+      long long rows;
+      statement_stats stats;
+      // Query plan, captured the first time this SQL text is logged, or
+      // again once it has dropped out of the most recent plan_capacity
+      // distinct texts.
+      std::string plan;
+    };
+
+    // Logs statement executions slower than a threshold. Records are
+    // queued in a ring buffer and handed to the sink on a background
+    // thread, so the query thread never waits for the sink or for query
+    // plans, which the background thread explains on its own connection.
+    // Records that do not fit in the buffer are dropped and counted.
+    class slow_query_log : noncopyable
+    {
+     public:
+      using sink = std::function<void (slow_query_record const&)>;
+
+      slow_query_log(std::chrono::nanoseconds threshold, sink s, std::size_t capacity = 1024, std::size_t plan_capacity = 1024);
+      // Turns the handlers of the databases still attached into no-ops,
+      // then delivers the queued records before returning. The databases
+      // themselves are not touched, so they may have been moved.
+      ~slow_query_log();
+
+      // Installs the log as the execution handler of db, which moves with
+      // it. Plans are taken from a read-only connection to the same file
+      // or, for in-memory databases, from a copy of the schema that is
+      // taken again when the schema version changes. A database that is
+      // destroyed or gets another execution handler is detached.
+      void attach(database& db);
+      // Removes the execution handler of db.
+      void detach(database& db);
+
+      // Waits until every queued record has been delivered.
+      void flush();
+      long long dropped() const;
+
+     private:
+      // A record and what the background thread needs to explain it.
+      struct pending {
+        slow_query_record record;
+        std::string sql;
+        std::shared_ptr<database> planner;
+      };
+
+      struct attachment;
+
+      struct state {
+        explicit state(std::size_t capacity);
+
+        ring_buffer<pending> queue;
+        std::atomic<long long> pushed;
+        std::atomic<long long> delivered;
+        std::atomic<long long> dropped;
+        std::atomic<bool> closed;
+
+        std::mutex attached_mutex;
+        std::vector<attachment*> attached;
+
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool stop;
+      };
+
+      // Shared by the copies of one installed handler, wherever its
+      // database has moved; unregisters itself when the handler is
+      // destroyed.
+      struct attachment {
+        attachment(std::shared_ptr<state> st, std::shared_ptr<database> planner, int schema_version);
+        ~attachment();
+
+        std::shared_ptr<state> st;
+        // Guarded by st->attached_mutex.
+        std::shared_ptr<database> planner;
+        // Version of the copied schema, or -1 if planner reads the file.
+        int schema_version;
+      };
+
+      void run();
+      // Used only by the background thread; most recent first.
+      bool first_time(std::string const& sql);
+
+     private:
+      std::chrono::nanoseconds threshold_;
+      sink sink_;
+      std::shared_ptr<state> state_;
+
+      std::size_t plan_capacity_;
+      std::list<std::string> planned_;
+      std::unordered_map<std::string, std::list<std::string>::iterator> planned_index_;
+
+      std::thread thread_;
+    };
+
+    struct index_proposal
+    {
+      std::string sql;
+      // sql with the parameters of a recorded execution; validation runs
+      // this text. Empty when the registry has no sample.
+      std::string sample;
+      // Counters from the connection's statement registry, if any.
+      statement_stats stats;
+      // Query plan before the index.
+      std::string plan;
+      std::string create_index;
+      // Set when the proposal was timed on a scratch copy; medians.
+      bool validated = false;
+      std::chrono::nanoseconds before = std::chrono::nanoseconds(0);
+      std::chrono::nanoseconds after = std::chrono::nanoseconds(0);
+      double speedup = 0.0;
+    };
+
+    struct advisor_options
+    {
+      long long min_fullscan_steps = 1000;
+      long long min_autoindexes = 1;
+      // Time read-only statements before and after each index on a copy
+      // made with database::backup(). Parameterized statements are timed
+      // with the sample from database::statement_samples().
+      bool validate = false;
+      int runs = 3;
+    };
+
+    // Proposes indexes for statements that SQLite answers with full scans
+    // or automatic indexes. Automatic index columns are taken from the
+    // query plan; for full scans each referenced column is tried on a
+    // schema-only copy and kept if the plan picks it up.
+    class index_advisor
+    {
+     public:
+      explicit index_advisor(database& db, advisor_options const& opts = advisor_options());
+
+      // Looks at db.statement_stats_by_sql(); see enable_statement_stats().
+      // The advisor's own queries run on a separate read-only connection
+      // or, for in-memory databases, a copy, so they stay out of the
+      // registry.
+      std::vector<index_proposal> analyze();
+      std::vector<index_proposal> analyze(std::vector<std::string> const& statements);
+
+      static std::string report(std::vector<index_proposal> const& proposals);
+
+     private:
+      std::vector<index_proposal> analyze(std::vector<std::string> const& statements,
+                                          std::map<std::string, statement_stats> const& registry,
+                                          std::map<std::string, std::string> const& samples);
+      void propose(std::string const& sql, statement_stats const& stats, database& planner, database& schema, std::vector<index_proposal>& out);
+      void validate(std::vector<index_proposal>& proposals);
+
+     private:
+      database& db_;
+      advisor_options opts_;
+    };
+
+    struct workload_entry
+    {
+      std::string sql;
+      // SQL literal list bound to the statement's parameters, e.g.
+      // "42, -1.5, 'x', X'00ff', NULL". It is parsed, never run as SQL.
+      std::string params;
+    };
+
+    // Reads statements terminated by ';' at the end of a line, ignoring a
+    // trailing "--" comment. A following "-- params: <literals>" line binds
+    // parameters; repeat it to run the statement with several parameter
+    // sets. Other "--" lines are comments.
+    std::vector<workload_entry> load_workload(std::istream& in);
+
+    struct plan_sample
+    {
+      std::string sql;
+      std::string params;
+      std::string plan;
+      std::chrono::nanoseconds median = std::chrono::nanoseconds(0);
+      std::chrono::nanoseconds p99 = std::chrono::nanoseconds(0);
+    };
+
+    struct plan_diff
+    {
+      plan_sample baseline;
+      plan_sample current;
+      bool plan_changed = false;
+      bool regressed = false;
+      // current median over baseline median.
+      double slowdown = 0.0;
+    };
+
+    struct harness_options
+    {
+      int runs = 20;
+      // A statement regresses when its median or p99 grows by this factor
+      // and by at least min_delta.
+      double slowdown_threshold = 1.5;
+      std::chrono::nanoseconds min_delta = std::chrono::microseconds(100);
+    };
+
+    // Records plans and timings of a workload and compares them with an
+    // earlier recording, e.g. after a schema change, ANALYZE or an SQLite
+    // upgrade. Each run executes inside a savepoint that is rolled back,
+    // so writes do not accumulate.
+    class plan_harness
+    {
+     public:
+      explicit plan_harness(database& db, harness_options const& opts = harness_options());
+
+      std::vector<plan_sample> run(std::vector<workload_entry> const& workload);
+      std::vector<plan_diff> compare(std::vector<plan_sample> const& baseline, std::vector<plan_sample> const& current) const;
+
+      // Baselines are kept in a plan_baseline table of an SQLite database.
+      static int save(database& store, std::vector<plan_sample> const& samples);
+      static std::vector<plan_sample> load(database& store);
+
+      static std::string report(std::vector<plan_diff> const& diffs);
+
+     private:
+      plan_sample measure(workload_entry const& e);
+
+     private:
+      database& db_;
+      harness_options opts_;
+    };
+
+    // Periodically writes database::status() of registered connections as
+    // Prometheus text or JSON. Status is read from the exporter thread, so
+    // registered connections must not use SQLITE_OPEN_NOMUTEX, and must
+    // stay in place (not be moved or destroyed) while registered.
+    class status_exporter : noncopyable
+    {
+     public:
+      enum format { prometheus, json };
+      using sink = std::function<void (std::string const&)>;
+      using error_handler = std::function<void (std::string const& message)>;
+
+      status_exporter(format fmt, sink s);
+      ~status_exporter();
+
+      // Replaces path atomically with each export. A failed write or rename
+      // leaves the previous file in place and is reported to on_error.
+      static sink file_sink(std::string const& path, error_handler on_error = error_handler());
+
+      void add(database& db, std::string const& name);
+      void remove(database& db);
+
+      std::string render() const;
+      void export_now();
+
+      void start(std::chrono::milliseconds interval);
+      void stop();
+
+     private:
+      void run(std::chrono::milliseconds interval);
+
+     private:
+      format fmt_;
+      sink sink_;
+
+      mutable std::mutex mutex_;
+      std::vector<std::pair<std::string, database*> > dbs_;
+
+      std::mutex run_mutex_;
+      std::condition_variable cv_;
+      bool stop_;
+      std::thread thread_;
+    };
+
+  } // namespace prof
+
+} // namespace sqlite3pp
+
+#include "sqlite3ppprof.ipp"
+
+#endif
@@ -0,0 +1,1192 @@
+// sqlite3ppprof.ipp
+//
+// The MIT License
+//
+// Copyright (c) 2015 Wongoo Lee (iwongu at gmail dot com)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <sstream>
+#include <thread>
+
+namespace sqlite3pp
+{
+  namespace prof
+  {
+
+    namespace
+    {
+
+      inline bool is_ident_char(char c)
+      {
+        return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '$' || (c & 0x80);
+      }
+
+      // Bumped whenever a profiler's state is destroyed, so that threads
+      // drop their caches for it on their next lookup.
+      inline std::atomic<unsigned long long>& profiler_deaths()
+      {
+        static std::atomic<unsigned long long> deaths(0);
+        return deaths;
+      }
+
+      inline std::size_t thread_shard(std::size_t n)
+      {
+        static thread_local std::size_t h = std::hash<std::thread::id>()(std::this_thread::get_id());
+        return h % n;
+      }
+
+      // Plan rows are (id, parent, detail) with parents listed first.
+      inline void append_plan_row(std::string& text, std::map<int, int>& depth, int id, int parent, char const* detail)
+      {
+        auto it = depth.find(parent);
+        auto d = it == depth.end() ? 0 : it->second + 1;
+        depth[id] = d;
+        text.append(2 * d, ' ');
+        text += detail ? detail : "";
+        text += '\n';
+      }
+
+      inline std::string lower(std::string s)
+      {
+        for (auto& c : s) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        return s;
+      }
+
+      // FNV-1a.
+      inline unsigned long long sql_hash(char const* s)
+      {
+        unsigned long long h = 14695981039346656037ULL;
+        for (; *s; ++s) {
+          h = (h ^ static_cast<unsigned char>(*s)) * 1099511628211ULL;
+        }
+        return h;
+      }
+
+      // Lower-cased identifiers and keywords of sql, skipping literals.
+      inline std::vector<std::string> sql_words(std::string const& sql)
+      {
+        std::vector<std::string> words;
+        auto norm = sql_profiler::normalize(sql.c_str());
+        for (std::size_t i = 0; i < norm.size();) {
+          if (is_ident_char(norm[i])) {
+            auto start = i;
+            while (i < norm.size() && is_ident_char(norm[i])) ++i;
+            words.push_back(lower(norm.substr(start, i - start)));
+          } else if (norm[i] == '"' || norm[i] == '`' || norm[i] == '[') {
+            auto close = norm[i] == '[' ? ']' : norm[i];
+            auto start = ++i;
+            while (i < norm.size() && norm[i] != close) ++i;
+            words.push_back(lower(norm.substr(start, i - start)));
+            ++i;
+          } else {
+            ++i;
+          }
+        }
+        return words;
+      }
+
+      // line without a trailing "--" comment outside quotes.
+      inline std::string strip_comment(std::string const& line)
+      {
+        char quote = 0;
+        for (std::size_t i = 0; i < line.size(); ++i) {
+          auto c = line[i];
+          if (quote) {
+            if (c == quote) quote = 0;
+          } else if (c == '\'' || c == '"' || c == '`') {
+            quote = c;
+          } else if (c == '[') {
+            quote = ']';
+          } else if (c == '-' && i + 1 < line.size() && line[i + 1] == '-') {
+            return line.substr(0, i);
+          }
+        }
+        return line;
+      }
+
+      // Parses a comma-separated list of SQL literals: integers, reals,
+      // 'text', X'hex' blobs and NULL.
+      inline bool parse_literals(std::string const& text, std::vector<value>& out)
+      {
+        std::size_t i = 0;
+        auto skip = [&] {
+          while (i < text.size() && std::isspace(static_cast<unsigned char>(text[i]))) ++i;
+        };
+        for (;;) {
+          skip();
+          if (i == text.size()) return out.empty();
+          auto c = text[i];
+          if (c == '\'') {
+            std::string str;
+            for (++i;; ++i) {
+              if (i == text.size()) return false;
+              if (text[i] == '\'') {
+                if (i + 1 < text.size() && text[i + 1] == '\'') {
+                  ++i;
+                } else {
+                  ++i;
+                  break;
+                }
+              }
+              str += text[i];
+            }
+            out.push_back(value(str));
+          } else if ((c == 'x' || c == 'X') && i + 1 < text.size() && text[i + 1] == '\'') {
+            auto end = text.find('\'', i + 2);
+            if (end == std::string::npos || (end - i) % 2 != 0) return false;
+            std::string bytes;
+            for (auto j = i + 2; j < end; j += 2) {
+              auto hex = text.substr(j, 2);
+              if (!std::isxdigit(static_cast<unsigned char>(hex[0])) || !std::isxdigit(static_cast<unsigned char>(hex[1]))) return false;
+              bytes += static_cast<char>(std::stoi(hex, nullptr, 16));
+            }
+            blob_view blob = {bytes.data(), bytes.size()};
+            out.push_back(value(blob));
+            i = end + 1;
+          } else if (lower(text.substr(i, 4)) == "null" && (i + 4 == text.size() || !is_ident_char(text[i + 4]))) {
+            out.push_back(value());
+            i += 4;
+          } else {
+            auto start = i;
+            if (c == '+' || c == '-') ++i;
+            while (i < text.size() && (std::isalnum(static_cast<unsigned char>(text[i])) || text[i] == '.' ||
+                                       ((text[i] == '+' || text[i] == '-') && (text[i - 1] == 'e' || text[i - 1] == 'E')))) {
+              ++i;
+            }
+            auto num = text.substr(start, i - start);
+            if (num.empty()) return false;
+            char* end = nullptr;
+            errno = 0;
+            if (num.find_first_of(".eE") == std::string::npos) {
+              auto v = std::strtoll(num.c_str(), &end, 10);
+              if (*end || errno) return false;
+              out.push_back(value(static_cast<long long int>(v)));
+            } else {
+              auto v = std::strtod(num.c_str(), &end);
+              if (*end || errno) return false;
+              out.push_back(value(v));
+            }
+          }
+          skip();
+          if (i == text.size()) return true;
+          if (text[i++] != ',') return false;
+        }
+      }
+
+      // Maps the names used in query plans (table names or aliases) to tables.
+      inline std::map<std::string, std::string> plan_names(std::vector<std::string> const& words, std::vector<std::string> const& tables)
+      {
+        static char const* const keywords[] = {
+          "where", "join", "on", "inner", "left", "right", "full", "outer", "cross", "natural", "using",
+          "group", "order", "limit", "set", "indexed", "not", "union", "except", "intersect", "window",
+          "values", "default", "returning", "having", "select", "from"
+        };
+        std::map<std::string, std::string> names;
+        for (auto& t : tables) {
+          names[t] = t;
+        }
+        for (std::size_t i = 0; i + 1 < words.size(); ++i) {
+          if (std::find(tables.begin(), tables.end(), words[i]) == tables.end()) continue;
+          auto j = i + 1;
+          if (words[j] == "as" && j + 1 < words.size()) ++j;
+          if (std::find(std::begin(keywords), std::end(keywords), words[j]) == std::end(keywords)) {
+            names[words[j]] = words[i];
+          }
+        }
+        return names;
+      }
+
+      class plan_probe : public command
+      {
+       public:
+        plan_probe(database& db, char const* sql) : command(db, sql) {}
+
+        bool timeable() const {
+          return stmt_ && sqlite3_stmt_readonly(stmt_) && sqlite3_bind_parameter_count(stmt_) == 0;
+        }
+      };
+
+      inline std::string indent(std::string const& text)
+      {
+        std::string out;
+        std::istringstream in(text);
+        std::string line;
+        while (std::getline(in, line)) {
+          out += "    " + line + "\n";
+        }
+        return out;
+      }
+
+      struct status_metric
+      {
+        char const* name;
+        char const* type;
+        char const* help;
+        long long database_status::* value;
+      };
+
+      status_metric const status_metrics[] = {
+        {"cache_hit", "counter", "Page cache hits.", &database_status::cache_hit},
+        {"cache_miss", "counter", "Page cache misses.", &database_status::cache_miss},
+        {"cache_write", "counter", "Dirty pages written to the database file.", &database_status::cache_write},
+        {"cache_spill", "counter", "Dirty pages spilled mid-transaction.", &database_status::cache_spill},
+        {"cache_used_bytes", "gauge", "Heap used by the page cache.", &database_status::cache_used},
+        {"cache_used_shared_bytes", "gauge", "Page cache heap, shared caches split between users.", &database_status::cache_used_shared},
+        {"lookaside_used", "gauge", "Lookaside slots in use.", &database_status::lookaside_used},
+        {"lookaside_highwater", "gauge", "Most lookaside slots ever in use.", &database_status::lookaside_highwater},
+        {"lookaside_hit", "counter", "Allocations served from lookaside.", &database_status::lookaside_hit},
+        {"lookaside_miss_size", "counter", "Lookaside misses because the request was too large.", &database_status::lookaside_miss_size},
+        {"lookaside_miss_full", "counter", "Lookaside misses because all slots were in use.", &database_status::lookaside_miss_full},
+        {"schema_used_bytes", "gauge", "Heap used by schemas.", &database_status::schema_used},
+        {"stmt_used_bytes", "gauge", "Heap used by prepared statements.", &database_status::stmt_used},
+        {"deferred_fks", "gauge", "Outstanding deferred foreign key violations.", &database_status::deferred_fks},
+      };
+
+      char const* const schema_sql =
+        "SELECT sql FROM sqlite_master WHERE sql IS NOT NULL AND name NOT LIKE 'sqlite\\_%' ESCAPE '\\'";
+
+      // Raw statements, so that they never reach the execution handler
+      // that calls these.
+      inline int schema_version(sqlite3* db)
+      {
+        sqlite3_stmt* stmt = nullptr;
+        auto version = -1;
+        if (sqlite3_prepare_v2(db, "PRAGMA schema_version", -1, &stmt, nullptr) == SQLITE_OK &&
+            sqlite3_step(stmt) == SQLITE_ROW) {
+          version = sqlite3_column_int(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+        return version;
+      }
+
+      // An in-memory database with the main schema of db, to plan on.
+      inline std::shared_ptr<database> copy_schema(sqlite3* db)
+      {
+        auto copy = std::make_shared<database>(":memory:");
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(db, schema_sql, -1, &stmt, nullptr) != SQLITE_OK) {
+          sqlite3_finalize(stmt);
+          return nullptr;
+        }
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+          copy->execute(reinterpret_cast<char const*>(sqlite3_column_text(stmt, 0)));
+        }
+        sqlite3_finalize(stmt);
+        return copy;
+      }
+
+      inline std::string escape_label(std::string const& s)
+      {
+        std::string out;
+        for (auto c : s) {
+          if (c == '\\' || c == '"') out += '\\';
+          if (c == '\n') {
+            out += "\\n";
+            continue;
+          }
+          out += c;
+        }
+        return out;
+      }
+
+    } // namespace
+
+
+    inline sql_profiler::entry::entry() : executions(0)
+    {
+    }
+
+    inline sql_profiler::state::state()
+    {
+      static std::atomic<unsigned long long> next_id(1);
+      id = next_id++;
+    }
+
+    inline sql_profiler::state::~state()
+    {
+      ++profiler_deaths();
+    }
+
+    inline sql_profiler::sql_profiler(int shards) : state_(std::make_shared<state>())
+    {
+      for (int i = 0; i < std::max(shards, 1); ++i) {
+        state_->shards.emplace_back(new shard);
+      }
+    }
+
+    inline void sql_profiler::attach(database& db)
+    {
+      auto st = state_;
+      db.set_trace_handler(SQLITE_TRACE_STMT | SQLITE_TRACE_PROFILE, [st](unsigned type, void* p, void* x) {
+        auto stmt = static_cast<sqlite3_stmt*>(p);
+        if (type == SQLITE_TRACE_STMT) {
+          // Trigger programs are reported as "-- TRIGGER name"; skip them.
+          auto text = static_cast<char const*>(x);
+          if (text && text[0] == '-' && text[1] == '-') return 0;
+          if (auto e = lookup(st, stmt, true)) ++e->executions;
+        } else if (type == SQLITE_TRACE_PROFILE) {
+          if (auto e = lookup(st, stmt, false)) e->latency.record(*static_cast<sqlite3_int64*>(x));
+        }
+        return 0;
+      });
+    }
+
+    inline sql_profiler::entry* sql_profiler::lookup(std::shared_ptr<state> const& sp, sqlite3_stmt* stmt, bool start)
+    {
+      struct thread_cache {
+        std::weak_ptr<state> owner;
+        std::unordered_map<sqlite3_stmt*, cached_stmt> stmts;
+      };
+      // Never shared between threads, so no lock is needed. The caches of
+      // destroyed profilers are dropped once a thread notices a death.
+      static thread_local std::unordered_map<unsigned long long, thread_cache> caches;
+      static thread_local unsigned long long deaths = 0;
+      auto seen = profiler_deaths().load(std::memory_order_relaxed);
+      if (seen != deaths) {
+        deaths = seen;
+        for (auto it = caches.begin(); it != caches.end();) {
+          if (it->second.owner.expired()) {
+            it = caches.erase(it);
+          } else {
+            ++it;
+          }
+        }
+      }
+      auto& st = *sp;
+      auto& tc = caches[st.id];
+      if (tc.owner.expired()) tc.owner = sp;
+      auto& cache = tc.stmts;
+
+      auto it = cache.find(stmt);
+      if (!start && it != cache.end()) {
+        return it->second.e;
+      }
+      auto sql = sqlite3_sql(stmt);
+      if (!sql) return nullptr;
+      auto h = sql_hash(sql);
+      if (it != cache.end() && it->second.hash == h) {
+        return it->second.e;
+      }
+
+      auto& sh = *st.shards[thread_shard(st.shards.size())];
+      entry* e = nullptr;
+      {
+        std::lock_guard<std::mutex> lock(sh.mutex);
+        auto& slot = sh.entries[normalize(sql)];
+        if (!slot) {
+          slot.reset(new entry);
+        }
+        e = slot.get();
+      }
+      if (cache.size() >= 4096) {
+        cache.clear();
+      }
+      cache[stmt] = cached_stmt{h, e};
+      return e;
+    }
+
+    inline std::vector<sql_profile> sql_profiler::snapshot() const
+    {
+      std::map<std::string, sql_profile> merged;
+      for (auto& sh : state_->shards) {
+        std::lock_guard<std::mutex> lock(sh->mutex);
+        for (auto& kv : sh->entries) {
+          auto& p = merged[kv.first];
+          p.sql = kv.first;
+          p.executions += kv.second->executions.load();
+          p.latency += kv.second->latency.snapshot();
+        }
+      }
+
+      std::vector<sql_profile> profiles;
+      for (auto& kv : merged) {
+        if (kv.second.executions || kv.second.latency.count()) {
+          profiles.push_back(kv.second);
+        }
+      }
+      std::sort(profiles.begin(), profiles.end(), [](sql_profile const& a, sql_profile const& b) {
+        return a.latency.sum() > b.latency.sum();
+      });
+      return profiles;
+    }
+
+    inline void sql_profiler::reset()
+    {
+      // Entries are kept so that concurrent recorders never see them freed.
+      for (auto& sh : state_->shards) {
+        std::lock_guard<std::mutex> lock(sh->mutex);
+        for (auto& kv : sh->entries) {
+          kv.second->latency.reset();
+          kv.second->executions = 0;
+        }
+      }
+    }
+
+    inline std::string sql_profiler::normalize(char const* sql)
+    {
+      std::string out;
+      auto n = std::strlen(sql);
+      out.reserve(n);
+
+      auto space = false;
+      for (std::size_t i = 0; i < n; ++i) {
+        auto c = sql[i];
+        if (std::isspace(static_cast<unsigned char>(c))) {
+          space = true;
+          continue;
+        }
+        if (c == '-' && sql[i + 1] == '-') {
+          while (i < n && sql[i] != '\n') ++i;
+          space = true;
+          continue;
+        }
+        if (c == '/' && sql[i + 1] == '*') {
+          auto end = std::strstr(sql + i + 2, "*/");
+          i = end ? static_cast<std::size_t>(end - sql) + 1 : n;
+          space = true;
+          continue;
+        }
+        if (space && !out.empty()) {
+          out += ' ';
+        }
+        space = false;
+
+        auto after_ident = !out.empty() && is_ident_char(out.back());
+        if (c == '\'' || ((c == 'x' || c == 'X') && sql[i + 1] == '\'' && !after_ident)) {
+          // String or blob literal; '' is an escaped quote.
+          if (c != '\'') ++i;
+          for (++i; i < n; ++i) {
+            if (sql[i] == '\'') {
+              if (sql[i + 1] != '\'') break;
+              ++i;
+            }
+          }
+          out += '?';
+        } else if (!after_ident && (std::isdigit(static_cast<unsigned char>(c)) ||
+                                    (c == '.' && std::isdigit(static_cast<unsigned char>(sql[i + 1]))))) {
+          while (i + 1 < n && (is_ident_char(sql[i + 1]) || sql[i + 1] == '.' ||
+                               ((sql[i + 1] == '+' || sql[i + 1] == '-') && (sql[i] == 'e' || sql[i] == 'E')))) {
+            ++i;
+          }
+          out += '?';
+        } else if (c == '"' || c == '`' || c == '[') {
+          auto close = c == '[' ? ']' : c;
+          auto start = i;
+          for (++i; i < n && sql[i] != close; ++i) {
+          }
+          out.append(sql + start, std::min(i + 1, n) - start);
+        } else {
+          out += c;
+        }
+      }
+      return out;
+    }
+
+    inline std::string explain_query_plan(database& db, char const* sql)
+    {
+      std::string text;
+      std::map<int, int> depth;
+      query qry(db, (std::string("EXPLAIN QUERY PLAN ") + sql).c_str());
+      for (auto row : qry) {
+        append_plan_row(text, depth, row.get<int>(0), row.get<int>(1), row.get<char const*>(3));
+      }
+      return text;
+    }
+
+    inline slow_query_log::state::state(std::size_t capacity)
+      : queue(capacity), pushed(0), delivered(0), dropped(0), closed(false), stop(false)
+    {
+    }
+
+    inline slow_query_log::slow_query_log(std::chrono::nanoseconds threshold, sink s, std::size_t capacity, std::size_t plan_capacity)
+      : threshold_(threshold), sink_(s), state_(std::make_shared<state>(capacity)), plan_capacity_(std::max<std::size_t>(plan_capacity, 1))
+    {
+      thread_ = std::thread(&slow_query_log::run, this);
+    }
+
+    inline slow_query_log::~slow_query_log()
+    {
+      {
+        // The handlers stay installed but stop pushing, and let go of
+        // their planner connections.
+        std::lock_guard<std::mutex> lock(state_->attached_mutex);
+        state_->closed = true;
+        for (auto att : state_->attached) {
+          att->planner.reset();
+        }
+      }
+      {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        state_->stop = true;
+      }
+      state_->cv.notify_all();
+      thread_.join();
+    }
+
+    inline void slow_query_log::attach(database& db)
+    {
+      std::shared_ptr<database> planner;
+      auto version = -1;
+      try {
+        auto path = db.filename();
+        if (*path) {
+          planner = std::make_shared<database>(path, SQLITE_OPEN_READONLY);
+        } else {
+          query pragma(db, "PRAGMA schema_version");
+          version = (*pragma.begin()).get<int>(0);
+          planner = std::make_shared<database>(":memory:");
+          query qry(db, schema_sql);
+          for (auto row : qry) {
+            planner->execute(row.get<char const*>(0));
+          }
+        }
+      } catch (database_error&) {
+        // Records are still logged, without plans.
+        planner.reset();
+      }
+
+      auto st = state_;
+      auto att = std::make_shared<attachment>(st, planner, version);
+      db.set_execution_handler([st, att](execution_info const& info) {
+        if (st->closed.load(std::memory_order_relaxed)) return;
+        std::shared_ptr<database> planner;
+        {
+          std::lock_guard<std::mutex> lock(st->attached_mutex);
+          if (st->closed) return;
+          if (att->schema_version != -1) {
+            auto db = sqlite3_db_handle(info.stmt);
+            auto version = schema_version(db);
+            if (version != att->schema_version) {
+              att->schema_version = version;
+              try {
+                att->planner = copy_schema(db);
+              } catch (database_error&) {
+                att->planner.reset();
+              }
+            }
+          }
+          planner = att->planner;
+        }
+        pending p;
+        p.record.when = std::chrono::system_clock::now();
+        p.record.elapsed = info.elapsed;
+        p.record.rows = info.rows;
+        p.record.stats = info.stats;
+
+        auto expanded = sqlite3_expanded_sql(info.stmt);
+        p.record.sql = expanded ? expanded : sqlite3_sql(info.stmt);
+        sqlite3_free(expanded);
+        p.sql = sqlite3_sql(info.stmt);
+        p.planner = planner;
+
+        // Counted before pushing so that delivered never exceeds pushed.
+        ++st->pushed;
+        if (st->queue.try_push(std::move(p))) {
+          st->cv.notify_one();
+        } else {
+          --st->pushed;
+          ++st->dropped;
+        }
+      }, threshold_);
+    }
+
+    inline void slow_query_log::detach(database& db)
+    {
+      db.set_execution_handler(database::execution_handler());
+    }
+
+    inline slow_query_log::attachment::attachment(std::shared_ptr<state> st, std::shared_ptr<database> planner, int schema_version)
+      : st(st), planner(planner), schema_version(schema_version)
+    {
+      std::lock_guard<std::mutex> lock(st->attached_mutex);
+      st->attached.push_back(this);
+    }
+
+    inline slow_query_log::attachment::~attachment()
+    {
+      std::lock_guard<std::mutex> lock(st->attached_mutex);
+      auto it = std::find(st->attached.begin(), st->attached.end(), this);
+      if (it != st->attached.end()) st->attached.erase(it);
+    }
+
+    inline void slow_query_log::flush()
+    {
+      std::unique_lock<std::mutex> lock(state_->mutex);
+      while (state_->delivered.load() < state_->pushed.load()) {
+        state_->cv.notify_all();
+        state_->cv.wait_for(lock, std::chrono::milliseconds(1));
+      }
+    }
+
+    inline long long slow_query_log::dropped() const
+    {
+      return state_->dropped.load();
+    }
+
+    inline void slow_query_log::run()
+    {
+      auto& st = *state_;
+      for (;;) {
+        pending p;
+        while (st.queue.try_pop(p)) {
+          if (p.planner && first_time(p.sql)) {
+            try {
+              p.record.plan = explain_query_plan(*p.planner, p.sql.c_str());
+            } catch (database_error&) {
+              // E.g. a table created after attach() on an in-memory database.
+            }
+          }
+          p.planner.reset();
+          sink_(p.record);
+          ++st.delivered;
+        }
+        std::unique_lock<std::mutex> lock(st.mutex);
+        if (st.stop && st.delivered.load() == st.pushed.load()) break;
+        // Producers notify without taking the lock, so also poll.
+        st.cv.wait_for(lock, std::chrono::milliseconds(10));
+      }
+    }
+
+    inline bool slow_query_log::first_time(std::string const& sql)
+    {
+      auto it = planned_index_.find(sql);
+      if (it != planned_index_.end()) {
+        planned_.splice(planned_.begin(), planned_, it->second);
+        return false;
+      }
+      if (planned_.size() >= plan_capacity_) {
+        planned_index_.erase(planned_.back());
+        planned_.pop_back();
+      }
+      planned_.push_front(sql);
+      planned_index_[sql] = planned_.begin();
+      return true;
+    }
+
+    inline index_advisor::index_advisor(database& db, advisor_options const& opts) : db_(db), opts_(opts)
+    {
+    }
+
+    inline std::vector<index_proposal> index_advisor::analyze()
+    {
+      std::vector<std::string> statements;
+      auto registry = db_.statement_stats_by_sql();
+      for (auto& kv : registry) {
+        if (kv.second.autoindexes >= opts_.min_autoindexes || kv.second.fullscan_steps >= opts_.min_fullscan_steps) {
+          statements.push_back(kv.first);
+        }
+      }
+      return analyze(statements, registry, db_.statement_samples());
+    }
+
+    inline std::vector<index_proposal> index_advisor::analyze(std::vector<std::string> const& statements)
+    {
+      return analyze(statements, std::map<std::string, statement_stats>(), std::map<std::string, std::string>());
+    }
+
+    inline std::vector<index_proposal> index_advisor::analyze(std::vector<std::string> const& statements,
+                                                              std::map<std::string, statement_stats> const& registry,
+                                                              std::map<std::string, std::string> const& samples)
+    {
+      std::unique_ptr<database> planner;
+      auto path = db_.filename();
+      if (*path) {
+        try {
+          planner.reset(new database(path, SQLITE_OPEN_READONLY));
+        } catch (database_error&) {
+        }
+      }
+      if (!planner) {
+        planner.reset(new database(":memory:"));
+        if (db_.backup(*planner) != SQLITE_DONE) return std::vector<index_proposal>();
+      }
+
+      database schema(":memory:");
+      {
+        query qry(*planner, schema_sql);
+        for (auto row : qry) {
+          schema.execute(row.get<char const*>(0));
+        }
+      }
+
+      std::vector<index_proposal> proposals;
+      for (auto& sql : statements) {
+        auto first = proposals.size();
+        auto st = registry.find(sql);
+        propose(sql, st == registry.end() ? statement_stats() : st->second, *planner, schema, proposals);
+        auto sample = samples.find(sql);
+        for (auto i = first; sample != samples.end() && i < proposals.size(); ++i) {
+          proposals[i].sample = sample->second;
+        }
+      }
+      if (opts_.validate) {
+        validate(proposals);
+      }
+      return proposals;
+    }
+
+    inline void index_advisor::propose(std::string const& sql, statement_stats const& stats, database& planner, database& schema, std::vector<index_proposal>& out)
+    {
+      std::string plan;
+      try {
+        plan = explain_query_plan(planner, sql.c_str());
+      } catch (database_error&) {
+        return;
+      }
+
+      std::vector<std::string> tables;
+      {
+        query qry(schema, "SELECT lower(name) FROM sqlite_master WHERE type = 'table'");
+        for (auto row : qry) {
+          tables.push_back(row.get<std::string>(0));
+        }
+      }
+      auto words = sql_words(sql);
+      auto names = plan_names(words, tables);
+
+      // Index name and column list for each table that needs one.
+      std::vector<std::pair<std::string, std::vector<std::string> > > wanted;
+
+      std::istringstream lines(plan);
+      std::string line;
+      while (std::getline(lines, line)) {
+        auto pos = line.find_first_not_of(' ');
+        if (pos == std::string::npos) continue;
+        line = line.substr(pos);
+
+        std::istringstream in(line);
+        std::string verb, name;
+        in >> verb >> name;
+        auto it = names.find(lower(name));
+        if (it == names.end()) continue;
+        auto& table = it->second;
+
+        auto autoidx = line.find("AUTOMATIC");
+        if (verb == "SEARCH" && autoidx != std::string::npos) {
+          auto open = line.find('(', autoidx);
+          auto close = line.find(')', open);
+          if (open == std::string::npos || close == std::string::npos) continue;
+          std::vector<std::string> cols;
+          std::istringstream terms(line.substr(open + 1, close - open - 1));
+          std::string term;
+          while (terms >> term) {
+            if (term == "AND") continue;
+            auto end = term.find_first_of("=<>");
+            cols.push_back(term.substr(0, end));
+          }
+          wanted.push_back(std::make_pair(table, cols));
+        } else if (verb == "SCAN" && line.find("INDEX") == std::string::npos && plan.find("AUTOMATIC") == std::string::npos) {
+          // Try each column mentioned in the statement on the schema copy.
+          // Joins with an automatic index are covered by that proposal;
+          // the outer loop of a join is a scan either way.
+          std::vector<std::string> columns;
+          {
+            query qry(schema, ("SELECT lower(name) FROM pragma_table_info(" + quote_identifier(table) + ")").c_str());
+            for (auto row : qry) {
+              columns.push_back(row.get<std::string>(0));
+            }
+          }
+          for (auto& col : columns) {
+            if (std::find(words.begin(), words.end(), col) == words.end()) continue;
+            auto trial = "sqlite3pp_advisor_trial";
+            if (schema.executef("CREATE INDEX \"%w\" ON \"%w\"(\"%w\")", trial, table.c_str(), col.c_str()) != SQLITE_OK) continue;
+            std::string after;
+            try {
+              after = explain_query_plan(schema, sql.c_str());
+            } catch (database_error&) {
+            }
+            schema.executef("DROP INDEX \"%w\"", trial);
+            // A covering index scan is still a scan; only a search counts.
+            auto at = after.find(trial);
+            auto bol = at == std::string::npos ? at : after.rfind('\n', at);
+            bol = bol == std::string::npos ? 0 : bol + 1;
+            if (at != std::string::npos && after.find("SEARCH", bol) == after.find_first_not_of(' ', bol)) {
+              wanted.push_back(std::make_pair(table, std::vector<std::string>(1, col)));
+              break;
+            }
+          }
+        }
+      }
+
+      for (auto& w : wanted) {
+        index_proposal p;
+        p.sql = sql;
+        p.stats = stats;
+        p.plan = plan;
+        auto name = "idx_" + w.first;
+        std::string cols;
+        for (auto& c : w.second) {
+          name += "_" + lower(c);
+          cols += (cols.empty() ? "" : ", ") + quote_identifier(c);
+        }
+        p.create_index = "CREATE INDEX " + quote_identifier(name) + " ON " + quote_identifier(w.first) + " (" + cols + ")";
+        out.push_back(p);
+      }
+    }
+
+    inline void index_advisor::validate(std::vector<index_proposal>& proposals)
+    {
+      database scratch(":memory:");
+      if (db_.backup(scratch) != SQLITE_DONE) return;
+
+      auto time = [this, &scratch](std::string const& sql) {
+        std::vector<std::chrono::nanoseconds> times;
+        for (int i = 0; i < std::max(opts_.runs, 1); ++i) {
+          command cmd(scratch, sql.c_str());
+          auto start = std::chrono::steady_clock::now();
+          while (cmd.step() == SQLITE_ROW) {
+          }
+          times.push_back(std::chrono::steady_clock::now() - start);
+        }
+        std::sort(times.begin(), times.end());
+        return times[times.size() / 2];
+      };
+
+      for (auto& p : proposals) {
+        auto& sql = p.sample.empty() ? p.sql : p.sample;
+        // Parameters would run as NULL, and writes would change the copy.
+        {
+          plan_probe probe(scratch, sql.c_str());
+          if (!probe.timeable()) continue;
+        }
+        p.before = time(sql);
+        scratch.execute("SAVEPOINT sqlite3pp_advisor");
+        if (scratch.execute(p.create_index.c_str()) == SQLITE_OK) {
+          p.after = time(sql);
+          p.validated = true;
+        }
+        scratch.execute("ROLLBACK TO sqlite3pp_advisor");
+        scratch.execute("RELEASE sqlite3pp_advisor");
+        if (!p.validated) continue;
+        p.speedup = p.after.count() > 0 ? static_cast<double>(p.before.count()) / p.after.count() : 0.0;
+      }
+    }
+
+    inline std::string index_advisor::report(std::vector<index_proposal> const& proposals)
+    {
+      std::ostringstream out;
+      for (auto& p : proposals) {
+        out << p.create_index << ";\n";
+        out << "  -- for: " << p.sql << "\n";
+        out << "  -- full scan steps: " << p.stats.fullscan_steps << ", automatic indexes: " << p.stats.autoindexes << "\n";
+        if (p.validated) {
+          out << "  -- " << p.before.count() / 1000 << "us -> " << p.after.count() / 1000 << "us, speedup " << p.speedup << "x\n";
+        }
+      }
+      return out.str();
+    }
+
+    inline std::vector<workload_entry> load_workload(std::istream& in)
+    {
+      std::vector<workload_entry> workload;
+      std::string line, pending;
+      bool has_params = false;
+      auto trim = [](std::string const& str) {
+        auto b = str.find_first_not_of(" \t\r");
+        auto e = str.find_last_not_of(" \t\r");
+        return b == std::string::npos ? std::string() : str.substr(b, e - b + 1);
+      };
+
+      while (std::getline(in, line)) {
+        auto t = trim(line);
+        if (t.compare(0, 10, "-- params:") == 0) {
+          if (workload.empty()) continue;
+          if (has_params) workload.push_back(workload.back());
+          workload.back().params = trim(t.substr(10));
+          has_params = true;
+          continue;
+        }
+        t = trim(strip_comment(t));
+        if (t.empty()) {
+          continue;
+        } else {
+          pending += pending.empty() ? t : "\n" + t;
+          if (t.back() == ';') {
+            pending.pop_back();
+            workload_entry e;
+            e.sql = trim(pending);
+            workload.push_back(e);
+            pending.clear();
+            has_params = false;
+          }
+        }
+      }
+      return workload;
+    }
+
+    inline plan_harness::plan_harness(database& db, harness_options const& opts) : db_(db), opts_(opts)
+    {
+    }
+
+    inline plan_sample plan_harness::measure(workload_entry const& e)
+    {
+      plan_sample s;
+      s.sql = e.sql;
+      s.params = e.params;
+      s.plan = explain_query_plan(db_, e.sql.c_str());
+
+      query qry(db_, e.sql.c_str());
+      if (!e.params.empty()) {
+        std::vector<value> params;
+        if (!parse_literals(e.params, params)) {
+          throw database_error(("bad params: " + e.params).c_str());
+        }
+        for (std::size_t i = 0; i < params.size(); ++i) {
+          if (qry.bind(static_cast<int>(i) + 1, params[i]) != SQLITE_OK) throw database_error(db_);
+        }
+      }
+
+      std::vector<std::chrono::nanoseconds> times;
+      for (int i = 0; i < std::max(opts_.runs, 1); ++i) {
+        db_.execute("SAVEPOINT sqlite3pp_plan_harness");
+        auto start = std::chrono::steady_clock::now();
+        for (auto it = qry.begin(); it != qry.end(); ++it) {
+        }
+        times.push_back(std::chrono::steady_clock::now() - start);
+        qry.reset();
+        db_.execute("ROLLBACK TO sqlite3pp_plan_harness");
+        db_.execute("RELEASE sqlite3pp_plan_harness");
+      }
+      std::sort(times.begin(), times.end());
+      s.median = times[times.size() / 2];
+      s.p99 = times[std::min(times.size() - 1, times.size() * 99 / 100)];
+      return s;
+    }
+
+    inline std::vector<plan_sample> plan_harness::run(std::vector<workload_entry> const& workload)
+    {
+      std::vector<plan_sample> samples;
+      for (auto& e : workload) {
+        samples.push_back(measure(e));
+      }
+      return samples;
+    }
+
+    inline std::vector<plan_diff> plan_harness::compare(std::vector<plan_sample> const& baseline, std::vector<plan_sample> const& current) const
+    {
+      std::map<std::pair<std::string, std::string>, plan_sample const*> base;
+      for (auto& b : baseline) {
+        base[std::make_pair(b.sql, b.params)] = &b;
+      }
+
+      auto worse = [this](std::chrono::nanoseconds before, std::chrono::nanoseconds after) {
+        return after - before >= opts_.min_delta && after.count() >= before.count() * opts_.slowdown_threshold;
+      };
+
+      std::vector<plan_diff> diffs;
+      for (auto& c : current) {
+        auto it = base.find(std::make_pair(c.sql, c.params));
+        if (it == base.end()) continue;
+        plan_diff d;
+        d.baseline = *it->second;
+        d.current = c;
+        d.plan_changed = d.baseline.plan != c.plan;
+        d.regressed = worse(d.baseline.median, c.median) || worse(d.baseline.p99, c.p99);
+        d.slowdown = d.baseline.median.count() > 0 ? static_cast<double>(c.median.count()) / d.baseline.median.count() : 0.0;
+        diffs.push_back(d);
+      }
+      return diffs;
+    }
+
+    inline int plan_harness::save(database& store, std::vector<plan_sample> const& samples)
+    {
+      auto rc = store.execute(
+          "CREATE TABLE IF NOT EXISTS plan_baseline ("
+          "sql TEXT NOT NULL, params TEXT NOT NULL, plan TEXT NOT NULL, "
+          "median_ns INTEGER NOT NULL, p99_ns INTEGER NOT NULL, PRIMARY KEY (sql, params))");
+      if (rc != SQLITE_OK) return rc;
+
+      transaction xct(store);
+      command cmd(store, "INSERT OR REPLACE INTO plan_baseline VALUES (?, ?, ?, ?, ?)");
+      for (auto& s : samples) {
+        cmd.reset();
+        cmd.bind(1, s.sql, nocopy);
+        cmd.bind(2, s.params, nocopy);
+        cmd.bind(3, s.plan, nocopy);
+        cmd.bind(4, static_cast<long long int>(s.median.count()));
+        cmd.bind(5, static_cast<long long int>(s.p99.count()));
+        if ((rc = cmd.execute()) != SQLITE_OK) return rc;
+      }
+      return xct.commit();
+    }
+
+    inline std::vector<plan_sample> plan_harness::load(database& store)
+    {
+      std::vector<plan_sample> samples;
+      query qry(store, "SELECT sql, params, plan, median_ns, p99_ns FROM plan_baseline");
+      for (auto row : qry) {
+        plan_sample s;
+        s.sql = row.get<std::string>(0);
+        s.params = row.get<std::string>(1);
+        s.plan = row.get<std::string>(2);
+        s.median = std::chrono::nanoseconds(row.get<long long int>(3));
+        s.p99 = std::chrono::nanoseconds(row.get<long long int>(4));
+        samples.push_back(s);
+      }
+      return samples;
+    }
+
+    inline std::string plan_harness::report(std::vector<plan_diff> const& diffs)
+    {
+      std::ostringstream out;
+      for (auto& d : diffs) {
+        if (!d.plan_changed && !d.regressed) continue;
+        out << (d.regressed ? "REGRESSED" : "PLAN CHANGED") << ": " << d.current.sql;
+        if (!d.current.params.empty()) out << "  -- params: " << d.current.params;
+        out << "\n  median " << d.baseline.median.count() / 1000 << "us -> " << d.current.median.count() / 1000 << "us"
+            << ", p99 " << d.baseline.p99.count() / 1000 << "us -> " << d.current.p99.count() / 1000 << "us\n";
+        if (d.plan_changed) {
+          out << "  before:\n" << indent(d.baseline.plan) << "  after:\n" << indent(d.current.plan);
+        }
+      }
+      return out.str();
+    }
+
+    inline status_exporter::status_exporter(format fmt, sink s) : fmt_(fmt), sink_(s), stop_(false)
+    {
+    }
+
+    inline status_exporter::~status_exporter()
+    {
+      stop();
+    }
+
+    inline status_exporter::sink status_exporter::file_sink(std::string const& path, error_handler on_error)
+    {
+      return [path, on_error](std::string const& text) {
+        auto tmp = path + ".tmp";
+        {
+          std::ofstream out(tmp.c_str(), std::ios::binary | std::ios::trunc);
+          out << text;
+          out.close();
+          if (!out) {
+            std::remove(tmp.c_str());
+            if (on_error) on_error("cannot write " + tmp);
+            return;
+          }
+        }
+        if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+          auto err = errno;
+          std::remove(tmp.c_str());
+          if (on_error) on_error("cannot rename " + tmp + " to " + path + ": " + std::strerror(err));
+        }
+      };
+    }
+
+    inline void status_exporter::add(database& db, std::string const& name)
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      dbs_.push_back(std::make_pair(name, &db));
+    }
+
+    inline void status_exporter::remove(database& db)
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      dbs_.erase(std::remove_if(dbs_.begin(), dbs_.end(), [&db](std::pair<std::string, database*> const& e) {
+        return e.second == &db;
+      }), dbs_.end());
+    }
+
+    inline std::string status_exporter::render() const
+    {
+      std::vector<std::pair<std::string, database_status> > statuses;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& e : dbs_) {
+          statuses.push_back(std::make_pair(e.first, e.second->status()));
+        }
+      }
+
+      std::ostringstream out;
+      if (fmt_ == prometheus) {
+        for (auto& m : status_metrics) {
+          // Prometheus names counters with a _total suffix.
+          std::string name = m.name;
+          if (std::strcmp(m.type, "counter") == 0) name += "_total";
+          out << "# HELP sqlite3pp_" << name << " " << m.help << "\n";
+          out << "# TYPE sqlite3pp_" << name << " " << m.type << "\n";
+          for (auto& st : statuses) {
+            out << "sqlite3pp_" << name << "{db=\"" << escape_label(st.first) << "\"} " << st.second.*m.value << "\n";
+          }
+        }
+      } else {
+        out << "{";
+        for (std::size_t i = 0; i < statuses.size(); ++i) {
+          out << (i ? "," : "") << "\"" << escape_label(statuses[i].first) << "\":{";
+          auto first = true;
+          for (auto& m : status_metrics) {
+            out << (first ? "" : ",") << "\"" << m.name << "\":" << statuses[i].second.*m.value;
+            first = false;
+          }
+          out << "}";
+        }
+        out << "}\n";
+      }
+      return out.str();
+    }
+
+    inline void status_exporter::export_now()
+    {
+      sink_(render());
+    }
+
+    inline void status_exporter::start(std::chrono::milliseconds interval)
+    {
+      stop();
+      stop_ = false;
+      thread_ = std::thread(&status_exporter::run, this, interval);
+    }
+
+    inline void status_exporter::stop()
+    {
+      {
+        std::lock_guard<std::mutex> lock(run_mutex_);
+        stop_ = true;
+      }
+      cv_.notify_all();
+      if (thread_.joinable()) {
+        thread_.join();
+      }
+    }
+
+    inline void status_exporter::run(std::chrono::milliseconds interval)
+    {
+      std::unique_lock<std::mutex> lock(run_mutex_);
+      while (!stop_) {
+        lock.unlock();
+        export_now();
+        lock.lock();
+        cv_.wait_for(lock, interval, [this] { return stop_; });
+      }
+    }
+
+  } // namespace prof
+
+} // namespace sqlite3pp
@@ -1,9 +1,22 @@
+// The system SQLite used by the tests is built with unlock_notify.
+#define SQLITE_ENABLE_UNLOCK_NOTIFY
+
 #include <iostream>
 #include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <thread>
 #include <vector>
 #include <string>
 #include "sqlite3pp.h"
 #include "sqlite3ppext.h"
+#include "sqlite3ppmem.h"
+#include "sqlite3ppprof.h"
 
 using namespace std;
 
@@ -134,12 +147,33 @@ void test_extensions() {
     func.create<int (int, int)>("myadd", [](int a, int b) { return a + b; });
     func.create<string (string)>("myecho", [](string s) { return s; });
     func.create<void (int)>("mynoop", [](int) {});
+    func.create("mytwice", std::function<int (int)>([](int a) { return a * 2; }));
 
-    sqlite3pp::query qry(db, "SELECT myadd(1, 2), myecho('hello'), mynoop(1)");
+    sqlite3pp::query qry(db, "SELECT myadd(1, 2), myecho('hello'), mynoop(1), mytwice(4)");
     auto row = *qry.begin();
     assert(row.get<int>(0) == 3);
     assert(row.get<string>(1) == "hello");
     assert(row.column_type(2) == SQLITE_NULL);
+    assert(row.get<int>(3) == 8);
+
+    // Callables are owned by the connection, not by the function object,
+    // and released when replaced.
+    auto alive = std::make_shared<int>(0);
+    {
+        sqlite3pp::ext::function scoped(db);
+        scoped.create<long long int (char const*, double)>("mylen", [alive](char const* s, double scale) {
+            return static_cast<long long int>(std::strlen(s) * scale);
+        });
+    }
+    assert(alive.use_count() == 2);
+    sqlite3pp::query qry_len(db, "SELECT mylen('abcd', 2.5)");
+    assert((*qry_len.begin()).get<long long int>(0) == 10);
+    qry_len.reset();
+    qry.reset();
+    assert(func.create<int ()>("mylen", [] { return 0; }) == SQLITE_OK);
+    assert(alive.use_count() == 2);
+    assert(func.create<int (char const*, double)>("mylen", [] (char const*, double) { return 0; }) == SQLITE_OK);
+    assert(alive.use_count() == 1);
 
     // Aggregate
     struct sum_aggr {
@@ -257,6 +291,1231 @@ void test_borrow() {
     sqlite3_close(pdb);
 }
 
+void test_busy_backoff() {
+    cout << "Testing busy backoff and transaction retry..." << endl;
+    char const* path = "test_busy.db";
+    remove(path);
+    {
+        sqlite3pp::database db1(path);
+        db1.execute("CREATE TABLE test (id INTEGER)");
+
+        sqlite3pp::database db2(path);
+        sqlite3pp::backoff_policy policy;
+        policy.deadline = std::chrono::milliseconds(50);
+        db2.set_busy_backoff(policy);
+
+        db1.execute("BEGIN IMMEDIATE");
+        assert(db2.execute("INSERT INTO test VALUES (1)") == SQLITE_BUSY);
+        db1.execute("COMMIT");
+
+        auto stats = db2.contention();
+        assert(stats.busy_timeouts == 1);
+        assert(stats.lock_waits.count() == 1);
+        assert(stats.lock_waits.max() >= 50 * 1000 * 1000);
+
+        // No busy handler: BEGIN IMMEDIATE fails and the wrapper retries.
+        sqlite3pp::database db3(path);
+        db1.execute("BEGIN IMMEDIATE");
+        std::thread releaser([&] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            db1.execute("COMMIT");
+        });
+        int calls = 0;
+        int rc = db3.run_in_transaction([&] {
+            ++calls;
+            return db3.execute("INSERT INTO test VALUES (2)");
+        });
+        releaser.join();
+        assert(rc == SQLITE_OK);
+        assert(calls == 1);
+        assert(db3.contention().transaction_retries > 0);
+        assert(db3.contention().transaction_waits.count() == 1);
+
+        sqlite3pp::query qry(db1, "SELECT COUNT(*) FROM test");
+        assert((*qry.begin()).get<int>(0) == 1);
+    }
+    remove(path);
+}
+
+void test_single_thread_database() {
+    cout << "Testing single-thread database ownership..." << endl;
+    sqlite3pp::single_thread_database db(":memory:");
+    db.execute("CREATE TABLE test (id INTEGER)");
+    sqlite3pp::command cmd(db, "INSERT INTO test VALUES (?)");
+    assert(db.owned_by_this_thread());
+
+    std::thread intruder([&] {
+        assert(!db.owned_by_this_thread());
+        assert(cmd.bind(1, 1) == SQLITE_MISUSE);
+        assert(cmd.step() == SQLITE_MISUSE);
+    });
+    intruder.join();
+
+    auto main_id = std::this_thread::get_id();
+    db.hand_off();
+    assert(!db.owned_by_this_thread());
+    std::thread worker([&] {
+        db.adopt();
+        assert(cmd.bind(1, 2) == SQLITE_OK);
+        assert(cmd.execute() == SQLITE_OK);
+        db.hand_off(main_id);
+    });
+    worker.join();
+
+    assert(db.owned_by_this_thread());
+    sqlite3pp::query qry(db, "SELECT id FROM test");
+    assert((*qry.begin()).get<int>(0) == 2);
+}
+
+void test_deadline() {
+    cout << "Testing statement and transaction deadlines..." << endl;
+    sqlite3pp::database db(":memory:");
+    char const* sql =
+        "WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < ?) "
+        "SELECT COUNT(*) FROM c";
+
+    sqlite3pp::deadline_mode modes[] = {sqlite3pp::progress_check, sqlite3pp::timer_interrupt};
+    for (auto mode : modes) {
+        db.set_deadline_mode(mode, 100);
+        sqlite3pp::query qry(db, sql);
+        qry.set_timeout(20);
+        qry.bind(1, 1000000000000LL);
+        try {
+            qry.begin();
+            assert(false);
+        } catch (sqlite3pp::deadline_exceeded&) {
+        }
+        assert(qry.timed_out());
+
+        // The statement is reset and can run again.
+        qry.bind(1, 10);
+        assert((*qry.begin()).get<int>(0) == 10);
+        assert(!qry.timed_out());
+
+        // An expired deadline of a statement left mid-result does not
+        // interrupt other statements on the connection.
+        sqlite3pp::query idle(db, "WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c) SELECT x FROM c");
+        idle.set_timeout(20);
+        assert(idle.step() == SQLITE_ROW);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        sqlite3pp::query other(db, sql);
+        other.set_timeout(60000);
+        other.bind(1, 100000);
+        assert((*other.begin()).get<int>(0) == 100000);
+        assert(!other.timed_out());
+        int rc;
+        while ((rc = idle.step()) == SQLITE_ROW) {
+        }
+        assert(rc == SQLITE_INTERRUPT && idle.timed_out());
+    }
+
+    db.set_deadline_mode(sqlite3pp::progress_check);
+    db.execute("CREATE TABLE test (id INTEGER)");
+    sqlite3pp::transaction xct(db);
+    xct.set_timeout(20);
+    sqlite3pp::command cmd(db, "INSERT INTO test WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c) SELECT x FROM c");
+    assert(cmd.execute() == SQLITE_INTERRUPT);
+    assert(cmd.timed_out());
+    // SQLite rolls back the whole transaction when a write is interrupted.
+    xct.rollback();
+    // Ignored once the transaction has ended.
+    xct.set_timeout(20);
+    sqlite3pp::query qry(db, "SELECT COUNT(*) FROM test");
+    assert((*qry.begin()).get<int>(0) == 0);
+
+    // Deadlines of interleaved executions are armed independently.
+    db.execute("INSERT INTO test VALUES (1), (2), (3)");
+    sqlite3pp::query outer(db, "SELECT id FROM test");
+    outer.set_timeout(60000);
+    sqlite3pp::query inner(db, sql);
+    inner.set_timeout(20);
+    inner.bind(1, 1000000000000LL);
+    int seen = 0;
+    for (auto row : outer) {
+        (void)row;
+        assert(inner.step() == SQLITE_INTERRUPT && inner.timed_out());
+        ++seen;
+    }
+    assert(seen == 3 && !outer.timed_out());
+
+
+    // A moved connection does not keep deadline state of the old object.
+    sqlite3pp::database src(":memory:");
+    src.set_deadline(std::chrono::steady_clock::now() + std::chrono::seconds(60));
+    assert(src.execute("CREATE TABLE t (x)") == SQLITE_OK);
+    sqlite3pp::database dst(std::move(src));
+    dst.clear_deadline();
+    sqlite3pp::query after(dst, sql);
+    after.set_timeout(20);
+    after.bind(1, 1000000000000LL);
+    assert(after.step() == SQLITE_INTERRUPT && after.timed_out());
+}
+
+void test_progress_handler() {
+    cout << "Testing progress handler and cooperative yield..." << endl;
+    char const* sql =
+        "WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < 10000) "
+        "SELECT COUNT(*) FROM c";
+
+    int other_tasks = 0;
+    sqlite3pp::cooperative_yield yielder([&] { ++other_tasks; });
+    sqlite3pp::database db(":memory:");
+    db.set_progress_handler(yielder, 100);
+    {
+        sqlite3pp::query qry(db, sql);
+        assert((*qry.begin()).get<int>(0) == 10000);
+    }
+    auto yields = yielder.statistics().yields;
+    assert(yields > 0);
+    assert(other_tasks == yields);
+    assert(yielder.statistics().yield_times.count() == yields);
+
+    // Survives a move and keeps working alongside a deadline.
+    sqlite3pp::database db2 = std::move(db);
+    {
+        sqlite3pp::query qry(db2, sql);
+        qry.set_timeout(10000);
+        assert((*qry.begin()).get<int>(0) == 10000);
+    }
+    assert(yielder.statistics().yields > yields);
+
+    // A non-zero result interrupts the statement.
+    db2.set_progress_handler([] { return 1; }, 100);
+    sqlite3pp::command cmd(db2, sql);
+    assert(cmd.execute() == SQLITE_INTERRUPT);
+    assert(!cmd.timed_out());
+}
+
+void test_unlock_notify() {
+    cout << "Testing unlock_notify with shared cache..." << endl;
+    char const* uri = "file:unlock_notify?mode=memory&cache=shared";
+    int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI;
+    sqlite3pp::database writer(uri, flags);
+    sqlite3pp::database reader(uri, flags);
+    assert(reader.enable_unlock_notify() == SQLITE_OK);
+
+    writer.execute("CREATE TABLE test (id INTEGER)");
+    writer.execute("BEGIN");
+    writer.execute("INSERT INTO test VALUES (1)");
+
+    std::atomic<bool> done(false);
+    int count = -1;
+    std::thread t([&] {
+        sqlite3pp::query qry(reader, "SELECT COUNT(*) FROM test");
+        count = (*qry.begin()).get<int>(0);
+        done = true;
+    });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    assert(!done);
+    writer.execute("COMMIT");
+    t.join();
+    assert(count == 1);
+
+    // Transactions wait for the writer too, from BEGIN IMMEDIATE to COMMIT.
+    writer.execute("BEGIN");
+    writer.execute("INSERT INTO test VALUES (2)");
+    done = false;
+    int rc = -1;
+    std::thread t2([&] {
+        sqlite3pp::transaction xct(reader, false, true);
+        assert(reader.execute("INSERT INTO test VALUES (3)") == SQLITE_OK);
+        rc = xct.commit();
+        done = true;
+    });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    assert(!done);
+    writer.execute("COMMIT");
+    t2.join();
+    assert(rc == SQLITE_OK);
+    sqlite3pp::query qry(writer, "SELECT COUNT(*) FROM test");
+    assert((*qry.begin()).get<int>(0) == 3);
+}
+
+void test_sql_profiler() {
+    cout << "Testing SQL profiler..." << endl;
+    assert(sqlite3pp::prof::sql_profiler::normalize("SELECT  a, 'it''s', 1.5e+3, x'00'\n FROM t1 -- note\n WHERE b = 42")
+           == "SELECT a, ?, ?, ? FROM t1 WHERE b = ?");
+
+    sqlite3pp::prof::sql_profiler profiler;
+    sqlite3pp::database db(":memory:");
+    profiler.attach(db);
+    db.execute("CREATE TABLE test (id INTEGER)");
+    db.execute("INSERT INTO test VALUES (1)");
+    db.execute("INSERT INTO test VALUES (2)");
+
+    sqlite3pp::database db2 = std::move(db);
+    db2.execute("INSERT INTO test VALUES (3)");
+
+    auto profiles = profiler.snapshot();
+    bool found = false;
+    for (auto& p : profiles) {
+        if (p.sql == "INSERT INTO test VALUES (?)") {
+            found = true;
+            assert(p.executions == 3);
+            assert(p.latency.count() == 3);
+        }
+    }
+    assert(found);
+
+    profiler.reset();
+    assert(profiler.snapshot().empty());
+}
+
+void test_statement_stats() {
+    cout << "Testing statement stats..." << endl;
+    sqlite3pp::database db(":memory:");
+    db.execute("CREATE TABLE test (id INTEGER, v INTEGER)");
+    db.execute("WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < 100) "
+               "INSERT INTO test SELECT x, x % 10 FROM c");
+    db.enable_statement_stats();
+
+    char const* sql = "SELECT COUNT(*) FROM test WHERE v = ?";
+    sqlite3pp::query qry(db, sql);
+    for (int i = 0; i < 2; ++i) {
+        qry.bind(1, i);
+        assert((*qry.begin()).get<int>(0) == 10);
+        qry.reset();
+    }
+    // The registry does not reset the statement's own counters.
+    assert(qry.stats().runs == 2);
+
+    {
+        sqlite3pp::query join(db, "SELECT COUNT(*) FROM test a JOIN test b ON a.id = b.v");
+        assert((*join.begin()).get<int>(0) == 90);
+        assert(join.stats().autoindexes > 0);
+    }
+
+    auto registry = db.statement_stats_by_sql();
+    auto& s = registry[sql];
+    assert(s.runs == 2);
+    assert(s.fullscan_steps >= 2 * 99);
+    assert(s.vm_steps > 0);
+    assert(s.memory_used > 0);
+    assert(registry.size() == 2);
+
+    db.reset_statement_stats();
+    assert(db.statement_stats_by_sql().empty());
+}
+
+void test_status_exporter() {
+    cout << "Testing database status and exporter..." << endl;
+    sqlite3pp::database db(":memory:");
+    db.execute("CREATE TABLE test (id INTEGER)");
+    db.execute("INSERT INTO test VALUES (1)");
+    auto st = db.status();
+    assert(st.cache_used > 0);
+    assert(st.schema_used > 0);
+
+    std::vector<std::string> exports;
+    std::mutex mutex;
+    sqlite3pp::prof::status_exporter prom(sqlite3pp::prof::status_exporter::prometheus, [&](std::string const& text) {
+        std::lock_guard<std::mutex> lock(mutex);
+        exports.push_back(text);
+    });
+    prom.add(db, "main");
+    prom.export_now();
+    assert(exports.size() == 1);
+    assert(exports[0].find("# TYPE sqlite3pp_cache_hit_total counter") != string::npos);
+    assert(exports[0].find("sqlite3pp_cache_hit_total{db=\"main\"} ") != string::npos);
+    assert(exports[0].find("sqlite3pp_schema_used_bytes{db=\"main\"} ") != string::npos);
+
+    prom.start(std::chrono::milliseconds(5));
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    prom.stop();
+    assert(exports.size() > 2);
+
+    sqlite3pp::prof::status_exporter json(sqlite3pp::prof::status_exporter::json, [](std::string const&) {});
+    json.add(db, "main");
+    assert(json.render().find("{\"main\":{\"cache_hit\":") == 0);
+    json.remove(db);
+    assert(json.render() == "{}\n");
+
+    std::string error;
+    auto on_error = [&](std::string const& message) { error = message; };
+    sqlite3pp::prof::status_exporter::file_sink("status_exporter.prom", on_error)("ok\n");
+    assert(error.empty());
+    std::ifstream in("status_exporter.prom");
+    std::string line;
+    assert(std::getline(in, line) && line == "ok");
+    std::remove("status_exporter.prom");
+
+    sqlite3pp::prof::status_exporter::file_sink("no_such_dir/status.prom", on_error)("ok\n");
+    assert(!error.empty());
+}
+
+void test_slow_query_log() {
+    cout << "Testing slow query log..." << endl;
+    std::vector<sqlite3pp::prof::slow_query_record> records;
+    {
+        sqlite3pp::prof::slow_query_log log(std::chrono::milliseconds(5), [&](sqlite3pp::prof::slow_query_record const& r) {
+            records.push_back(r);
+        });
+
+        sqlite3pp::database db(":memory:");
+        db.execute("CREATE TABLE test (id INTEGER)");
+        log.attach(db);
+
+        char const* sql =
+            "WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < ?) "
+            "SELECT x FROM c ORDER BY x DESC";
+        sqlite3pp::query qry(db, sql);
+        for (int i = 0; i < 2; ++i) {
+            qry.bind(1, 300000);
+            int rows = 0;
+            for (auto i = qry.begin(); i != qry.end(); ++i) {
+                ++rows;
+            }
+            assert(rows == 300000);
+            qry.reset();
+        }
+
+        // Fast statements are not logged.
+        db.execute("INSERT INTO test VALUES (1)");
+        sqlite3pp::command fast(db, "UPDATE test SET id = 2");
+        assert(fast.execute() == SQLITE_OK);
+
+        log.flush();
+        assert(log.dropped() == 0);
+    }
+
+    assert(records.size() == 2);
+    assert(records[0].sql.find("x < 300000") != string::npos);
+    assert(records[0].rows == 300000);
+    assert(records[0].elapsed >= std::chrono::milliseconds(5));
+    assert(records[0].stats.sorts == 1);
+    assert(records[0].plan.find("SCAN c") != string::npos);
+    assert(records[1].plan.empty());
+
+    // Plans are explained again once the text drops out of the plan
+    // cache, and a log destroyed first stops logging.
+    records.clear();
+    sqlite3pp::database db(":memory:");
+    db.execute("CREATE TABLE t (id INTEGER PRIMARY KEY, v INTEGER)");
+    {
+        sqlite3pp::prof::slow_query_log log(std::chrono::nanoseconds(0), [&](sqlite3pp::prof::slow_query_record const& r) {
+            records.push_back(r);
+        }, 1024, 1);
+        log.attach(db);
+        for (int i = 0; i < 2; ++i) {
+            sqlite3pp::command(db, "SELECT * FROM t WHERE id = 1").execute();
+            sqlite3pp::command(db, "SELECT * FROM t WHERE v = 1").execute();
+        }
+        log.flush();
+    }
+    assert(records.size() == 4);
+    for (auto& r : records) {
+        assert(!r.plan.empty());
+    }
+    assert(records[0].plan.find("SEARCH t") != string::npos);
+    assert(records[1].plan.find("SCAN t") != string::npos);
+    sqlite3pp::command(db, "SELECT * FROM t WHERE v = 1").execute();
+    assert(records.size() == 4);
+
+    // The in-memory schema copy follows schema changes, and the log
+    // outlives a database that was moved and destroyed.
+    records.clear();
+    std::unique_ptr<sqlite3pp::prof::slow_query_log> log(new sqlite3pp::prof::slow_query_log(
+        std::chrono::nanoseconds(0), [&](sqlite3pp::prof::slow_query_record const& r) {
+            records.push_back(r);
+        }));
+    std::unique_ptr<sqlite3pp::database> a(new sqlite3pp::database(":memory:"));
+    a->execute("CREATE TABLE t (id INTEGER PRIMARY KEY, v INTEGER)");
+    log->attach(*a);
+    a->execute("CREATE INDEX t_v ON t (v)");
+    sqlite3pp::database b = std::move(*a);
+    a.reset();
+    sqlite3pp::command(b, "SELECT * FROM t WHERE v = 1").execute();
+    log.reset();
+    assert(!records.empty());
+    assert(records.back().plan.find("USING COVERING INDEX t_v") != string::npos);
+    sqlite3pp::command(b, "SELECT * FROM t WHERE v = 2").execute();
+}
+
+void test_index_advisor() {
+    cout << "Testing index advisor..." << endl;
+    sqlite3pp::database db(":memory:");
+    db.execute("CREATE TABLE a (id INTEGER PRIMARY KEY, v INTEGER)");
+    db.execute("CREATE TABLE b (id INTEGER PRIMARY KEY, v INTEGER, w TEXT)");
+    db.execute("WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < 2000) "
+               "INSERT INTO a SELECT x, x % 100 FROM c");
+    db.execute("WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < 2000) "
+               "INSERT INTO b SELECT x, x % 100, 'w' FROM c");
+    db.enable_statement_stats();
+
+    sqlite3pp::query join(db, "SELECT count(*) FROM a x JOIN b y ON y.v = x.v");
+    for (auto i = join.begin(); i != join.end(); ++i) {
+    }
+    sqlite3pp::query scan(db, "SELECT id FROM b WHERE w = ?");
+    scan.bind(1, "w", sqlite3pp::nocopy);
+    for (auto i = scan.begin(); i != scan.end(); ++i) {
+    }
+
+    sqlite3pp::prof::advisor_options opts;
+    opts.validate = true;
+    sqlite3pp::prof::index_advisor advisor(db, opts);
+    auto proposals = advisor.analyze();
+    assert(proposals.size() == 2);
+
+    std::map<std::string, sqlite3pp::prof::index_proposal> by_sql;
+    for (auto& p : proposals) by_sql[p.sql] = p;
+    auto& j = by_sql["SELECT count(*) FROM a x JOIN b y ON y.v = x.v"];
+    assert(j.create_index == "CREATE INDEX \"idx_b_v\" ON \"b\" (\"v\")");
+    assert(j.stats.autoindexes > 0);
+    assert(j.validated && j.after.count() > 0);
+    auto& s = by_sql["SELECT id FROM b WHERE w = ?"];
+    assert(s.create_index == "CREATE INDEX \"idx_b_w\" ON \"b\" (\"w\")");
+    assert(s.sample == "SELECT id FROM b WHERE w = 'w'");
+    assert(s.validated);
+
+    // The advisor's own queries do not land in the registry.
+    assert(db.statement_stats_by_sql().size() == 2);
+
+    // Literal statements can be checked without the registry.
+    proposals = advisor.analyze({"SELECT * FROM a WHERE v = 3"});
+    assert(proposals.size() == 1);
+    assert(proposals[0].create_index == "CREATE INDEX \"idx_a_v\" ON \"a\" (\"v\")");
+
+    assert(sqlite3pp::prof::index_advisor::report(proposals).find("idx_a_v") != string::npos);
+
+    // Only the "sqlite_" prefix is reserved, not any name like it.
+    db.execute("CREATE TABLE sqlitex (v INTEGER)");
+    proposals = advisor.analyze({"SELECT * FROM sqlitex WHERE v = 3"});
+    assert(proposals.size() == 1);
+}
+
+void test_scan_status() {
+    cout << "Testing scan status..." << endl;
+    sqlite3pp::database db(":memory:");
+    db.execute("CREATE TABLE a (id INTEGER PRIMARY KEY, v INTEGER)");
+    db.execute("INSERT INTO a VALUES (1, 1), (2, 2)");
+    sqlite3pp::query qry(db, "SELECT x.id FROM a x JOIN a y ON y.v = x.v");
+    for (auto i = qry.begin(); i != qry.end(); ++i) {
+    }
+    auto nodes = qry.scan_status();
+#ifdef SQLITE_ENABLE_STMT_SCANSTATUS
+    assert(nodes.size() >= 1);
+#else
+    assert(nodes.empty());
+#endif
+    qry.reset_scan_status();
+
+    sqlite3pp::scan_node outer, inner;
+    outer.explain = "SCAN x";
+    outer.loops = 1;
+    outer.rows = 2;
+    outer.estimated_rows = 4;
+    inner.explain = "SEARCH y USING AUTOMATIC COVERING INDEX (v=?)";
+    inner.loops = 2;
+    inner.rows = 2;
+    inner.estimated_rows = 10;
+    inner.cycles = 500;
+    outer.children.push_back(inner);
+    assert(sqlite3pp::format_scan_status({outer}) ==
+           "SCAN x  (loops=1 rows=2 est=4)\n"
+           "  SEARCH y USING AUTOMATIC COVERING INDEX (v=?)  (loops=2 rows=2 est=20 cycles=500)\n");
+}
+
+void test_change_feed() {
+    cout << "Testing change feed..." << endl;
+    sqlite3pp::database db(":memory:");
+    db.execute("CREATE TABLE test (id INTEGER PRIMARY KEY, v TEXT)");
+    sqlite3pp::change_feed feed(2);
+    assert(feed.attach(db) == SQLITE_OK);
+    assert(feed.attach(db) == SQLITE_MISUSE);
+
+    std::vector<sqlite3pp::change_feed::batch> received;
+    std::thread consumer([&] {
+        sqlite3pp::change_feed::batch b;
+        while (received.size() < 2 && feed.pop(b, std::chrono::seconds(5))) {
+            received.push_back(b);
+        }
+    });
+
+    db.execute("INSERT INTO test VALUES (1, 'a')");
+    {
+        sqlite3pp::transaction xct(db);
+        db.execute("INSERT INTO test VALUES (2, 'b')");
+        db.execute("DELETE FROM test WHERE id = 2");
+        xct.rollback();
+    }
+    {
+        sqlite3pp::transaction xct(db);
+        db.execute("UPDATE test SET v = 'c' WHERE id = 1");
+        db.execute("INSERT INTO test VALUES (3, 'd')");
+        xct.commit();
+    }
+    consumer.join();
+
+    assert(received.size() == 2);
+    assert(received[0].size() == 1);
+    assert(received[0][0].op == SQLITE_INSERT && received[0][0].table == "test" && received[0][0].rowid == 1);
+    assert(received[1].size() == 2);
+    assert(received[1][0].op == SQLITE_UPDATE && received[1][0].dbname == "main");
+    assert(received[1][1].op == SQLITE_INSERT && received[1][1].rowid == 3);
+
+    // With nobody consuming, batches beyond the capacity are dropped.
+    for (int i = 10; i < 13; ++i) {
+        db.executef("INSERT INTO test VALUES (%d, 'x')", i);
+    }
+    assert(feed.dropped() == 1);
+
+    // A commit that fails is never published.
+    sqlite3pp::database vetoed(":memory:");
+    vetoed.execute("CREATE TABLE test (id INTEGER PRIMARY KEY)");
+    sqlite3pp::change_feed vfeed;
+    assert(vfeed.attach(vetoed) == SQLITE_OK);
+    vetoed.set_commit_handler([] { return 1; });
+    assert(vetoed.execute("INSERT INTO test VALUES (1)") != SQLITE_OK);
+    assert(sqlite3pp::command(vetoed, "INSERT INTO test VALUES (2)").execute() != SQLITE_OK);
+    sqlite3pp::change_feed::batch b;
+    assert(!vfeed.try_pop(b));
+    vetoed.set_commit_handler(sqlite3pp::database::commit_handler());
+    assert(sqlite3pp::command(vetoed, "INSERT INTO test VALUES (3)").execute() == SQLITE_OK);
+    assert(vfeed.try_pop(b) && b.size() == 1 && b[0].rowid == 3);
+}
+
+void test_plan_harness() {
+    cout << "Testing plan regression harness..." << endl;
+    sqlite3pp::database db(":memory:");
+    db.execute("CREATE TABLE t (id INTEGER PRIMARY KEY, v INTEGER, w TEXT)");
+    db.execute("WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < 50000) "
+               "INSERT INTO t SELECT x, x % 1000, 'w' FROM c");
+    db.execute("CREATE INDEX t_v ON t (v)");
+
+    std::istringstream file(
+        "-- lookups\n"
+        "SELECT count(*) FROM t\n"
+        "  WHERE v = ?;\n"
+        "-- params: 7\n"
+        "-- params: 8\n"
+        "UPDATE t SET w = ? WHERE id = 1; -- not 'a' statement\n"
+        "-- params: 'x'\n");
+    auto workload = sqlite3pp::prof::load_workload(file);
+    assert(workload.size() == 3);
+    assert(workload[0].sql == "SELECT count(*) FROM t\nWHERE v = ?");
+    assert(workload[1].params == "8");
+    assert(workload[2].sql == "UPDATE t SET w = ? WHERE id = 1");
+    assert(workload[2].params == "'x'");
+
+    sqlite3pp::prof::harness_options opts;
+    opts.runs = 5;
+    opts.min_delta = std::chrono::nanoseconds(0);
+    sqlite3pp::prof::plan_harness harness(db, opts);
+
+    sqlite3pp::database store(":memory:");
+    assert(sqlite3pp::prof::plan_harness::save(store, harness.run(workload)) == SQLITE_OK);
+    auto baseline = sqlite3pp::prof::plan_harness::load(store);
+    assert(baseline.size() == 3);
+
+    // The update ran in a rolled back savepoint.
+    sqlite3pp::query w(db, "SELECT w FROM t WHERE id = 1");
+    assert((*w.begin()).get<std::string>(0) == "w");
+    w.finish();
+
+    auto same = harness.compare(baseline, harness.run(workload));
+    assert(same.size() == 3 && !same[0].plan_changed);
+
+    db.execute("DROP INDEX t_v");
+    auto diffs = harness.compare(baseline, harness.run(workload));
+    assert(diffs.size() == 3);
+    for (auto& d : diffs) {
+        if (d.current.sql.find("count") == string::npos) continue;
+        assert(d.plan_changed);
+        assert(d.regressed && d.slowdown > 1.5);
+        assert(d.baseline.plan.find("USING COVERING INDEX t_v") != string::npos);
+    }
+    assert(sqlite3pp::prof::plan_harness::report(diffs).find("REGRESSED") != string::npos);
+
+    // Parameters are parsed as literals and bound, never run as SQL.
+    std::string seen;
+    sqlite3pp::ext::function func(db);
+    func.create<int (string)>("seen", [&](string s) { seen += s + "|"; return 1; });
+    std::istringstream typed(
+        "SELECT seen(typeof(?1) || typeof(?2) || typeof(?3) || typeof(?4) || typeof(?5)), seen(?1), seen(hex(?2)), seen(?4 + ?5);\n"
+        "-- params: 'it''s', X'00ff', NULL, -2, 1.5e1\n");
+    opts.runs = 1;
+    sqlite3pp::prof::plan_harness once(db, opts);
+    once.run(sqlite3pp::prof::load_workload(typed));
+    assert(seen == "textblobnullintegerreal|it's|00FF|13.0|");
+    std::istringstream injected("SELECT ?;\n-- params: 1 FROM sqlite_master\n");
+    bool thrown = false;
+    try {
+        once.run(sqlite3pp::prof::load_workload(injected));
+    } catch (sqlite3pp::database_error&) {
+        thrown = true;
+    }
+    assert(thrown);
+}
+
+void test_materialize() {
+    cout << "Testing materialized result sets..." << endl;
+    sqlite3pp::database db(":memory:");
+    db.execute("CREATE TABLE t (id INTEGER, name TEXT, score REAL, data BLOB)");
+    db.execute("WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < 1000) "
+               "INSERT INTO t SELECT x, 'name' || x, x / 2.0, CASE WHEN x % 2 THEN x'0102' END FROM c");
+
+    sqlite3pp::arena a(4096);
+    sqlite3pp::query qry(db, "SELECT id, name, score, data FROM t ORDER BY id");
+    auto rs = qry.materialize(a);
+    assert(rs.size() == 1000);
+    assert(rs.column_count() == 4);
+    assert(rs.column_name(1).str() == "name");
+
+    // Rows stay valid after the statement moved on.
+    qry.reset();
+    auto r = rs[41];
+    assert(r[0].type == SQLITE_INTEGER && r[0].i == 42);
+    assert(r[1].type == SQLITE_TEXT && r[1].text.str() == "name42" && r[1].text.data[6] == '\0');
+    assert(r[2].type == SQLITE_FLOAT && r[2].d == 21.0);
+    assert(rs[41][3].type == SQLITE_NULL);
+    assert(rs[42][3].type == SQLITE_BLOB && rs[42][3].blob.size == 2);
+    assert(static_cast<unsigned char const*>(rs[42][3].blob.data)[1] == 2);
+
+    auto reserved = a.bytes_reserved();
+    assert(a.bytes_used() > 0 && reserved >= a.bytes_used());
+
+    // Reusing the arena does not allocate again.
+    a.reset();
+    assert(a.bytes_used() == 0);
+    rs = qry.materialize(a);
+    assert(rs.size() == 1000 && rs[999][0].i == 1000);
+    assert(a.bytes_reserved() == reserved);
+
+    // Large values get their own block.
+    auto big = a.allocate(100000, 64);
+    assert(reinterpret_cast<std::uintptr_t>(big) % 64 == 0);
+}
+
+void test_value() {
+    cout << "Testing dynamic values..." << endl;
+    sqlite3pp::value n;
+    assert(n.is_null() && n.type() == SQLITE_NULL);
+
+    sqlite3pp::value i(42), d(2.5), s("short"), l(std::string(100, 'x'));
+    assert(i.as_int() == 42 && i.as_double() == 42.0);
+    assert(d.as_double() == 2.5 && d.as_int() == 2);
+    assert(s.is_inline() && s.as_text().str() == "short" && s.as_text().data[5] == '\0');
+    assert(!l.is_inline() && !l.is_borrowed() && l.as_text().size == 100);
+    assert(sqlite3pp::value(7L).as_int() == 7 && sqlite3pp::value(7u).as_int() == 7);
+    assert(sqlite3pp::value(std::size_t(7)).type() == SQLITE_INTEGER);
+    sqlite3pp::value huge(std::numeric_limits<unsigned long long>::max());
+    assert(huge.type() == SQLITE_FLOAT && huge.as_double() > 1e19);
+
+    std::string src = "a borrowed string longer than the buffer";
+    sqlite3pp::value b(src, sqlite3pp::nocopy);
+    assert(b.is_borrowed() && b.as_text().data == src.data());
+
+    // Copies own their data unless it was borrowed; moves steal it.
+    sqlite3pp::value lc(l);
+    assert(lc.as_text().data != l.as_text().data && lc.as_text().str() == l.as_text().str());
+    sqlite3pp::value lm(std::move(l));
+    assert(lm.as_text().size == 100 && l.is_null());
+    sqlite3pp::value bc = b;
+    assert(bc.is_borrowed() && bc.as_text().data == src.data());
+    s = lc;
+    assert(s.as_text().size == 100);
+
+    sqlite3pp::database db(":memory:");
+    db.execute("CREATE TABLE t (v)");
+    sqlite3pp::command cmd(db, "INSERT INTO t VALUES (?)");
+    unsigned char bytes[] = { 0, 1, 2 };
+    std::vector<sqlite3pp::value> in = { n, i, d, sqlite3pp::value("text"), lm,
+                                         sqlite3pp::value(sqlite3pp::blob_view{bytes, 3}),
+                                         sqlite3pp::value(sqlite3pp::blob_view{nullptr, 0}) };
+    for (auto const& v : in) {
+        cmd.reset();
+        assert(cmd.bind(1, v) == SQLITE_OK);
+        assert(cmd.execute() == SQLITE_OK);
+    }
+
+    sqlite3pp::query qry(db, "SELECT v FROM t ORDER BY rowid");
+    std::size_t k = 0;
+    for (auto row : qry) {
+        auto v = row.get_value(0, sqlite3pp::nocopy);
+        assert(v.type() == in[k].type());
+        auto a = v.as_blob(), e = in[k].as_blob();
+        assert(a.size == e.size && (a.size == 0 || std::memcmp(a.data, e.data, a.size) == 0));
+        assert(v.as_int() == in[k].as_int());
+        if (v.type() == SQLITE_TEXT || v.type() == SQLITE_BLOB) {
+            assert(v.is_inline() || v.is_borrowed());
+            assert(!row.get_value(0).is_borrowed() && !row.get<sqlite3pp::value>(0).is_borrowed());
+        }
+        ++k;
+    }
+    assert(k == in.size());
+}
+
+void test_pragmas() {
+    cout << "Testing pragma settings..." << endl;
+    char const* path = "/tmp/sqlite3pp_pragma_test.db";
+    std::remove(path);
+    {
+        sqlite3pp::database db(path);
+        auto before = db.pragmas();
+        assert(before.journal.set && before.journal.value == sqlite3pp::journal_delete);
+        assert(before.synchronous.value == sqlite3pp::synchronous_full);
+
+        {
+            sqlite3pp::pragma_scope scope(db, sqlite3pp::pragma_settings::oltp());
+            auto now = db.pragmas();
+            assert(now.journal.value == sqlite3pp::journal_wal);
+            assert(now.synchronous.value == sqlite3pp::synchronous_normal);
+            assert(now.cache_size.value == -64 * 1024);
+            assert(now.temp_store.value == sqlite3pp::temp_store_memory);
+            assert(now.busy_timeout.value == 5000);
+            assert(db.execute("CREATE TABLE t (x)") == SQLITE_OK);
+        }
+        auto after = db.pragmas();
+        assert(after.journal.value == sqlite3pp::journal_delete);
+        assert(after.synchronous.value == before.synchronous.value);
+        assert(after.cache_size.value == before.cache_size.value);
+        assert(after.busy_timeout.value == before.busy_timeout.value);
+
+        assert(db.set_threads(2) == SQLITE_OK);
+        assert(db.set_limit(sqlite3pp::limit_variable_number, 100) > 100);
+        assert(db.limit(sqlite3pp::limit_variable_number) == 100);
+        assert(db.set_mmap_size(1 << 20) == SQLITE_OK);
+    }
+    std::remove(path);
+
+    // WAL is refused for in-memory databases; nothing else stays changed.
+    sqlite3pp::database mem(":memory:");
+    auto page_size = mem.pragmas().page_size.value;
+    sqlite3pp::pragma_settings s;
+    s.page_size = page_size * 2;
+    s.journal = sqlite3pp::journal_wal;
+    int restored = -1;
+    assert(mem.apply_pragmas(s, &restored) == SQLITE_ERROR);
+    assert(restored == SQLITE_OK);
+    assert(mem.pragmas().page_size.value == page_size);
+    try {
+        sqlite3pp::pragma_scope scope(mem, s);
+        assert(false);
+    } catch (sqlite3pp::database_error&) {
+    }
+    assert(mem.pragmas().page_size.value == page_size);
+
+    // A busy timeout replaces the busy handler, also after a move.
+    int busy_calls = 0;
+    mem.set_busy_handler([&](int) { ++busy_calls; return 0; });
+    sqlite3pp::pragma_settings timeout;
+    timeout.busy_timeout = 10;
+    assert(mem.apply_pragmas(timeout) == SQLITE_OK);
+    sqlite3pp::database moved(std::move(mem));
+    assert(moved.pragmas().busy_timeout.value == 10);
+    {
+        sqlite3pp::pragma_scope scope(moved, sqlite3pp::pragma_settings());
+        assert(scope.revert() == SQLITE_OK);
+        assert(scope.revert() == SQLITE_OK);
+    }
+}
+
+void test_bulk_load_session() {
+    cout << "Testing bulk load sessions..." << endl;
+    char const* path = "/tmp/sqlite3pp_bulk_test.db";
+    std::remove(path);
+    sqlite3pp::database db(path);
+    db.execute("CREATE TABLE t (id INTEGER PRIMARY KEY, k TEXT UNIQUE, v INTEGER)");
+    db.execute("CREATE INDEX t_v ON t (v)");
+    db.execute("CREATE INDEX \"t \"\"w\"\"\" ON t (v, k)");
+    db.execute("CREATE UNIQUE INDEX t_vid ON t (v, id)");
+    db.execute("CREATE INDEX t_big ON t (v) WHERE v > 5");
+    db.execute("CREATE TABLE other (x)");
+    db.execute("CREATE INDEX other_x ON other (x)");
+    auto before = db.pragmas();
+    auto threads = db.limit(sqlite3pp::limit_worker_threads);
+    // The limit is capped at SQLITE_MAX_WORKER_THREADS.
+    db.set_limit(sqlite3pp::limit_worker_threads, 1000);
+    int max_threads = db.limit(sqlite3pp::limit_worker_threads);
+    db.set_limit(sqlite3pp::limit_worker_threads, threads);
+
+    auto count_indexes = [&db]() {
+        sqlite3pp::query qry(db, "SELECT count(*) FROM sqlite_master WHERE type = 'index'");
+        return (*qry.begin()).get<int>(0);
+    };
+    assert(count_indexes() == 6);
+
+    {
+        sqlite3pp::bulk_load_session session(db, { "T" }, 2);
+        assert(session.index_sql().size() == 2);
+        // UNIQUE, partial and constraint indexes and the other table's
+        // index are kept.
+        assert(count_indexes() == 4);
+        assert(db.pragmas().synchronous.value == sqlite3pp::synchronous_off);
+        assert(db.limit(sqlite3pp::limit_worker_threads) == std::min(2, max_threads));
+
+        sqlite3pp::transaction xct(db);
+        sqlite3pp::command cmd(db, "INSERT INTO t (k, v) VALUES (?, ?)");
+        for (int i = 0; i < 1000; ++i) {
+            cmd.reset();
+            cmd.binder() << std::to_string(i) << i % 7;
+            assert(cmd.execute() == SQLITE_OK);
+        }
+        assert(xct.commit() == SQLITE_OK);
+        assert(session.finish() == SQLITE_OK);
+    }
+    assert(count_indexes() == 6);
+    auto after = db.pragmas();
+    assert(after.journal.value == before.journal.value);
+    assert(after.synchronous.value == before.synchronous.value);
+    assert(after.threads.value == before.threads.value);
+    assert(db.limit(sqlite3pp::limit_worker_threads) == threads);
+
+    // Indexes and settings come back when the load throws.
+    try {
+        sqlite3pp::bulk_load_session session(db, { "t", "other" });
+        assert(count_indexes() == 3);
+        throw std::runtime_error("load failed");
+    } catch (std::runtime_error&) {
+    }
+    assert(count_indexes() == 6);
+    assert(db.pragmas().synchronous.value == before.synchronous.value);
+
+    // A failed rebuild is rolled back and can be retried.
+    {
+        sqlite3pp::bulk_load_session session(db, { "t", "other" });
+        db.execute("DROP TABLE other");
+        assert(session.finish() != SQLITE_OK);
+        assert(db.autocommit());
+        assert(count_indexes() == 3);
+        assert(db.pragmas().synchronous.value == sqlite3pp::synchronous_off);
+        db.execute("CREATE TABLE other (x)");
+        assert(session.finish() == SQLITE_OK);
+    }
+    assert(count_indexes() == 6);
+    assert(db.pragmas().synchronous.value == before.synchronous.value);
+
+    auto saved_table = [&db]() {
+        sqlite3pp::query qry(db, "SELECT count(*) FROM sqlite_master WHERE name = 'sqlite3pp_bulk_load'");
+        return (*qry.begin()).get<int>(0) == 1;
+    };
+    assert(!saved_table());
+
+    // A transaction left open is rolled back before the rebuild.
+    {
+        sqlite3pp::bulk_load_session session(db, { "t" });
+        db.execute("BEGIN");
+        db.execute("INSERT INTO t (k, v) VALUES ('open', 1)");
+    }
+    assert(db.autocommit());
+    assert(count_indexes() == 6);
+
+    // Indexes that could not be rebuilt stay saved until recover().
+    {
+        sqlite3pp::bulk_load_session session(db, { "t", "other" });
+        assert(saved_table());
+        db.execute("DROP TABLE other");
+    }
+    assert(count_indexes() == 3);
+    assert(saved_table());
+    assert(db.pragmas().synchronous.value == before.synchronous.value);
+    assert(sqlite3pp::bulk_load_session::recover(db) == SQLITE_OK);
+    assert(count_indexes() == 5);
+    assert(!saved_table());
+    assert(sqlite3pp::bulk_load_session::recover(db) == SQLITE_OK);
+    db.execute("CREATE TABLE other (x)");
+    db.execute("CREATE INDEX other_x ON other (x)");
+
+    // Sessions refuse to start inside a transaction.
+    {
+        sqlite3pp::transaction xct(db);
+        bool thrown = false;
+        try {
+            sqlite3pp::bulk_load_session session(db, { "t" });
+        } catch (sqlite3pp::database_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+        assert(count_indexes() == 6);
+    }
+    std::remove(path);
+}
+
+void test_serialize() {
+    cout << "Testing serialized images..." << endl;
+    sqlite3pp::database src(":memory:");
+    src.execute("CREATE TABLE t (id INTEGER PRIMARY KEY, name TEXT)");
+    src.execute("WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < 500) "
+                "INSERT INTO t SELECT x, 'name' || x FROM c");
+    auto image = src.serialize();
+    assert(!image.empty() && image.size() > 0);
+
+    auto count = [](sqlite3pp::database& db) {
+        sqlite3pp::query qry(db, "SELECT count(*) FROM t");
+        return (*qry.begin()).get<int>(0);
+    };
+
+    // A copy is writable and can grow.
+    sqlite3pp::database copy(":memory:");
+    assert(copy.deserialize(image.data(), image.size()) == SQLITE_OK);
+    assert(count(copy) == 500);
+    assert(copy.execute("INSERT INTO t (name) SELECT name FROM t") == SQLITE_OK);
+    assert(count(copy) == 1000);
+
+    // A read-only image is used in place.
+    sqlite3pp::database ro(":memory:");
+    assert(ro.deserialize(image.data(), image.size(), sqlite3pp::deserialize_read_only) == SQLITE_OK);
+    assert(count(ro) == 500);
+    assert(ro.execute("DELETE FROM t") == SQLITE_READONLY);
+
+    char const* path = "/tmp/sqlite3pp_image_test.db";
+    auto f = std::fopen(path, "wb");
+    assert(f && std::fwrite(image.data(), 1, image.size(), f) == image.size());
+    std::fclose(f);
+
+    sqlite3pp::database mapped(":memory:");
+    assert(mapped.deserialize_file(path, sqlite3pp::deserialize_read_only) == SQLITE_OK);
+    std::remove(path);
+    assert(count(mapped) == 500);
+    assert(mapped.execute("DELETE FROM t") == SQLITE_READONLY);
+    // The mapping moves with the connection.
+    sqlite3pp::database moved(std::move(mapped));
+    assert(count(moved) == 500);
+
+    // An attached image goes away with its schema.
+    f = std::fopen(path, "wb");
+    assert(f && std::fwrite(image.data(), 1, image.size(), f) == image.size());
+    std::fclose(f);
+    assert(moved.attach(":memory:", "aux") == SQLITE_OK);
+    assert(moved.deserialize_file(path, sqlite3pp::deserialize_read_only, "aux") == SQLITE_OK);
+    std::remove(path);
+    assert(moved.detach("AUX") == SQLITE_OK);
+
+    // A statement left open keeps the image mapped after disconnect().
+    sqlite3pp::query left(moved, "SELECT count(*) FROM t");
+    assert(moved.disconnect() == SQLITE_OK);
+    assert(left.step() == SQLITE_ROW);
+    left.finish();
+
+    assert(copy.deserialize_file(path) == SQLITE_CANTOPEN);
+    assert(count(copy) == 1000);
+}
+
+void test_memory_budget() {
+    cout << "Testing memory budget..." << endl;
+    char const* paths[] = { "/tmp/sqlite3pp_budget_a.db", "/tmp/sqlite3pp_budget_b.db", "/tmp/sqlite3pp_budget_c.db" };
+    std::vector<std::unique_ptr<sqlite3pp::database> > dbs;
+    for (auto path : paths) {
+        std::remove(path);
+        dbs.emplace_back(new sqlite3pp::database(path));
+        dbs.back()->execute("PRAGMA cache_size = -4000");
+        dbs.back()->execute("CREATE TABLE t (v BLOB)");
+        dbs.back()->execute("WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < 2000) "
+                            "INSERT INTO t SELECT randomblob(1000) FROM c");
+    }
+
+    std::vector<sqlite3pp::release_event> events;
+    {
+        // Nothing to do while under budget.
+        sqlite3pp::memory_budget roomy(1LL << 40);
+        assert(roomy.enforce() == 0);
+    }
+
+    auto used = sqlite3_memory_used();
+    sqlite3pp::memory_budget budget(used - 3000000, [&](sqlite3pp::release_event const& e) {
+        events.push_back(e);
+    });
+    budget.add(*dbs[0], "a");
+    budget.add(*dbs[1], "b");
+    budget.add(*dbs[2], "c");
+
+    // Touch a and c, so that b is the least recently used.
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    for (auto i : {0, 2}) {
+        sqlite3pp::query qry(*dbs[i], "SELECT count(*) FROM t");
+        qry.begin();
+    }
+
+    auto released = budget.enforce();
+    assert(released > 0);
+    assert(!events.empty());
+    assert(events[0].name == "b");
+    assert(events[0].cache_before > events[0].cache_after);
+    assert(sqlite3_memory_used() < used);
+
+    budget.remove(*dbs[1]);
+    dbs.clear();
+    for (auto path : paths) std::remove(path);
+}
+
+void test_pool_allocator() {
+    cout << "Testing pool allocator..." << endl;
+    assert(sqlite3_shutdown() == SQLITE_OK);
+    sqlite3pp::pool_options opts;
+    opts.thread_cache_blocks = 8;
+    assert(sqlite3pp::config::use_pool_allocator(opts) == SQLITE_OK);
+
+    auto work = [] {
+        sqlite3pp::database db(":memory:");
+        db.execute("CREATE TABLE t (id INTEGER PRIMARY KEY, v TEXT)");
+        sqlite3pp::command cmd(db, "INSERT INTO t (v) VALUES (?)");
+        for (int i = 0; i < 2000; ++i) {
+            cmd.bind(1, std::string(i % 300, 'x'), sqlite3pp::copy);
+            assert(cmd.execute() == SQLITE_OK);
+            cmd.reset();
+        }
+        sqlite3pp::query qry(db, "SELECT v FROM t ORDER BY v");
+        for (auto i = qry.begin(); i != qry.end(); ++i) {
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i) threads.emplace_back(work);
+    for (auto& t : threads) t.join();
+    work();
+
+    // A connection closed by a thread_local destructor after the thread's
+    // cache is gone frees into the shared lists.
+    struct late_close {
+        std::unique_ptr<sqlite3pp::database> db;
+    };
+    std::thread([] {
+        static thread_local late_close late;
+        late.db.reset(new sqlite3pp::database(":memory:"));
+        late.db->execute("CREATE TABLE t (v TEXT)");
+    }).join();
+
+    sqlite3pp::pool_options other = opts;
+    assert(sqlite3pp::config::use_pool_allocator(opts) == SQLITE_OK);
+    other.chunk_size *= 2;
+    assert(sqlite3pp::config::use_pool_allocator(other) == SQLITE_MISUSE);
+
+    auto st = sqlite3pp::config::pool_statistics();
+    assert(st.pooled_allocations > 1000);
+    assert(st.fallback_allocations > 0);
+    assert(st.frees > 0);
+    assert(st.chunk_bytes > 0);
+    assert(st.live_reserved >= st.live_requested);
+    assert(st.internal_fragmentation() >= 0.0 && st.internal_fragmentation() < 1.0);
+    assert(st.external_fragmentation() >= 0.0 && st.external_fragmentation() <= 1.0);
+}
+
+void test_page_cache() {
+    cout << "Testing page cache and lookaside configuration..." << endl;
+    assert(sqlite3_shutdown() == SQLITE_OK);
+    assert(sqlite3pp::config::page_cache_header_size() > 0);
+    assert(sqlite3pp::config::use_page_cache(4096, 32, sqlite3pp::transparent_huge_pages) == SQLITE_OK);
+
+    {
+        // The lookaside buffer must outlive the connection.
+        sqlite3pp::mapped_buffer buf(128 * 64);
+        sqlite3pp::database db(":memory:");
+        assert(db.configure_lookaside(128, 64, buf.data()) == SQLITE_OK);
+        db.execute("CREATE TABLE t (v TEXT)");
+        db.execute("INSERT INTO t VALUES (randomblob(100))");
+
+        auto st = sqlite3pp::config::page_cache_statistics();
+        assert(st.slots == 32 && st.slot_size >= 4096);
+        assert(st.used.current > 0);
+        assert(st.sufficient());
+
+        // More pages than slots spill to the heap.
+        db.execute("WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < 200) "
+                   "INSERT INTO t SELECT randomblob(1000) FROM c");
+        st = sqlite3pp::config::page_cache_statistics();
+        assert(st.used.current > 0 && st.used.current <= 32);
+        assert(!st.sufficient() && st.overflow.current > 0);
+    }
+
+    // Leave later tests on the default page cache.
+    assert(sqlite3_shutdown() == SQLITE_OK);
+    assert(sqlite3_config(SQLITE_CONFIG_PAGECACHE, nullptr, 0, 0) == SQLITE_OK);
+}
+
+void test_shared_page_cache() {
+    cout << "Testing shared page cache..." << endl;
+    assert(sqlite3_shutdown() == SQLITE_OK);
+    long long const budget = 64 * 4096;
+    assert(sqlite3pp::config::use_shared_page_cache(budget, 4) == SQLITE_OK);
+
+    char const* path = "/tmp/sqlite3pp_pcache_test.db";
+    std::remove(path);
+    {
+        sqlite3pp::database db(path);
+        db.execute("CREATE TABLE t (id INTEGER PRIMARY KEY, v BLOB)");
+        db.execute("WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < 2000) "
+                   "INSERT INTO t SELECT x, randomblob(900) FROM c");
+    }
+
+    auto reader = [path] {
+        sqlite3pp::database db(path);
+        for (int i = 0; i < 3; ++i) {
+            sqlite3pp::query qry(db, "SELECT count(*), sum(length(v)) FROM t");
+            auto row = *qry.begin();
+            assert(row.get<int>(0) == 2000);
+            assert(row.get<long long int>(1) == 2000LL * 900);
+        }
+        sqlite3pp::query hot(db, "SELECT v FROM t WHERE id = ?");
+        for (int i = 0; i < 200; ++i) {
+            hot.bind(1, i % 10 + 1);
+            assert(hot.begin() != hot.end());
+            hot.reset();
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i) threads.emplace_back(reader);
+    for (auto& t : threads) t.join();
+
+    auto st = sqlite3pp::config::shared_page_cache_statistics();
+    assert(st.budget == budget);
+    assert(st.evictions > 0);
+    assert(st.hits > 0 && st.hit_rate() > 0.0 && st.hit_rate() < 1.0);
+    // Everything was closed, so every page was released.
+    assert(st.pages == 0 && st.bytes == 0);
+    std::remove(path);
+}
+
+void test_memory_accounting() {
+    cout << "Testing memory accounting..." << endl;
+    // Earlier tests have initialized SQLite; allocator changes need a restart.
+    assert(sqlite3_shutdown() == SQLITE_OK);
+    assert(sqlite3pp::enable_memory_accounting() == SQLITE_OK);
+    assert(sqlite3pp::enable_memory_accounting() == SQLITE_OK);
+
+    sqlite3pp::database small(":memory:");
+    sqlite3pp::database large(":memory:");
+    small.execute("CREATE TABLE t (v TEXT)");
+    large.execute("CREATE TABLE t (v TEXT)");
+    large.execute("WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < 5000) "
+                  "INSERT INTO t SELECT printf('%0200d', x) FROM c");
+
+    auto s = small.memory();
+    auto l = large.memory();
+    assert(s.current > 0 && s.allocations > 0);
+    assert(l.current > s.current + 500000);
+    assert(l.highwater >= l.current);
+
+    auto before = l.current;
+    {
+        sqlite3pp::query qry(large, "SELECT v FROM t ORDER BY v DESC");
+        for (auto i = qry.begin(); i != qry.end(); ++i) {
+        }
+    }
+    assert(large.memory().highwater > before);
+
+    auto g = sqlite3pp::global_memory_status();
+    assert(g.memory_used.current >= l.current + s.current);
+    assert(g.malloc_count.current > 0);
+
+    // Moving a connection keeps its account.
+    sqlite3pp::database moved(std::move(large));
+    assert(moved.memory().current > 0);
+    assert(large.memory().current == 0);
+
+    // Copies made by bind() and by column type conversions are charged
+    // to the connection as well.
+    sqlite3pp::database conv(":memory:");
+    auto base = conv.memory().current;
+    sqlite3pp::query qry(conv, "SELECT ?");
+    qry.bind(1, std::string(100000, 'x'), sqlite3pp::copy);
+    assert(conv.memory().current >= base + 100000);
+    auto row = *qry.begin();
+    auto bound = conv.memory().current;
+    assert(row.get<char16_t const*>(0) != nullptr);
+    assert(conv.memory().current >= bound + 200000);
+}
+
 int main() {
     try {
         test_database_basic();
@@ -269,6 +1528,29 @@ int main() {
         test_errors();
         test_attach_backup();
         test_borrow();
+        test_busy_backoff();
+        test_single_thread_database();
+        test_deadline();
+        test_progress_handler();
+        test_unlock_notify();
+        test_sql_profiler();
+        test_statement_stats();
+        test_status_exporter();
+        test_slow_query_log();
+        test_index_advisor();
+        test_scan_status();
+        test_change_feed();
+        test_plan_harness();
+        test_materialize();
+        test_value();
+        test_pragmas();
+        test_bulk_load_session();
+        test_serialize();
+        test_memory_budget();
+        test_pool_allocator();
+        test_page_cache();
+        test_shared_page_cache();
+        test_memory_accounting();
         cout << "All tests passed successfully!" << endl;
     } catch (exception& e) {
         cerr << "Test failed with exception: " << e.what() << endl;
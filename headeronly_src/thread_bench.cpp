@@ -0,0 +1,80 @@
+// Times CREATE INDEX and a large ORDER BY with 1..N sorter threads
+// (limit_worker_threads), to pick the value for bulk_load_session.
+//
+//   thread_bench [max_threads] [rows]
+//
+// The table lives in a temporary file database so that sorts spill the
+// way they do on real data.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include "sqlite3pp.h"
+
+using namespace std;
+
+namespace {
+
+template <class F>
+double time_ms(F f) {
+    auto start = chrono::steady_clock::now();
+    f();
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+    int rows = argc > 2 ? atoi(argv[2]) : 1000000;
+    if (max_threads < 1 || rows < 1) {
+        cerr << "usage: " << argv[0] << " [max_threads] [rows]" << endl;
+        return 2;
+    }
+
+    string path = "thread_bench.db";
+    remove(path.c_str());
+    try {
+        sqlite3pp::database db(path.c_str());
+        // Small enough that the sorts do not fit in memory.
+        db.execute("PRAGMA cache_size = -16384");
+        db.execute("CREATE TABLE t (id INTEGER PRIMARY KEY, k TEXT, v INTEGER)");
+        sqlite3pp::command fill(db,
+                                "WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c WHERE x < ?) "
+                                "INSERT INTO t (k, v) SELECT hex(randomblob(16)), abs(random()) % 1000000 FROM c");
+        fill.bind(1, rows);
+        if (fill.execute() != SQLITE_OK) {
+            cerr << db.error_msg() << endl;
+            return 2;
+        }
+
+        db.set_limit(sqlite3pp::limit_worker_threads, max_threads);
+        int cap = db.limit(sqlite3pp::limit_worker_threads);
+        if (cap < max_threads) {
+            cout << "limit_worker_threads is capped at " << cap << " by SQLITE_MAX_WORKER_THREADS" << endl;
+        }
+
+        cout << "threads  create index ms  order by ms" << endl;
+        for (int threads = 1; threads <= max_threads; ++threads) {
+            db.set_limit(sqlite3pp::limit_worker_threads, threads);
+            auto create = time_ms([&] {
+                db.execute("CREATE INDEX t_k ON t (k)");
+            });
+            db.execute("DROP INDEX t_k");
+            auto order = time_ms([&] {
+                sqlite3pp::query qry(db, "SELECT k, v FROM t ORDER BY v, k");
+                for (auto i = qry.begin(); i != qry.end(); ++i) {
+                }
+            });
+            cout << threads << "\t " << create << "\t\t  " << order << endl;
+        }
+    } catch (exception& e) {
+        cerr << e.what() << endl;
+        remove(path.c_str());
+        return 2;
+    }
+    remove(path.c_str());
+    return 0;
+}